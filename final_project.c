@@ -1,104 +1,215 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <time.h>
-#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <stdarg.h>
+#include "sacco_ledger.h"
 
 // Constants
-#define MAX_FARMERS 100
-#define MAX_TRANSACTIONS 1000
-#define PASSWORD_LENGTH 4
-#define HASH_TABLE_SIZE 101
+#define RECENT_ACTIVITY_ROWS 10       // Rows shown on the statistics screen
+#define INGEST_MAGIC "SACCOIN2"        // First bytes of a binary ingest file
+#define INGEST_BATCH 4096              // Ingested records applied per settlement wait
+#define INGEST_MAX_ERRORS_SHOWN 10     // Rejected ingest records printed individually
+#define SERVER_LINE_MAX 512            // Longest protocol request line
+#define SERVER_REPLY_MAX 256           // Longest reply held back until settlement
+#define SERVER_EVENTS 256              // epoll events handled per wakeup
+#define SERVER_STATEMENT_DEFAULT 10    // Rows STATEMENT returns without a count
+#define SERVER_STATEMENT_MAX 1000      // Most rows one STATEMENT may return
+#define BENCH_STATEMENT_ROWS 10        // Rows copied by a benchmark statement query
+#define SEARCH_ROWS_SHOWN 50           // Newest matches printed by a statement search
+#define STATEMENT_PAGE_ROWS 20         // Rows on one page of the full statement screen
+#define EXPORT_CHUNK_ROWS 4096         // Statement rows copied out per read-lock hold
 
-// Transaction structure
+// One ingest entry; binary ingest files hold these back to back after INGEST_MAGIC
 typedef struct {
-    int farmer_id;
-    int amount;
-    time_t timestamp;
-    char type; // 'D' for deposit, 'W' for withdrawal
-    char description[100];
-} Transaction;
+    int32_t farmer_id;
+    int32_t to_id;          // Recipient for 'T', otherwise 0
+    money_t amount;
+    char type;              // 'D' credit, 'W' debit, 'T' transfer
+    char reserved[7];
+    char description[104];
+} IngestRecord;
 
-// Node for linked list of transactions
-typedef struct TransactionNode {
-    Transaction data;
-    struct TransactionNode* next;
-} TransactionNode;
-
-// Stack for recent transactions
+// Streaming reader over a CSV or binary ingest file
 typedef struct {
-    Transaction items[MAX_TRANSACTIONS];
-    int top;
-} TransactionStack;
+    FILE* fp;
+    bool binary;
+    long long record;       // Number of the record just read, from 1
+    char line[512];
+} IngestReader;
 
-// Queue for processing transactions
-typedef struct {
-    Transaction items[MAX_TRANSACTIONS];
-    int front;
-    int rear;
-    int size;
-} TransactionQueue;
-
-// Hash table entry for farmer lookup
-typedef struct HashEntry {
-    int farmer_id;
-    int index;
-    struct HashEntry* next;
-} HashEntry;
+// One client connection in server mode
+typedef struct Connection {
+    int fd;
+    int farmer_id;                  // 0 until AUTH succeeds
+    char in[SERVER_LINE_MAX];       // Received bytes not yet handled
+    size_t in_used;
+    char* out;                      // Reply bytes the socket has not taken yet
+    size_t out_used;
+    size_t out_size;
+    uint64_t ticket;                // Held reply is sent once this settles; 0 when none
+    char held[SERVER_REPLY_MAX];
+    bool closing;                   // Close once out has drained
+    uint32_t events;                // epoll interest currently registered
+    struct Connection* next_closed; // Freed at the end of the event loop pass
+} Connection;
 
-// Farmer account structure
+// Event loop state for server mode
 typedef struct {
-    int farmer_id;
-    char username[50];
-    int password;
-    double balance;
-    TransactionNode* transactions; // Linked list of transactions
-    int transaction_count;
-} Farmer;
-
-// Global data structures
-Farmer farmers[MAX_FARMERS];
-int num_farmers = 5;
-TransactionStack recent_transactions;
-TransactionQueue transaction_queue;
-HashEntry* farmer_hash_table[HASH_TABLE_SIZE];
+    int listen_fd;
+    int epoll_fd;
+    int settle_fd;                  // eventfd shared with the settlement worker
+    Connection** waiting;           // Connections holding a reply for settlement
+    int waiting_count;
+    int waiting_capacity;
+    Connection* closed;             // Closed this pass; events may still point at them
+} Server;
 
 // Function prototypes
-void initialize_system();
 void display_welcome_banner();
-void display_main_menu();
 void display_farmer_menu(int farmer_id);
 int authenticate();
+void register_screen();
+bool close_account_screen(int farmer_id);
 void deposit(int farmer_id);
 void withdraw(int farmer_id);
 void check_balance(int farmer_id);
 void account_statement(int farmer_id);
 void transfer_money(int farmer_id);
-void add_transaction(int farmer_id, double amount, char type, const char* description);
+money_t scan_money();
 void display_recent_transactions(int farmer_id, int n);
 void display_transactions_by_date(int farmer_id, time_t start, time_t end);
-void push_to_stack(Transaction t);
-void enqueue_transaction(Transaction t);
-Transaction dequeue_transaction();
+void display_search_results(int farmer_id, const char* query);
+void browse_statement(int farmer_id);
 void print_transaction(Transaction t);
 void print_separator();
 void print_box(const char* text);
-void free_memory();
-int find_farmer_index(int farmer_id);
-int hash_function(int farmer_id);
-void insert_farmer_hash(int farmer_id, int index);
-int lookup_farmer_hash(int farmer_id);
 void display_system_statistics();
 void clear_screen();
+void bench_farmer_lookup(int accounts);
+void bench_login(int accounts);
+bool ingest_open(IngestReader* r, const char* path);
+void ingest_rewind(IngestReader* r);
+int ingest_next(IngestReader* r, IngestRecord* rec);
+bool ingest_parse_csv(char* line, IngestRecord* rec);
+LedgerStatus ingest_check(const IngestRecord* rec, money_t* projected);
+LedgerStatus ingest_apply(const IngestRecord* rec, uint64_t* ticket);
+int ingest_file(const char* path, bool all_or_nothing);
+int ingest_atomic(IngestReader* reader);
+int server_run(const char* address);
+int server_listen(const char* address);
+void server_accept(Server* server);
+void server_read(Server* server, Connection* c);
+void server_handle_lines(Server* server, Connection* c);
+void server_command(Server* server, Connection* c, char* line);
+void server_settled(Server* server);
+void server_hold(Server* server, Connection* c);
+void server_close(Server* server, Connection* c);
+void connection_watch(Server* server, Connection* c);
+void connection_send(Server* server, Connection* c, const char* text, size_t len);
+void connection_printf(Server* server, Connection* c, const char* format, ...);
+void connection_flush(Server* server, Connection* c);
+void server_stop(int signal_number);
+int ledger_reconcile();
+void bench_history_alloc(long long transactions, int accounts);
+void bench_load(int accounts, int threads, int ops, int hot_percent, int read_percent);
+void* bench_load_worker(void* arg);
+int disburse_file(int from_id, const char* path, const char* note);
+int close_month(const char* rate_text, const char* description);
+int statement_export(int farmer_id, const char* format, const char* path);
+void metrics_dump(FILE* out, bool json);
+void* metrics_signal_worker(void* arg);
+void metrics_signals_start();
+void start_engine();
+void print_notice(const char* message);
+void print_fatal(const char* message);
 
-int main() {
-    initialize_system();
+int main(int argc, char* argv[]) {
+    ledger_on_notice(print_notice);
+    ledger_on_fatal(print_fatal);
+    metrics_signals_start();
+    
+    if (argc >= 2 && strcmp(argv[1], "--bench-lookup") == 0) {
+        bench_farmer_lookup(argc >= 3 ? atoi(argv[2]) : 100000);
+        return 0;
+    }
+    if (argc >= 2 && strcmp(argv[1], "--bench-login") == 0) {
+        bench_login(argc >= 3 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+    if (argc >= 2 && strcmp(argv[1], "--bench-alloc") == 0) {
+        bench_history_alloc(argc >= 3 ? atoll(argv[2]) : 10000000, argc >= 4 ? atoi(argv[3]) : 1000000);
+        return 0;
+    }
+    
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+        bench_load(argc >= 3 ? atoi(argv[2]) : 100000, argc >= 4 ? atoi(argv[3]) : 8,
+                   argc >= 5 ? atoi(argv[4]) : 100000, argc >= 6 ? atoi(argv[5]) : 0,
+                   argc >= 7 ? atoi(argv[6]) : 50);
+        return 0;
+    }
+    
+    start_engine();
+    
+    if (argc >= 2 && strcmp(argv[1], "--reconcile") == 0) {
+        int result = ledger_reconcile();
+        shutdown_system();
+        printf("\n🧹 Memory cleaned up successfully!\n");
+        return result;
+    }
+    if (argc >= 3 && strcmp(argv[1], "--serve") == 0) {
+        int result = server_run(argv[2]);
+        shutdown_system();
+        printf("\n🧹 Memory cleaned up successfully!\n");
+        return result;
+    }
+    if (argc >= 3 && strcmp(argv[1], "--ingest") == 0) {
+        bool all_or_nothing = argc >= 4 && strcmp(argv[3], "--all-or-nothing") == 0;
+        int result = ingest_file(argv[2], all_or_nothing);
+        shutdown_system();
+        printf("\n🧹 Memory cleaned up successfully!\n");
+        return result;
+    }
+    if (argc >= 4 && strcmp(argv[1], "--disburse") == 0) {
+        int result = disburse_file(atoi(argv[2]), argv[3], argc >= 5 ? argv[4] : "");
+        shutdown_system();
+        printf("\n🧹 Memory cleaned up successfully!\n");
+        return result;
+    }
+    if (argc >= 3 && strcmp(argv[1], "--close-month") == 0) {
+        int result = close_month(argv[2], argc >= 4 ? argv[3] : NULL);
+        shutdown_system();
+        printf("\n🧹 Memory cleaned up successfully!\n");
+        return result;
+    }
+    if (argc >= 4 && strcmp(argv[1], "--export") == 0) {
+        // Without a file the statement goes to stdout, so stay quiet there
+        int result = statement_export(atoi(argv[2]), argv[3], argc >= 5 ? argv[4] : NULL);
+        shutdown_system();
+        if (argc >= 5 && strcmp(argv[4], "-") != 0) printf("\n🧹 Memory cleaned up successfully!\n");
+        return result;
+    }
     
     while (1) {
         clear_screen();
         display_welcome_banner();
         
         int farmer_id = authenticate();
+        if (farmer_id == -2) {
+            continue;
+        }
         if (farmer_id == -1) {
             printf("\n❌ Authentication failed! Press Enter to try again...");
             getchar();
@@ -130,6 +241,14 @@ int main() {
             else if (strcmp(choice, "6") == 0) {
                 display_system_statistics();
             }
+            else if (strcmp(choice, "8") == 0) {
+                if (close_account_screen(farmer_id)) {
+                    printf("Press Enter to continue...");
+                    getchar();
+                    getchar();
+                    break;
+                }
+            }
             else if (strcmp(choice, "7") == 0) {
                 printf("\n👋 Logging out... Thank you for using our services!\n");
                 printf("Press Enter to continue...");
@@ -152,7 +271,8 @@ int main() {
         } while (1);
     }
     
-    free_memory();
+    shutdown_system();
+    printf("\n🧹 Memory cleaned up successfully!\n");
     return 0;
 }
 
@@ -191,10 +311,11 @@ void display_farmer_menu(int farmer_id) {
     printf("║                                                                              ║\n");
     printf("║                          🧑‍🌾 FARMER DASHBOARD 🧑‍🌾                           ║\n");
     printf("║                                                                              ║\n");
-    printf("║    Welcome: %-20s                   Balance: $%.2f          ║\n", 
-           farmers[index].username, farmers[index].balance);
+    char balance[MONEY_TEXT_SIZE];
+    printf("║    Welcome: %-20s                   Balance: $%s          ║\n", 
+           farmer_at(index)->username, money_text(farmer_at(index)->balance, balance));
     printf("║    Farmer ID: %-5d                            Transactions: %-5d        ║\n", 
-           farmer_id, farmers[index].transaction_count);
+           farmer_id, farmer_at(index)->transaction_count);
     printf("║                                                                              ║\n");
     printf("╠══════════════════════════════════════════════════════════════════════════════╣\n");
     printf("║                                                                              ║\n");
@@ -203,75 +324,18 @@ void display_farmer_menu(int farmer_id) {
     printf("║    [1] 💰 Deposit Money          [2] 💸 Withdraw Money                      ║\n");
     printf("║    [3] 💳 Check Balance          [4] 📄 Account Statement                   ║\n");
     printf("║    [5] 🔄 Transfer Money         [6] 📊 System Statistics                   ║\n");
-    printf("║    [7] 🚪 Logout                                                            ║\n");
+    printf("║    [7] 🚪 Logout                 [8] 🔒 Close Account                       ║\n");
     printf("║                                                                              ║\n");
     printf("╚══════════════════════════════════════════════════════════════════════════════╝\n");
 }
 
-void initialize_system() {
-    // Initialize hash table
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        farmer_hash_table[i] = NULL;
-    }
-    
-    // Dan_Trevor_Matovu dcs/day/2024/ 1539, "Mubwiine_Arnold: dcs/day/2024/ 0246", "Sebirungi_Shafiq:dcs/day/2024/0191g",
-    //"Kamogo_David:dcs/day/2024/1006g", "Twesimire_Dorris:dcs/day/2024/0902g"
-    char* usernames[] = {"Dan_Trevor_Matovu", "Mubwiine_Arnold", "Sebirungi_Shafiq", "Kamogo_David", "Twesimire_Dorris"};
-    int passwords[] = {1539, 0246, 1910, 10060, 9020};
-    double balances[] = {5000.00, 7500.50, 3000.25, 6000.75, 9000.00};
-    
-    for (int i = 0; i < num_farmers; i++) {
-        farmers[i].farmer_id = i + 1;
-        strcpy(farmers[i].username, usernames[i]);
-        farmers[i].password = passwords[i];
-        farmers[i].balance = balances[i];
-        farmers[i].transactions = NULL;
-        farmers[i].transaction_count = 0;
-        
-        // Insert into hash table
-        insert_farmer_hash(farmers[i].farmer_id, i);
-        
-        // Add initial deposit transaction
-        char desc[100];
-        sprintf(desc, "Initial deposit - Account opening");
-        add_transaction(i+1, balances[i], 'D', desc);
-    }
-    
-    // Initialize transaction stack and queue
-    recent_transactions.top = -1;
-    transaction_queue.front = 0;
-    transaction_queue.rear = -1;
-    transaction_queue.size = 0;
-}
-
-int hash_function(int farmer_id) {
-    return farmer_id % HASH_TABLE_SIZE;
-}
-
-void insert_farmer_hash(int farmer_id, int index) {
-    int hash_index = hash_function(farmer_id);
-    HashEntry* new_entry = (HashEntry*)malloc(sizeof(HashEntry));
-    new_entry->farmer_id = farmer_id;
-    new_entry->index = index;
-    new_entry->next = farmer_hash_table[hash_index];
-    farmer_hash_table[hash_index] = new_entry;
-}
-
-int lookup_farmer_hash(int farmer_id) {
-    int hash_index = hash_function(farmer_id);
-    HashEntry* current = farmer_hash_table[hash_index];
-    
-    while (current != NULL) {
-        if (current->farmer_id == farmer_id) {
-            return current->index;
-        }
-        current = current->next;
-    }
-    return -1;
-}
-
-int find_farmer_index(int farmer_id) {
-    return lookup_farmer_hash(farmer_id);
+money_t scan_money() {
+    // Reads one amount from the keyboard; -1 if it is not a valid positive amount
+    char text[MONEY_TEXT_SIZE];
+    money_t amount;
+    if (scanf("%31s", text) != 1) return -1;
+    const char* end = parse_money(text, &amount);
+    return (end != NULL && *end == '\0' && amount > 0) ? amount : -1;
 }
 
 int authenticate() {
@@ -281,12 +345,18 @@ int authenticate() {
     printf("\n┌────────────────────────────────────────────────────────────────────────────┐\n");
     printf("│                              🔐 USER LOGIN 🔐                              │\n");
     printf("└────────────────────────────────────────────────────────────────────────────┘\n");
-    printf("\n👤 Enter username (or 'exit' to quit): ");
+    printf("\n👤 Enter username ('register' for a new account, 'exit' to quit): ");
     scanf("%s", username);
     
+    if (strcmp(username, "register") == 0) {
+        register_screen();
+        return -2; // No login attempted
+    }
+    
     if (strcmp(username, "exit") == 0) {
         printf("\n👋 Thank you for using SACCO Management System!\n");
-        free_memory();
+        shutdown_system();
+        printf("\n🧹 Memory cleaned up successfully!\n");
         exit(0);
     }
     
@@ -294,14 +364,62 @@ int authenticate() {
     scanf("%d", &password);
     
     // Use hash table for efficient lookup
-    for (int i = 0; i < num_farmers; i++) {
-        if (strcmp(username, farmers[i].username) == 0 && password == farmers[i].password) {
-            printf("\n✅ Authentication successful! Welcome, %s.\n", username);
-            return farmers[i].farmer_id;
-        }
+    int farmer_id = check_login(username, password);
+    if (farmer_id != -1) {
+        printf("\n✅ Authentication successful! Welcome, %s.\n", username);
+    }
+    return farmer_id;
+}
+
+void register_screen() {
+    char username[50];
+    int password;
+    
+    clear_screen();
+    printf("\n");
+    printf("╔══════════════════════════════════════════════════════════════════════════════╗\n");
+    printf("║                             📝 OPEN NEW ACCOUNT 📝                          ║\n");
+    printf("╚══════════════════════════════════════════════════════════════════════════════╝\n");
+    
+    printf("\n👤 Choose a username (no spaces): ");
+    scanf("%49s", username);
+    printf("🔑 Choose a numeric password: ");
+    scanf("%d", &password);
+    
+    int farmer_id = create_farmer(username, password);
+    if (farmer_id == -1) {
+        printf("\n❌ Could not open account: username is taken or invalid.\n");
+    } else {
+        journal_commit();
+        printf("\n✅ Account opened! Your Farmer ID is %d. Please log in.\n", farmer_id);
     }
+    printf("Press Enter to continue...");
+    getchar();
+    getchar();
+}
+
+bool close_account_screen(int farmer_id) {
+    clear_screen();
+    printf("\n");
+    printf("╔══════════════════════════════════════════════════════════════════════════════╗\n");
+    printf("║                              🔒 CLOSE ACCOUNT 🔒                            ║\n");
+    printf("╚══════════════════════════════════════════════════════════════════════════════╝\n");
     
-    return -1;
+    char confirm[10];
+    printf("\n⚠️  Closing is permanent. Type 'yes' to confirm: ");
+    scanf("%9s", confirm);
+    if (strcmp(confirm, "yes") != 0) {
+        printf("\n❎ Account not closed.\n");
+        return false;
+    }
+    
+    if (!close_farmer(farmer_id)) {
+        printf("\n❌ Account can only be closed once its balance is zero.\n");
+        return false;
+    }
+    journal_commit();
+    printf("\n✅ Account closed. Thank you for banking with us.\n");
+    return true;
 }
 
 void deposit(int farmer_id) {
@@ -311,14 +429,15 @@ void deposit(int farmer_id) {
     printf("║                              💰 DEPOSIT MONEY 💰                            ║\n");
     printf("╚══════════════════════════════════════════════════════════════════════════════╝\n");
     
-    double amount;
+    money_t amount;
     char description[100];
+    char money[3][MONEY_TEXT_SIZE];
     
     printf("\n💵 Enter amount to deposit: $");
-    scanf("%lf", &amount);
+    amount = scan_money();
     
     if (amount <= 0) {
-        printf("\n❌ Invalid amount! Please enter a positive value.\n");
+        printf("\n❌ Invalid amount! Please enter a positive value with at most two decimals.\n");
         return;
     }
     
@@ -331,24 +450,27 @@ void deposit(int farmer_id) {
         strcpy(description, "Cash deposit");
     }
     
-    int index = find_farmer_index(farmer_id);
-    if (index == -1) {
+    uint64_t ticket;
+    LedgerStatus status = ledger_deposit(farmer_id, amount, description, &ticket);
+    if (status == LEDGER_LIMIT_EXCEEDED) {
+        printf("\n❌ Deposit would take the balance past the account limit.\n");
+        return;
+    }
+    if (status != LEDGER_OK) {
         printf("\n❌ Error: Farmer account not found!\n");
         return;
     }
+    int index = find_farmer_index(farmer_id);
     
-    // Update balance
-    farmers[index].balance += amount;
-    
-    // Record transaction
-    add_transaction(farmer_id, amount, 'D', description);
+    // Acknowledge only once the settlement batch holding it is durable
+    wait_for_settlement(ticket);
     
     printf("\n");
     printf("┌────────────────────────────────────────────────────────────────────────────┐\n");
     printf("│                           ✅ DEPOSIT SUCCESSFUL ✅                          │\n");
     printf("├────────────────────────────────────────────────────────────────────────────┤\n");
-    printf("│ Amount Deposited: $%-15.2f                                       │\n", amount);
-    printf("│ New Balance:      $%-15.2f                                       │\n", farmers[index].balance);
+    printf("│ Amount Deposited: $%-15s                                       │\n", money_text(amount, money[0]));
+    printf("│ New Balance:      $%-15s                                       │\n", money_text(farmer_at(index)->balance, money[1]));
     printf("│ Description:      %-45s      │\n", description);
     printf("└────────────────────────────────────────────────────────────────────────────┘\n");
 }
@@ -360,8 +482,9 @@ void withdraw(int farmer_id) {
     printf("║                             💸 WITHDRAW MONEY 💸                            ║\n");
     printf("╚══════════════════════════════════════════════════════════════════════════════╝\n");
     
-    double amount;
+    money_t amount;
     char description[100];
+    char money[3][MONEY_TEXT_SIZE];
     
     int index = find_farmer_index(farmer_id);
     if (index == -1) {
@@ -369,22 +492,23 @@ void withdraw(int farmer_id) {
         return;
     }
     
-    printf("\n💳 Current Balance: $%.2f\n", farmers[index].balance);
+    printf("\n💳 Current Balance: $%s\n", money_text(farmer_at(index)->balance, money[0]));
     printf("💵 Enter amount to withdraw: $");
-    scanf("%lf", &amount);
+    amount = scan_money();
     
     if (amount <= 0) {
-        printf("\n❌ Invalid amount! Please enter a positive value.\n");
+        printf("\n❌ Invalid amount! Please enter a positive value with at most two decimals.\n");
         return;
     }
     
     // Check balance
-    if (amount > farmers[index].balance) {
+    money_t balance = farmer_at(index)->balance;
+    if (amount > balance) {
         printf("\n❌ Insufficient funds!\n");
         printf("┌────────────────────────────────────────────────────────────────────────────┐\n");
-        printf("│ Requested Amount: $%-15.2f                                       │\n", amount);
-        printf("│ Available Balance: $%-15.2f                                      │\n", farmers[index].balance);
-        printf("│ Shortage: $%-15.2f                                               │\n", amount - farmers[index].balance);
+        printf("│ Requested Amount: $%-15s                                       │\n", money_text(amount, money[0]));
+        printf("│ Available Balance: $%-15s                                      │\n", money_text(balance, money[1]));
+        printf("│ Shortage: $%-15s                                               │\n", money_text(amount - balance, money[2]));
         printf("└────────────────────────────────────────────────────────────────────────────┘\n");
         return;
     }
@@ -398,18 +522,25 @@ void withdraw(int farmer_id) {
         strcpy(description, "Cash withdrawal");
     }
     
-    // Update balance
-    farmers[index].balance -= amount;
-    
-    // Record transaction
-    add_transaction(farmer_id, amount, 'W', description);
+    // The balance is checked again under the account lock; another session may have spent it
+    uint64_t ticket;
+    LedgerStatus status = ledger_withdraw(farmer_id, amount, description, &ticket);
+    if (status == LEDGER_INSUFFICIENT_FUNDS) {
+        printf("\n❌ Insufficient funds!\n");
+        return;
+    }
+    if (status != LEDGER_OK) {
+        printf("\n❌ Error: Farmer account not found!\n");
+        return;
+    }
+    wait_for_settlement(ticket);
     
     printf("\n");
     printf("┌────────────────────────────────────────────────────────────────────────────┐\n");
     printf("│                          ✅ WITHDRAWAL SUCCESSFUL ✅                        │\n");
     printf("├────────────────────────────────────────────────────────────────────────────┤\n");
-    printf("│ Amount Withdrawn: $%-15.2f                                       │\n", amount);
-    printf("│ New Balance:      $%-15.2f                                       │\n", farmers[index].balance);
+    printf("│ Amount Withdrawn: $%-15s                                       │\n", money_text(amount, money[0]));
+    printf("│ New Balance:      $%-15s                                       │\n", money_text(farmer_at(index)->balance, money[1]));
     printf("│ Description:      %-45s      │\n", description);
     printf("└────────────────────────────────────────────────────────────────────────────┘\n");
 }
@@ -431,10 +562,11 @@ void check_balance(int farmer_id) {
     printf("║                             💳 ACCOUNT BALANCE 💳                           ║\n");
     printf("╠══════════════════════════════════════════════════════════════════════════════╣\n");
     printf("║                                                                              ║\n");
-    printf("║    Account Holder: %-30s                             ║\n", farmers[index].username);
+    printf("║    Account Holder: %-30s                             ║\n", farmer_at(index)->username);
     printf("║    Farmer ID:      %-5d                                                   ║\n", farmer_id);
-    printf("║    Current Balance: $%-15.2f                                       ║\n", farmers[index].balance);
-    printf("║    Total Transactions: %-5d                                             ║\n", farmers[index].transaction_count);
+    char balance[MONEY_TEXT_SIZE];
+    printf("║    Current Balance: $%-15s                                       ║\n", money_text(farmer_at(index)->balance, balance));
+    printf("║    Total Transactions: %-5d                                             ║\n", farmer_at(index)->transaction_count);
     printf("║    Last Updated:   %-30s                             ║\n", time_str);
     printf("║                                                                              ║\n");
     printf("╚══════════════════════════════════════════════════════════════════════════════╝\n");
@@ -448,8 +580,9 @@ void transfer_money(int farmer_id) {
     printf("╚══════════════════════════════════════════════════════════════════════════════╝\n");
     
     int recipient_id;
-    double amount;
+    money_t amount;
     char description[100];
+    char money[2][MONEY_TEXT_SIZE];
     
     int sender_index = find_farmer_index(farmer_id);
     if (sender_index == -1) {
@@ -457,7 +590,7 @@ void transfer_money(int farmer_id) {
         return;
     }
     
-    printf("\n💳 Your Balance: $%.2f\n", farmers[sender_index].balance);
+    printf("\n💳 Your Balance: $%s\n", money_text(farmer_at(sender_index)->balance, money[0]));
     printf("👤 Enter recipient Farmer ID: ");
     scanf("%d", &recipient_id);
     
@@ -473,14 +606,14 @@ void transfer_money(int farmer_id) {
     }
     
     printf("💵 Enter amount to transfer: $");
-    scanf("%lf", &amount);
+    amount = scan_money();
     
     if (amount <= 0) {
-        printf("\n❌ Invalid amount! Please enter a positive value.\n");
+        printf("\n❌ Invalid amount! Please enter a positive value with at most two decimals.\n");
         return;
     }
     
-    if (amount > farmers[sender_index].balance) {
+    if (amount > farmer_at(sender_index)->balance) {
         printf("\n❌ Insufficient funds for transfer!\n");
         return;
     }
@@ -490,30 +623,31 @@ void transfer_money(int farmer_id) {
     fgets(description, sizeof(description), stdin);
     description[strcspn(description, "\n")] = 0;
     
-    if (strlen(description) == 0) {
-        sprintf(description, "Transfer to %s", farmers[recipient_index].username);
+    // Both accounts are locked together; the balance check is repeated there
+    uint64_t ticket;
+    LedgerStatus status = ledger_transfer(farmer_id, recipient_id, amount, description, &ticket);
+    if (status == LEDGER_INSUFFICIENT_FUNDS) {
+        printf("\n❌ Insufficient funds for transfer!\n");
+        return;
     }
-    
-    // Process transfer
-    farmers[sender_index].balance -= amount;
-    farmers[recipient_index].balance += amount;
-    
-    // Record transactions
-    char sender_desc[150], recipient_desc[150];
-    sprintf(sender_desc, "Transfer to %s: %s", farmers[recipient_index].username, description);
-    sprintf(recipient_desc, "Transfer from %s: %s", farmers[sender_index].username, description);
-    
-    add_transaction(farmer_id, amount, 'W', sender_desc);
-    add_transaction(recipient_id, amount, 'D', recipient_desc);
+    if (status == LEDGER_LIMIT_EXCEEDED) {
+        printf("\n❌ Transfer would take the recipient past the account limit.\n");
+        return;
+    }
+    if (status != LEDGER_OK) {
+        printf("\n❌ Recipient account not found!\n");
+        return;
+    }
+    wait_for_settlement(ticket);
     
     printf("\n");
     printf("┌────────────────────────────────────────────────────────────────────────────┐\n");
     printf("│                          ✅ TRANSFER SUCCESSFUL ✅                          │\n");
     printf("├────────────────────────────────────────────────────────────────────────────┤\n");
-    printf("│ From:             %-30s                             │\n", farmers[sender_index].username);
-    printf("│ To:               %-30s                             │\n", farmers[recipient_index].username);
-    printf("│ Amount:           $%-15.2f                                       │\n", amount);
-    printf("│ Your New Balance: $%-15.2f                                       │\n", farmers[sender_index].balance);
+    printf("│ From:             %-30s                             │\n", farmer_at(sender_index)->username);
+    printf("│ To:               %-30s                             │\n", farmer_at(recipient_index)->username);
+    printf("│ Amount:           $%-15s                                       │\n", money_text(amount, money[0]));
+    printf("│ Your New Balance: $%-15s                                       │\n", money_text(farmer_at(sender_index)->balance, money[1]));
     printf("└────────────────────────────────────────────────────────────────────────────┘\n");
 }
 
@@ -535,6 +669,8 @@ void account_statement(int farmer_id) {
     printf("  [1] Last N transactions\n");
     printf("  [2] Transactions between dates\n");
     printf("  [3] All transactions\n");
+    printf("  [4] Export all transactions to a file (CSV or JSON)\n");
+    printf("  [5] Search by words or a name (e.g. Kamogo_David)\n");
     printf("\n🔹 Enter your choice: ");
     scanf("%d", &option);
     
@@ -563,7 +699,22 @@ void account_statement(int farmer_id) {
         display_transactions_by_date(farmer_id, start_date, end_date);
     }
     else if (option == 3) {
-        display_recent_transactions(farmer_id, farmers[index].transaction_count);
+        browse_statement(farmer_id);
+    }
+    else if (option == 4) {
+        int format;
+        char path[256];
+        printf("📁 Format - [1] CSV  [2] JSON: ");
+        scanf("%d", &format);
+        printf("📁 Save to file: ");
+        scanf("%255s", path);
+        statement_export(farmer_id, format == 2 ? "json" : "csv", path);
+    }
+    else if (option == 5) {
+        char query[DESCRIPTION_MAX];
+        printf("🔍 Search for: ");
+        if (scanf(" %99[^\n]", query) != 1) return;
+        display_search_results(farmer_id, query);
     }
     else {
         printf("\n❌ Invalid option.\n");
@@ -577,34 +728,20 @@ void display_system_statistics() {
     printf("║                           📊 SYSTEM STATISTICS 📊                           ║\n");
     printf("╚══════════════════════════════════════════════════════════════════════════════╝\n");
     
-    double total_balance = 0;
-    int total_transactions = 0;
-    int total_deposits = 0;
-    int total_withdrawals = 0;
-    
-    for (int i = 0; i < num_farmers; i++) {
-        total_balance += farmers[i].balance;
-        total_transactions += farmers[i].transaction_count;
-        
-        // Count transaction types
-        TransactionNode* current = farmers[i].transactions;
-        while (current != NULL) {
-            if (current->data.type == 'D') total_deposits++;
-            else total_withdrawals++;
-            current = current->next;
-        }
-    }
+    // Totals come from the running aggregates, not a pass over the ledger
+    SystemStats stats = stats_snapshot();
+    char money[4][MONEY_TEXT_SIZE];
     
     printf("\n");
     printf("┌────────────────────────────────────────────────────────────────────────────┐\n");
     printf("│                            SYSTEM OVERVIEW                                 │\n");
     printf("├────────────────────────────────────────────────────────────────────────────┤\n");
-    printf("│ Total Farmers:        %-10d                                        │\n", num_farmers);
-    printf("│ Total Balance:        $%-15.2f                                    │\n", total_balance);
-    printf("│ Total Transactions:   %-10d                                        │\n", total_transactions);
-    printf("│ Total Deposits:       %-10d                                        │\n", total_deposits);
-    printf("│ Total Withdrawals:    %-10d                                        │\n", total_withdrawals);
-    printf("│ Average Balance:      $%-15.2f                                    │\n", total_balance / num_farmers);
+    printf("│ Total Farmers:        %-10lld                                        │\n", stats.accounts);
+    printf("│ Total Balance:        $%-15s                                    │\n", money_text(stats.total_balance, money[0]));
+    printf("│ Total Transactions:   %-10lld                                        │\n", stats.transactions);
+    printf("│ Total Deposits:       %-10lld ($%-15s)                     │\n", stats.deposits, money_text(stats.deposit_total, money[1]));
+    printf("│ Total Withdrawals:    %-10lld ($%-15s)                     │\n", stats.withdrawals, money_text(stats.withdrawal_total, money[2]));
+    printf("│ Average Balance:      $%-15s                                    │\n", money_text(stats.accounts ? stats.total_balance / stats.accounts : 0, money[3]));
     printf("└────────────────────────────────────────────────────────────────────────────┘\n");
     
     printf("\n");
@@ -615,73 +752,130 @@ void display_system_statistics() {
     printf("├────┼───────────────────┼────────────────┼─────────────────────────────────┤\n");
     
     for (int i = 0; i < num_farmers; i++) {
-        printf("│ %-2d │ %-17s │ $%-13.2f │ %-10d                      │\n", 
-               farmers[i].farmer_id, 
-               farmers[i].username, 
-               farmers[i].balance, 
-               farmers[i].transaction_count);
+        if (!farmer_at(i)->active) continue;
+        printf("│ %-2d │ %-17s │ $%-13s │ %-10d                      │\n", 
+               farmer_at(i)->farmer_id, 
+               farmer_at(i)->username, 
+               money_text(farmer_at(i)->balance, money[0]), 
+               farmer_at(i)->transaction_count);
     }
     
     printf("└────┴───────────────────┴────────────────┴─────────────────────────────────┘\n");
-}
-
-void add_transaction(int farmer_id, double amount, char type, const char* description) {
-    time_t now = time(NULL);
-    
-    // Create new transaction
-    Transaction t;
-    t.farmer_id = farmer_id;
-    t.amount = amount;
-    t.timestamp = now;
-    t.type = type;
-    strcpy(t.description, description);
-    
-    int index = find_farmer_index(farmer_id);
-    if (index == -1) return;
-    
-    // Add to farmer's linked list (insert at head)
-    TransactionNode* new_node = (TransactionNode*)malloc(sizeof(TransactionNode));
-    new_node->data = t;
-    new_node->next = farmers[index].transactions;
-    farmers[index].transactions = new_node;
-    farmers[index].transaction_count++;
     
-    // Push to stack for recent transactions
-    push_to_stack(t);
+    // Newest activity across every account, straight from the recent feed
+    Transaction recent[RECENT_ACTIVITY_ROWS];
+    int shown = recent_feed_last(RECENT_ACTIVITY_ROWS, recent);
     
-    // Enqueue for processing
-    enqueue_transaction(t);
+    printf("\n");
+    printf("┌────────────────────────────────────────────────────────────────────────────┐\n");
+    printf("│                        RECENT ACTIVITY (ALL FARMERS)                       │\n");
+    printf("├──────┬──────────────────┬──────────┬─────────────┬─────────────────────────┤\n");
+    for (int i = 0; i < shown; i++) {
+        char time_str[20];
+        strftime(time_str, 20, "%Y-%m-%d %H:%M", localtime(&recent[i].timestamp));
+        printf("│ %-4d │ %-16s │ %-8s │ $%-10s │ %-23.23s │\n",
+               recent[i].farmer_id, time_str, recent[i].type == 'D' ? "Deposit" : "Withdraw",
+               money_text(recent[i].amount, money[0]), description_at(recent[i].description));
+    }
+    if (shown == 0) {
+        printf("│                         No transactions found                             │\n");
+    }
+    printf("└──────┴──────────────────┴──────────┴─────────────┴─────────────────────────┘\n");
 }
 
 void display_recent_transactions(int farmer_id, int n) {
+    // The newest n rows, newest first, one page at a time like browse_statement()
     int index = find_farmer_index(farmer_id);
     if (index == -1) {
         printf("\n❌ Error: Farmer account not found!\n");
         return;
     }
+    StatementCursor page;
+    statement_latest(&page, farmer_id, STATEMENT_PAGE_ROWS);
+    Transaction rows[STATEMENT_PAGE_ROWS];
     
     printf("\n");
     printf("┌────────────────────────────────────────────────────────────────────────────┐\n");
-    printf("│                    RECENT TRANSACTIONS - %s                           │\n", farmers[index].username);
+    printf("│                    RECENT TRANSACTIONS - %s                           │\n", farmer_at(index)->username);
     printf("├────────────────────────────────────────────────────────────────────────────┤\n");
-    printf("│ Date/Time           │ Type     │ Amount      │ Description              │\n");
-    printf("├─────────────────────┼──────────┼─────────────┼──────────────────────────┤\n");
-    
-    TransactionNode* current = farmers[index].transactions;
-    int count = 0;
     
-    while (current != NULL && count < n) {
-        print_transaction(current->data);
-        current = current->next;
-        count++;
+    int shown = 0;
+    while (true) {
+        int count = statement_read(&page, rows, NULL);
+        if (count == -1) {
+            printf("\n❌ Error: Farmer account not found!\n");
+            return;
+        }
+        
+        printf("│ Date/Time           │ Type     │ Amount      │ Description              │\n");
+        printf("├─────────────────────┼──────────┼─────────────┼──────────────────────────┤\n");
+        for (int i = count - 1; i >= 0 && shown < n; i--, shown++) {
+            print_transaction(rows[i]);
+        }
+        if (shown == 0) {
+            printf("│                         No transactions found                             │\n");
+        }
+        printf("└─────────────────────┴──────────┴─────────────┴──────────────────────────┘\n");
+        
+        if (shown >= n || !statement_older(&page)) break;
+        char choice[8];
+        printf("\nShowing %d of %d. 🔹 [n] Next page  [q] Done: ", shown, n);
+        if (scanf("%7s", choice) != 1 || strcmp(choice, "n") != 0) break;
+        printf("\n┌─────────────────────┬──────────┬─────────────┬──────────────────────────┐\n");
     }
-    
-    if (count == 0) {
-        printf("│                         No transactions found                             │\n");
+    printf("\nTotal transactions shown: %d\n", shown);
+}
+
+void browse_statement(int farmer_id) {
+    // One page at a time, newest page first; only the page on screen is copied out
+    StatementCursor page;
+    statement_latest(&page, farmer_id, STATEMENT_PAGE_ROWS);
+    Transaction rows[STATEMENT_PAGE_ROWS];
+    char token[STATEMENT_TOKEN_SIZE];
+    
+    while (true) {
+        int count = statement_read(&page, rows, NULL);
+        if (count == -1) {
+            printf("\n❌ Error: Farmer account not found!\n");
+            return;
+        }
+        
+        printf("\n");
+        printf("┌─────────────────────┬──────────┬─────────────┬──────────────────────────┐\n");
+        printf("│ Date/Time           │ Type     │ Amount      │ Description              │\n");
+        printf("├─────────────────────┼──────────┼─────────────┼──────────────────────────┤\n");
+        for (int i = count - 1; i >= 0; i--) {
+            print_transaction(rows[i]);
+        }
+        if (count == 0) {
+            printf("│                         No transactions found                             │\n");
+        }
+        printf("└─────────────────────┴──────────┴─────────────┴──────────────────────────┘\n");
+        
+        // Numbered from the newest, as the rows are printed
+        int total = statement_total(&page);
+        printf("\nShowing %d-%d of %d (resume token %s)\n", count ? total - page.end + 1 : 0,
+               total - page.first, total, statement_token(&page, token));
+        
+        char choice[STATEMENT_TOKEN_SIZE];
+        printf("🔹 [n] Older  [p] Newer  [q] Done, or paste a resume token: ");
+        if (scanf("%47s", choice) != 1 || strcmp(choice, "q") == 0) return;
+        
+        if (strchr(choice, ':') != NULL) {
+            StatementCursor resumed;
+            if (!statement_resume(&resumed, choice) || resumed.farmer_id != farmer_id) {
+                printf("\n❌ Error: that is not a resume token for this account.\n");
+            } else {
+                page = resumed;
+            }
+        } else if (strcmp(choice, "n") == 0) {
+            if (!statement_older(&page)) printf("\n📄 This is the oldest page.\n");
+        } else if (strcmp(choice, "p") == 0) {
+            if (!statement_newer(&page)) printf("\n📄 This is the newest page.\n");
+        } else {
+            printf("\n❌ Invalid option.\n");
+        }
     }
-    
-    printf("└─────────────────────┴──────────┴─────────────┴──────────────────────────┘\n");
-    printf("\nTotal transactions shown: %d\n", count);
 }
 
 void display_transactions_by_date(int farmer_id, time_t start, time_t end) {
@@ -702,16 +896,30 @@ void display_transactions_by_date(int farmer_id, time_t start, time_t end) {
     printf("│ Date/Time           │ Type     │ Amount      │ Description              │\n");
     printf("├─────────────────────┼──────────┼─────────────┼──────────────────────────┤\n");
     
-    TransactionNode* current = farmers[index].transactions;
+    // Seek straight to the window through the history's time index, newest first
+    Ledger* ledger = farmer_ledger(farmer_at(index));
+    pthread_rwlock_rdlock(&ledger->lock);
+    int* history = farmer_at(index)->history;
+    int first;
+    int span = history_range(farmer_at(index), (int64_t)start, (int64_t)end, &first);
+    Transaction* rows = (Transaction*)malloc((size_t)(span + 1) * sizeof(Transaction));
+    if (rows == NULL) {
+        pthread_rwlock_unlock(&ledger->lock);
+        printf("│                  Not enough memory for this date range                    │\n");
+        printf("└─────────────────────┴──────────┴─────────────┴──────────────────────────┘\n");
+        return;
+    }
     int count = 0;
+    for (int i = first + span - 1; i >= first; i--) {
+        int64_t when = ledger->timestamp[history[i]];
+        if (when >= (int64_t)start && when <= (int64_t)end) rows[count++] = ledger_transaction(ledger, history[i]);
+    }
+    pthread_rwlock_unlock(&ledger->lock);
     
-    while (current != NULL) {
-        if (current->data.timestamp >= start && current->data.timestamp <= end) {
-            print_transaction(current->data);
-            count++;
-        }
-        current = current->next;
+    for (int i = 0; i < count; i++) {
+        print_transaction(rows[i]);
     }
+    free(rows);
     
     if (count == 0) {
         printf("│                    No transactions found in date range                    │\n");
@@ -721,38 +929,38 @@ void display_transactions_by_date(int farmer_id, time_t start, time_t end) {
     printf("\nTotal transactions in range: %d\n", count);
 }
 
-void push_to_stack(Transaction t) {
-    if (recent_transactions.top >= MAX_TRANSACTIONS - 1) {
-        // Stack overflow, shift elements
-        for (int i = 0; i < MAX_TRANSACTIONS - 1; i++) {
-            recent_transactions.items[i] = recent_transactions.items[i + 1];
-        }
-        recent_transactions.top--;
+void display_search_results(int farmer_id, const char* query) {
+    int index = find_farmer_index(farmer_id);
+    if (index == -1) {
+        printf("\n❌ Error: Farmer account not found!\n");
+        return;
     }
-    recent_transactions.items[++recent_transactions.top] = t;
-}
-
-void enqueue_transaction(Transaction t) {
-    if (transaction_queue.size >= MAX_TRANSACTIONS) {
-        // Queue is full, dequeue oldest
-        dequeue_transaction();
+    
+    Transaction* rows = (Transaction*)malloc(SEARCH_ROWS_SHOWN * sizeof(Transaction));
+    double start = now_seconds();
+    int total = ledger_search(farmer_id, query, rows, SEARCH_ROWS_SHOWN);
+    double elapsed = now_seconds() - start;
+    int count = total < SEARCH_ROWS_SHOWN ? total : SEARCH_ROWS_SHOWN;
+    
+    printf("\n");
+    printf("┌────────────────────────────────────────────────────────────────────────────┐\n");
+    printf("│                    SEARCH RESULTS - %s                           │\n", farmer_at(index)->username);
+    printf("├────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("│ Date/Time           │ Type     │ Amount      │ Description              │\n");
+    printf("├─────────────────────┼──────────┼─────────────┼──────────────────────────┤\n");
+    for (int i = 0; i < count; i++) {
+        print_transaction(rows[i]);
     }
+    free(rows);
     
-    transaction_queue.rear = (transaction_queue.rear + 1) % MAX_TRANSACTIONS;
-    transaction_queue.items[transaction_queue.rear] = t;
-    transaction_queue.size++;
-}
-
-Transaction dequeue_transaction() {
-    Transaction t = {0};
-    if (transaction_queue.size <= 0) {
-        return t; // Empty queue
+    if (count == 0) {
+        printf("│                         No transactions found                             │\n");
     }
     
-    t = transaction_queue.items[transaction_queue.front];
-    transaction_queue.front = (transaction_queue.front + 1) % MAX_TRANSACTIONS;
-    transaction_queue.size--;
-    return t;
+    printf("└─────────────────────┴──────────┴─────────────┴──────────────────────────┘\n");
+    printf("\n%d transactions mention \"%s\" (%.2f ms)", total, query, elapsed * 1000);
+    if (total > count) printf("; the newest %d are shown", count);
+    printf("\n");
 }
 
 void print_transaction(Transaction t) {
@@ -767,19 +975,21 @@ void print_transaction(Transaction t) {
     }
     
     // Truncate description if too long
+    const char* text = description_at(t.description);
     char desc[25];
-    if (strlen(t.description) > 24) {
-        strncpy(desc, t.description, 21);
+    if (strlen(text) > 24) {
+        strncpy(desc, text, 21);
         desc[21] = '.';
         desc[22] = '.';
         desc[23] = '.';
         desc[24] = '\0';
     } else {
-        strcpy(desc, t.description);
+        strcpy(desc, text);
     }
     
-    printf("│ %-19s │ %-8s │ $%-10.2f │ %-24s │\n", 
-           time_str, type_str, t.amount, desc);
+    char amount[MONEY_TEXT_SIZE];
+    printf("│ %-19s │ %-8s │ $%-10s │ %-24s │\n", 
+           time_str, type_str, money_text(t.amount, amount), desc);
 }
 
 void print_separator() {
@@ -795,28 +1005,1594 @@ void print_box(const char* text) {
     printf("╚══════════════════════════════════════════════════════════════════════════════╝\n");
 }
 
-void free_memory() {
-    // Free transaction linked lists for all farmers
+int statement_export(int farmer_id, const char* format, const char* path) {
+    // Oldest first and untruncated, for auditors. path NULL or "-" streams to stdout,
+    // so the summary then goes to stderr to keep the output clean.
+    int index = find_farmer_index(farmer_id);
+    if (index == -1) {
+        printf("\n❌ Error: Farmer account not found!\n");
+        return 1;
+    }
+    bool json = strcmp(format, "json") == 0;
+    if (!json && strcmp(format, "csv") != 0) {
+        printf("\n❌ Error: export format must be csv or json, not %s\n", format);
+        return 1;
+    }
+    bool to_stdout = path == NULL || strcmp(path, "-") == 0;
+    FILE* report = to_stdout ? stderr : stdout;
+    
+    ExportWriter w = { .fd = STDOUT_FILENO, .ok = true };
+    if (to_stdout) {
+        fflush(stdout);
+    } else {
+        w.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (w.fd == -1) {
+            printf("\n❌ Error: cannot create %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+    }
+    w.buffer = (char*)malloc(EXPORT_BUFFER);
+    Transaction* rows = (Transaction*)malloc(EXPORT_CHUNK_ROWS * sizeof(Transaction));
+    int* row_numbers = (int*)malloc(EXPORT_CHUNK_ROWS * sizeof(int));
+    if (w.buffer == NULL || rows == NULL || row_numbers == NULL) {
+        printf("\n❌ Error: out of memory for export!\n");
+        exit(1);
+    }
+    
+    double started = now_seconds();
+    const Farmer* f = farmer_at(index);
+    if (json) {
+        char id[16];
+        export_put(&w, "{\"farmer_id\":", 13);
+        export_put(&w, id, (size_t)snprintf(id, sizeof(id), "%d", farmer_id));
+        export_put(&w, ",\"username\":", 12);
+        export_text(&w, f->username, true);
+        export_put(&w, ",\"transactions\":[", 17);
+    } else {
+        export_put(&w, "row,timestamp,type,amount,description\n", 38);
+    }
+    
+    // The export covers the rows present when it starts. They are copied out a
+    // page at a time, so settlement never waits on a slow disk or pipe.
+    StatementCursor page;
+    statement_oldest(&page, farmer_id, EXPORT_CHUNK_ROWS);
+    int total = statement_total(&page);
+    int done = 0;
+    while (done < total && w.ok) {
+        int count = statement_read(&page, rows, row_numbers);
+        if (count == -1) break;
+        if (count > total - done) count = total - done;
+        for (int i = 0; i < count; i++) {
+            export_row(&w, &rows[i], row_numbers[i], json, done + i == 0);
+        }
+        done += count;
+        if (!statement_newer(&page)) break;
+    }
+    if (json) export_put(&w, "\n]}\n", 4);
+    export_flush(&w);
+    
+    double elapsed = now_seconds() - started;
+    bool ok = w.ok;
+    if (!to_stdout && close(w.fd) == -1) ok = false;
+    free(w.buffer);
+    free(rows);
+    free(row_numbers);
+    
+    if (!ok) {
+        fprintf(report, "\n❌ Error: export to %s failed: %s\n", to_stdout ? "stdout" : path, strerror(errno));
+        return 1;
+    }
+    fprintf(report, "\n📤 Exported %d transactions for %s to %s in %.3fs (%.0f rows/sec)\n",
+            done, f->username, to_stdout ? "stdout" : path, elapsed, elapsed > 0 ? done / elapsed : 0.0);
+    return 0;
+}
+
+int ledger_reconcile() {
+    // Exact check that the ledger, the balances and the running totals all agree
+    settle_all();
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        pthread_rwlock_rdlock(&shards[s].ledger.lock);
+    }
+    double start = now_seconds();
+    money_t ledger_total = 0;
+    long long rows = 0;
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        ledger_total += ledger_net_total(&shards[s].ledger, 0, shards[s].ledger.count);
+        rows += shards[s].ledger.count;
+    }
+    double scan = now_seconds() - start;
+    
+    money_t balance_total = 0;
+    long long mismatched = 0;
     for (int i = 0; i < num_farmers; i++) {
-        TransactionNode* current = farmers[i].transactions;
-        while (current != NULL) {
-            TransactionNode* temp = current;
-            current = current->next;
-            free(temp);
+        Farmer* f = farmer_at(i);
+        const Ledger* ledger = farmer_ledger(f);
+        money_t net = 0;
+        for (int j = 0; j < f->transaction_count; j++) {
+            long long row = f->history[j];
+            net += ledger->type[row] == 'D' ? ledger->amount[row] : -ledger->amount[row];
+        }
+        if (net != f->balance) {
+            char money[2][MONEY_TEXT_SIZE];
+            if (mismatched < INGEST_MAX_ERRORS_SHOWN) {
+                printf("❌ Farmer %d: balance $%s, ledger says $%s\n", f->farmer_id,
+                       money_text(f->balance, money[0]), money_text(net, money[1]));
+            }
+            mismatched++;
         }
-        farmers[i].transactions = NULL;
+        balance_total += f->balance;
+    }
+    double elapsed = now_seconds() - start;
+    for (int s = SHARD_COUNT - 1; s >= 0; s--) {
+        pthread_rwlock_unlock(&shards[s].ledger.lock);
+    }
+    
+    SystemStats stats = stats_snapshot();
+    char money[3][MONEY_TEXT_SIZE];
+    printf("\n📒 Reconciliation of %lld rows across %d accounts\n", rows, (int)num_farmers);
+    printf("   Ledger net:       $%s (column scan %.0f rows/sec)\n", money_text(ledger_total, money[0]),
+           scan > 0 ? rows / scan : 0.0);
+    printf("   Sum of balances:  $%s\n", money_text(balance_total, money[1]));
+    printf("   Running total:    $%s\n", money_text(stats.total_balance, money[2]));
+    
+    bool ok = mismatched == 0 && ledger_total == balance_total && ledger_total == stats.total_balance;
+    if (ok) {
+        printf("\n✅ Ledger reconciles exactly (%.2fs)\n", elapsed);
+    } else {
+        printf("\n❌ Ledger does not reconcile: %lld account(s) differ\n", mismatched);
+    }
+    return ok ? 0 : 1;
+}
+
+// The separately chained table farmer lookup used before, kept only for comparison
+typedef struct ChainedEntry {
+    int farmer_id;
+    int index;
+    struct ChainedEntry* next;
+} ChainedEntry;
+
+#define CHAINED_TABLE_SIZE 101
+
+void bench_farmer_lookup(int accounts) {
+    int lookups = 1000000;
+    if (accounts < 1) accounts = 1;
+    
+    // Same pseudo-random ID sequence for both tables
+    int* ids = (int*)malloc((size_t)lookups * sizeof(int));
+    uint32_t seed = 2463534242u;
+    for (int i = 0; i < lookups; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        ids[i] = (int)(seed % (uint32_t)accounts) + 1;
     }
     
-    // Free hash table entries
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        HashEntry* current = farmer_hash_table[i];
-        while (current != NULL) {
-            HashEntry* temp = current;
-            current = current->next;
+    printf("\n📊 Farmer lookup benchmark: %d accounts, %d lookups\n\n", accounts, lookups);
+    
+    // Chained table, as it was
+    ChainedEntry* chained[CHAINED_TABLE_SIZE] = { NULL };
+    double start = now_seconds();
+    for (int id = 1; id <= accounts; id++) {
+        ChainedEntry* e = (ChainedEntry*)malloc(sizeof(ChainedEntry));
+        e->farmer_id = id;
+        e->index = id - 1;
+        e->next = chained[id % CHAINED_TABLE_SIZE];
+        chained[id % CHAINED_TABLE_SIZE] = e;
+    }
+    double chained_insert = now_seconds() - start;
+    
+    long long checksum = 0;
+    start = now_seconds();
+    for (int i = 0; i < lookups; i++) {
+        ChainedEntry* e = chained[ids[i] % CHAINED_TABLE_SIZE];
+        while (e != NULL && e->farmer_id != ids[i]) e = e->next;
+        checksum += e ? e->index : -1;
+    }
+    double chained_lookup = now_seconds() - start;
+    
+    // Open addressing table used by find_farmer_index()
+    resize_farmer_hash(HASH_INITIAL_SLOTS);
+    start = now_seconds();
+    for (int id = 1; id <= accounts; id++) {
+        insert_farmer_hash(id, id - 1);
+    }
+    double open_insert = now_seconds() - start;
+    
+    start = now_seconds();
+    for (int i = 0; i < lookups; i++) {
+        checksum -= lookup_farmer_hash(ids[i]);
+    }
+    double open_lookup = now_seconds() - start;
+    
+    printf("  %-22s %14s %14s\n", "Table", "insert ns/op", "lookup ns/op");
+    printf("  %-22s %14.1f %14.1f\n", "chained (101 buckets)",
+           chained_insert * 1e9 / accounts, chained_lookup * 1e9 / lookups);
+    printf("  %-22s %14.1f %14.1f\n", "open addressing",
+           open_insert * 1e9 / accounts, open_lookup * 1e9 / lookups);
+    FarmerHashTable* table = atomic_load(&farmer_hash_table);
+    printf("\n  Slots: %u (load %.0f%%), speedup %.1fx, checksum %lld\n",
+           table->mask + 1, 100.0 * table->live / (table->mask + 1),
+           chained_lookup / open_lookup, checksum);
+    
+    for (int b = 0; b < CHAINED_TABLE_SIZE; b++) {
+        while (chained[b] != NULL) {
+            ChainedEntry* temp = chained[b];
+            chained[b] = temp->next;
             free(temp);
         }
-        farmer_hash_table[i] = NULL;
     }
+    free_farmer_hash();
+    free(ids);
+}
+
+void bench_login(int accounts) {
+    int logins = 1000000;
+    int linear_logins = 1000;
+    if (accounts < 1) accounts = 1;
+    
+    // In-memory registry only: nothing here touches the journal
+    resize_farmer_hash(HASH_INITIAL_SLOTS);
+    resize_username_index(HASH_INITIAL_SLOTS);
+    char username[50];
+    double start = now_seconds();
+    for (int i = 0; i < accounts; i++) {
+        snprintf(username, sizeof(username), "farmer_%d", i + 1);
+        register_farmer(i + 1, username, 1000 + i % 9000);
+    }
+    double setup = now_seconds() - start;
+    
+    printf("\n📊 Login benchmark: %d accounts (registered in %.2fs)\n\n", accounts, setup);
+    
+    uint32_t seed = 2463534242u;
+    int accepted = 0;
+    start = now_seconds();
+    for (int i = 0; i < logins; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        int n = (int)(seed % (uint32_t)accounts);
+        snprintf(username, sizeof(username), "farmer_%d", n + 1);
+        if (check_login(username, 1000 + n % 9000) != -1) accepted++;
+    }
+    double indexed = now_seconds() - start;
+    
+    // The strcmp scan authenticate() used before, on far fewer attempts
+    start = now_seconds();
+    for (int i = 0; i < linear_logins; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        int n = (int)(seed % (uint32_t)accounts);
+        snprintf(username, sizeof(username), "farmer_%d", n + 1);
+        for (int j = 0; j < num_farmers; j++) {
+            if (strcmp(username, farmer_at(j)->username) == 0 && farmer_at(j)->password == 1000 + n % 9000) {
+                accepted++;
+                break;
+            }
+        }
+    }
+    double linear = now_seconds() - start;
     
-    printf("\n🧹 Memory cleaned up successfully!\n");
+    printf("  %-16s %12s %16s\n", "Method", "attempts", "logins/sec");
+    printf("  %-16s %12d %16.0f\n", "username index", logins, logins / indexed);
+    printf("  %-16s %12d %16.0f\n", "linear scan", linear_logins, linear_logins / linear);
+    printf("\n  Accepted %d of %d attempts\n", accepted, logins + linear_logins);
+    
+    free_memory();
+}
+
+// Operations driven by the load benchmark; reads first
+typedef enum {
+    BENCH_BALANCE,
+    BENCH_STATEMENT,
+    BENCH_DEPOSIT,
+    BENCH_WITHDRAW,
+    BENCH_TRANSFER,
+    BENCH_OP_KINDS
+} BenchOp;
+
+typedef struct {
+    pthread_t thread;
+    int first_id;          // Benchmark accounts are first_id .. first_id + accounts - 1
+    int accounts;
+    int hot_accounts;      // The lowest IDs form the hot set
+    int hot_percent;       // Share of operations aimed at the hot set
+    int read_percent;
+    int ops;
+    uint32_t seed;
+    long long rejected;    // Refused by the ledger, e.g. insufficient funds; still timed
+    money_t checksum;      // Sum of everything read, so reads cannot be optimised away
+    LatencyHistogram latency[BENCH_OP_KINDS];
+} BenchWorker;
+
+void* bench_load_worker(void* arg) {
+    BenchWorker* w = (BenchWorker*)arg;
+    uint32_t seed = w->seed;
+    
+    for (int i = 0; i < w->ops; i++) {
+        // Three draws per operation: kind, account, counterparty/amount
+        uint32_t draw[3];
+        for (int d = 0; d < 3; d++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            draw[d] = seed;
+        }
+        BenchOp op;
+        if ((int)(draw[0] % 100) < w->read_percent) {
+            op = (draw[0] >> 8) & 1 ? BENCH_STATEMENT : BENCH_BALANCE;
+        } else {
+            op = (BenchOp)(BENCH_DEPOSIT + (draw[0] >> 8) % 3);
+        }
+        bool hot = (int)((draw[1] >> 16) % 100) < w->hot_percent;
+        int farmer_id = w->first_id + (int)(draw[1] % (uint32_t)(hot ? w->hot_accounts : w->accounts));
+        int to_id = w->first_id + (int)(draw[2] % (uint32_t)w->accounts);
+        money_t amount = 1 + (money_t)((draw[2] >> 8) % 10000);
+        
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        LedgerStatus status = LEDGER_OK;
+        uint64_t ticket = 0;
+        switch (op) {
+            case BENCH_BALANCE: {
+                int index = find_farmer_index(farmer_id);
+                if (index == -1) {
+                    status = LEDGER_NOT_FOUND;
+                    break;
+                }
+                w->checksum += farmer_at(index)->balance;
+                break;
+            }
+            case BENCH_STATEMENT: {
+                // The same page read as the statement screens
+                Transaction rows[BENCH_STATEMENT_ROWS];
+                StatementCursor page;
+                statement_latest(&page, farmer_id, BENCH_STATEMENT_ROWS);
+                int count = statement_read(&page, rows, NULL);
+                if (count == -1) {
+                    status = LEDGER_NOT_FOUND;
+                    break;
+                }
+                for (int r = 0; r < count; r++) {
+                    w->checksum += rows[r].amount;
+                }
+                break;
+            }
+            case BENCH_DEPOSIT:
+                status = ledger_deposit(farmer_id, amount, "Benchmark deposit", &ticket);
+                break;
+            case BENCH_WITHDRAW:
+                status = ledger_withdraw(farmer_id, amount, "Benchmark withdrawal", &ticket);
+                break;
+            default:
+                if (to_id == farmer_id) to_id = w->first_id + (farmer_id - w->first_id + 1) % w->accounts;
+                status = ledger_transfer(farmer_id, to_id, amount, "Benchmark transfer", &ticket);
+                break;
+        }
+        // Writes count until settled, exactly as long as a teller waits for the receipt
+        if (status == LEDGER_OK && ticket != 0) wait_for_settlement(ticket);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        
+        if (status != LEDGER_OK) w->rejected++;
+        histogram_record(&w->latency[op], (uint64_t)((end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec)));
+    }
+    return NULL;
+}
+
+void bench_load(int accounts, int threads, int ops, int hot_percent, int read_percent) {
+    if (accounts < 2) accounts = 2;
+    if (threads < 1) threads = 1;
+    if (ops < 1) ops = 1;
+    if (hot_percent < 0) hot_percent = 0;
+    if (hot_percent > 100) hot_percent = 100;
+    if (read_percent < 0) read_percent = 0;
+    if (read_percent > 100) read_percent = 100;
+    int hot_accounts = accounts / 100 > 0 ? accounts / 100 : 1;
+    
+    // A scratch directory keeps the benchmark journal away from the real one
+    char original[4096];
+    char scratch[] = "/tmp/sacco-bench-XXXXXX";
+    if (getcwd(original, sizeof(original)) == NULL || mkdtemp(scratch) == NULL || chdir(scratch) == -1) {
+        printf("\n❌ Error: cannot create benchmark directory: %s\n", strerror(errno));
+        exit(1);
+    }
+    start_engine();
+    
+    double start = now_seconds();
+    char username[50];
+    int first_id = 0;
+    for (int i = 0; i < accounts; i++) {
+        snprintf(username, sizeof(username), "bench_%d", i + 1);
+        int farmer_id = create_farmer(username, 1000 + i % 9000);
+        if (i == 0) first_id = farmer_id;
+        ledger_deposit(farmer_id, 100000, "Benchmark opening balance", NULL);
+    }
+    settle_all();
+    double setup = now_seconds() - start;
+    
+    printf("\n📊 Load benchmark: %d accounts, %d threads x %d operations (set up in %.2fs)\n", accounts, threads, ops, setup);
+    printf("   %d%% of operations on the %d hottest accounts, %d%% reads\n\n", hot_percent, hot_accounts, read_percent);
+    
+    BenchWorker* workers = (BenchWorker*)calloc((size_t)threads, sizeof(BenchWorker));
+    if (workers == NULL) {
+        printf("\n❌ Error: out of memory for benchmark!\n");
+        exit(1);
+    }
+    start = now_seconds();
+    for (int t = 0; t < threads; t++) {
+        workers[t].first_id = first_id;
+        workers[t].accounts = accounts;
+        workers[t].hot_accounts = hot_accounts;
+        workers[t].hot_percent = hot_percent;
+        workers[t].read_percent = read_percent;
+        workers[t].ops = ops;
+        workers[t].seed = 2463534242u + 7919u * (uint32_t)t;
+        if (pthread_create(&workers[t].thread, NULL, bench_load_worker, &workers[t]) != 0) {
+            printf("\n❌ Error: cannot start benchmark thread!\n");
+            exit(1);
+        }
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    double elapsed = now_seconds() - start;
+    
+    const char* names[BENCH_OP_KINDS] = {"balance", "statement", "deposit", "withdraw", "transfer"};
+    LatencyHistogram* merged = (LatencyHistogram*)calloc(BENCH_OP_KINDS + 1, sizeof(LatencyHistogram));
+    long long rejected = 0;
+    money_t checksum = 0;
+    for (int t = 0; t < threads; t++) {
+        for (int k = 0; k < BENCH_OP_KINDS; k++) {
+            histogram_merge(&merged[k], &workers[t].latency[k]);
+            histogram_merge(&merged[BENCH_OP_KINDS], &workers[t].latency[k]);
+        }
+        rejected += workers[t].rejected;
+        checksum += workers[t].checksum;
+    }
+    
+    printf("  %-10s %10s %12s %10s %10s %10s %10s\n", "Operation", "ops", "ops/sec", "p50 us", "p99 us", "p999 us", "max us");
+    for (int k = 0; k <= BENCH_OP_KINDS; k++) {
+        LatencyHistogram* h = &merged[k];
+        if (h->total == 0) continue;
+        printf("  %-10s %10llu %12.0f %10.1f %10.1f %10.1f %10.1f\n", k < BENCH_OP_KINDS ? names[k] : "all",
+               (unsigned long long)h->total, h->total / elapsed,
+               histogram_percentile(h, 50.0) / 1000.0, histogram_percentile(h, 99.0) / 1000.0,
+               histogram_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+    }
+    SystemStats stats = stats_snapshot();
+    printf("\n  %.2fs elapsed, %lld refused by the ledger, %lld transactions settled, checksum %lld\n",
+           elapsed, rejected, (long long)stats.transactions, (long long)checksum);
+    printf("\n📈 Engine metrics\n");
+    metrics_dump(stdout, false);
+    
+    free(merged);
+    free(workers);
+    shutdown_system();
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        char path[256];
+        shard_file_name(path, sizeof(path), JOURNAL_FILE, s);
+        unlink(path);
+        shard_file_name(path, sizeof(path), LEDGER_FILE, s);
+        unlink(path);
+    }
+    unlink(SNAPSHOT_FILE);
+    if (chdir(original) == -1 || rmdir(scratch) == -1) {
+        printf("\n⚠️  Could not remove benchmark directory %s\n", scratch);
+    }
+}
+
+bool ingest_open(IngestReader* r, const char* path) {
+    r->fp = fopen(path, "rb");
+    if (r->fp == NULL) return false;
+    // Large stdio buffer: the file is read front to back exactly once per pass
+    setvbuf(r->fp, NULL, _IOFBF, 1 << 20);
+    ingest_rewind(r);
+    return true;
+}
+
+void ingest_rewind(IngestReader* r) {
+    char magic[sizeof(INGEST_MAGIC) - 1];
+    rewind(r->fp);
+    r->record = 0;
+    r->binary = fread(magic, 1, sizeof(magic), r->fp) == sizeof(magic) &&
+                memcmp(magic, INGEST_MAGIC, sizeof(magic)) == 0;
+    if (!r->binary) rewind(r->fp);
+}
+
+int ingest_next(IngestReader* r, IngestRecord* rec) {
+    if (r->binary) {
+        size_t got = fread(rec, 1, sizeof(*rec), r->fp);
+        if (got == 0) return 0;
+        r->record++;
+        if (got != sizeof(*rec)) return -1;
+        rec->description[sizeof(rec->description) - 1] = '\0';
+        return (rec->type == 'D' || rec->type == 'W' || rec->type == 'T') ? 1 : -1;
+    }
+    
+    while (fgets(r->line, sizeof(r->line), r->fp) != NULL) {
+        size_t len = strcspn(r->line, "\r\n");
+        if (r->line[len] == '\0' && !feof(r->fp)) {
+            // Longer than any valid record: skip the rest of it
+            int c;
+            while ((c = fgetc(r->fp)) != EOF && c != '\n') {}
+            r->record++;
+            return -1;
+        }
+        r->line[len] = '\0';
+        // Blank lines, comments and the header row are not records
+        if (len == 0 || r->line[0] == '#' || strncmp(r->line, "type,", 5) == 0) continue;
+        r->record++;
+        return ingest_parse_csv(r->line, rec) ? 1 : -1;
+    }
+    return 0;
+}
+
+bool ingest_parse_csv(char* line, IngestRecord* rec) {
+    // type,farmer_id,amount,to_id,description; description comes last so it may contain commas
+    char* field = line;
+    char* end;
+    memset(rec, 0, sizeof(*rec));
+    
+    if (field[0] == '\0' || field[1] != ',') return false;
+    rec->type = field[0];
+    if (rec->type != 'D' && rec->type != 'W' && rec->type != 'T') return false;
+    field += 2;
+    
+    long farmer_id = strtol(field, &end, 10);
+    if (end == field || *end != ',' || farmer_id <= 0 || farmer_id > INT32_MAX) return false;
+    rec->farmer_id = (int32_t)farmer_id;
+    field = end + 1;
+    
+    const char* after = parse_money(field, &rec->amount);
+    if (after == NULL || *after != ',') return false;
+    field = (char*)after + 1;
+    
+    if (*field != ',') {
+        long to_id = strtol(field, &end, 10);
+        if (end == field || *end != ',' || to_id <= 0 || to_id > INT32_MAX) return false;
+        rec->to_id = (int32_t)to_id;
+        field = end;
+    }
+    if ((rec->type == 'T') != (rec->to_id != 0)) return false;
+    field++;
+    
+    snprintf(rec->description, sizeof(rec->description), "%s", field);
+    return true;
+}
+
+LedgerStatus ingest_check(const IngestRecord* rec, money_t* projected) {
+    // Dry run against projected balances; nothing is changed
+    if (rec->amount <= 0 || rec->amount > MONEY_MAX) return LEDGER_INVALID_AMOUNT;
+    int index = find_farmer_index(rec->farmer_id);
+    if (index == -1) return LEDGER_NOT_FOUND;
+    
+    if (rec->type == 'D') {
+        if (projected[index] > MONEY_MAX - rec->amount) return LEDGER_LIMIT_EXCEEDED;
+        projected[index] += rec->amount;
+        return LEDGER_OK;
+    }
+    if (rec->amount > projected[index]) return LEDGER_INSUFFICIENT_FUNDS;
+    
+    int to = -1;
+    if (rec->type == 'T') {
+        if (rec->to_id == rec->farmer_id) return LEDGER_SAME_ACCOUNT;
+        to = find_farmer_index(rec->to_id);
+        if (to == -1) return LEDGER_NOT_FOUND;
+        if (projected[to] > MONEY_MAX - rec->amount) return LEDGER_LIMIT_EXCEEDED;
+        projected[to] += rec->amount;
+    }
+    projected[index] -= rec->amount;
+    return LEDGER_OK;
+}
+
+LedgerStatus ingest_apply(const IngestRecord* rec, uint64_t* ticket) {
+    const char* description = rec->description;
+    if (rec->type == 'D') {
+        return ledger_deposit(rec->farmer_id, rec->amount, description[0] ? description : "Bulk credit", ticket);
+    }
+    if (rec->type == 'W') {
+        return ledger_withdraw(rec->farmer_id, rec->amount, description[0] ? description : "Bulk debit", ticket);
+    }
+    return ledger_transfer(rec->farmer_id, rec->to_id, rec->amount, description, ticket);
+}
+
+int disburse_file(int from_id, const char* path, const char* note) {
+    // One "farmer_id,amount" line per payment; the whole file settles as one bulk transfer
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        printf("\n❌ Error: cannot open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    
+    TransferLeg* legs = NULL;
+    int count = 0;
+    int capacity = 0;
+    int* line_of = NULL; // File line of each leg, for error messages
+    char line[256];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line_number++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        
+        char* comma = strchr(line, ',');
+        money_t amount = 0;
+        const char* end = comma ? parse_money(comma + 1, &amount) : NULL;
+        bool valid = end != NULL && *end == '\0';
+        if (!valid || count == BULK_MAX_LEGS) {
+            if (!valid) {
+                printf("\n❌ Error: line %d of %s is not a valid \"farmer_id,amount\" payment\n", line_number, path);
+            } else {
+                printf("\n❌ Error: line %d of %s is payment %d; one disbursement holds at most %d payments\n",
+                       line_number, path, count + 1, BULK_MAX_LEGS);
+            }
+            fclose(fp);
+            free(legs);
+            free(line_of);
+            return 1;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            legs = (TransferLeg*)realloc(legs, (size_t)capacity * sizeof(TransferLeg));
+            line_of = (int*)realloc(line_of, (size_t)capacity * sizeof(int));
+            if (legs == NULL || line_of == NULL) {
+                printf("\n❌ Error: out of memory for disbursement!\n");
+                exit(1);
+            }
+        }
+        legs[count].to_id = atoi(line);
+        legs[count].amount = amount;
+        line_of[count] = line_number;
+        count++;
+    }
+    fclose(fp);
+    
+    printf("\n💸 Disbursing %d payments from account %d (%s)\n", count, from_id, path);
+    double start = now_seconds();
+    int failed_leg;
+    uint64_t ticket = 0;
+    LedgerStatus status = ledger_bulk_transfer(from_id, legs, count, note, &failed_leg, &ticket);
+    if (status != LEDGER_OK) {
+        if (failed_leg >= 0) {
+            printf("\n❌ Nothing was paid: line %d (farmer %d): %s\n", line_of[failed_leg],
+                   legs[failed_leg].to_id, ledger_status_message(status));
+        } else {
+            printf("\n❌ Nothing was paid: %s\n", ledger_status_message(status));
+        }
+        free(legs);
+        free(line_of);
+        return 1;
+    }
+    wait_for_settlement(ticket);
+    double elapsed = now_seconds() - start;
+    
+    money_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += legs[i].amount;
+    }
+    char money[MONEY_TEXT_SIZE];
+    printf("\n✅ Paid $%s to %d accounts in %.3fs (%.0f payments/sec)\n", money_text(total, money), count,
+           elapsed, elapsed > 0 ? count / elapsed : 0.0);
+    free(legs);
+    free(line_of);
+    return 0;
+}
+
+int close_month(const char* rate_text, const char* description) {
+    // The annual rate is a percentage with up to two decimals; ledger_accrue() pays a twelfth of it
+    money_t hundredths;
+    const char* end = parse_money(rate_text, &hundredths);
+    if (end == NULL || *end != '\0' || hundredths <= 0 || hundredths > 100 * 100) {
+        printf("\n❌ Error: \"%s\" is not an annual rate between 0.01 and 100 percent\n", rate_text);
+        return 1;
+    }
+    int64_t rate = hundredths * (ACCRUAL_RATE_SCALE / (100 * 100));
+    
+    // The calendar month is the period: each shard closes it once, whatever the rate or text
+    time_t now = time(NULL);
+    struct tm local = *localtime(&now);
+    int32_t period = (local.tm_year + 1900) * 100 + local.tm_mon + 1;
+    char text[DESCRIPTION_MAX];
+    if (description == NULL) {
+        char month[8];
+        strftime(month, sizeof(month), "%Y-%m", &local);
+        snprintf(text, sizeof(text), "Interest %s at %s%% p.a.", month, rate_text);
+        description = text;
+    }
+    
+    printf("\n📅 Month-end close %d: crediting \"%s\" to every account\n", period, description);
+    double start = now_seconds();
+    AccrualSummary summary;
+    LedgerStatus status = ledger_accrue(rate, period, description, &summary);
+    if (status != LEDGER_OK) {
+        printf("\n❌ Nothing was credited: %s\n", ledger_status_message(status));
+        return 1;
+    }
+    double elapsed = now_seconds() - start;
+    
+    int skipped = 0;
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        if (summary.already_closed[s]) skipped++;
+    }
+    if (skipped > 0) {
+        printf("\n⚠️  %d of %d shards already closed %d; their accounts were not credited again\n",
+               skipped, SHARD_COUNT, period);
+    }
+    char money[MONEY_TEXT_SIZE];
+    printf("\n✅ Credited $%s to %lld accounts in %.3fs (%.0f accounts/sec)\n", money_text(summary.total, money),
+           summary.accounts, elapsed, elapsed > 0 ? summary.accounts / elapsed : 0.0);
+    return 0;
+}
+
+int ingest_file(const char* path, bool all_or_nothing) {
+    IngestReader reader;
+    if (!ingest_open(&reader, path)) {
+        printf("\n❌ Error: cannot open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    
+    printf("\n📥 Ingesting %s (%s%s)\n", path, reader.binary ? "binary" : "CSV",
+           all_or_nothing ? ", all-or-nothing" : "");
+    if (all_or_nothing) {
+        int result = ingest_atomic(&reader);
+        fclose(reader.fp);
+        return result;
+    }
+    IngestRecord rec;
+    long long rejected = 0;
+    int status;
+    double start = now_seconds();
+    
+    // Apply in batches; each batch is settled (journaled and fsynced) before the next is read
+    long long applied = 0;
+    while ((status = ingest_next(&reader, &rec)) != 0) {
+        LedgerStatus result = status == 1 ? ingest_apply(&rec, NULL) : LEDGER_INVALID_AMOUNT;
+        if (result == LEDGER_OK) {
+            // Records land on several shards, so a batch is done when all of them are
+            if (++applied % INGEST_BATCH == 0) settle_all();
+            continue;
+        }
+        if (rejected < INGEST_MAX_ERRORS_SHOWN) {
+            printf("❌ Record %lld: %s\n", reader.record, status == 1 ? ledger_status_message(result) : "malformed record");
+        }
+        rejected++;
+    }
+    settle_all();
+    double elapsed = now_seconds() - start;
+    fclose(reader.fp);
+    
+    if (rejected > INGEST_MAX_ERRORS_SHOWN) {
+        printf("   ... %lld more rejected records not shown\n", rejected - INGEST_MAX_ERRORS_SHOWN);
+    }
+    printf("\n✅ Applied %lld of %lld records in %.2fs (%.0f records/sec)\n",
+           applied, reader.record, elapsed, elapsed > 0 ? reader.record / elapsed : 0.0);
+    return rejected > 0 ? 1 : 0;
+}
+
+int ingest_atomic(IngestReader* reader) {
+    // Checks the whole file against projected balances, listing every bad record, then
+    // applies it as one bulk batch: one journal write, so a crash keeps all of it or none
+    IngestRecord rec;
+    IngestRecord* records = NULL;
+    long long count = 0;
+    long long capacity = 0;
+    long long rejected = 0;
+    long long rows = 0;            // Ledger rows the batch would store: two for a 'T'
+    int status;
+    double start = now_seconds();
+    money_t* projected = (money_t*)malloc((size_t)(num_farmers ? num_farmers : 1) * sizeof(money_t));
+    if (projected == NULL) {
+        printf("\n❌ Error: out of memory for ingest check!\n");
+        exit(1);
+    }
+    for (int i = 0; i < num_farmers; i++) projected[i] = farmer_at(i)->balance;
+    
+    while ((status = ingest_next(reader, &rec)) != 0) {
+        const char* reason = status == -1 ? "malformed record" : NULL;
+        if (reason == NULL) {
+            LedgerStatus checked = ingest_check(&rec, projected);
+            if (checked != LEDGER_OK) reason = ledger_status_message(checked);
+        }
+        if (reason != NULL) {
+            if (rejected < INGEST_MAX_ERRORS_SHOWN) printf("❌ Record %lld: %s\n", reader->record, reason);
+            rejected++;
+            continue;
+        }
+        rows += rec.type == 'T' ? 2 : 1;
+        if (rejected > 0 || rows > BULK_MAX_LEGS) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            records = (IngestRecord*)realloc(records, (size_t)capacity * sizeof(IngestRecord));
+            if (records == NULL) {
+                printf("\n❌ Error: out of memory for ingest!\n");
+                exit(1);
+            }
+        }
+        records[count++] = rec;
+    }
+    free(projected);
+    if (rejected > INGEST_MAX_ERRORS_SHOWN) {
+        printf("   ... %lld more rejected records not shown\n", rejected - INGEST_MAX_ERRORS_SHOWN);
+    }
+    if (rejected == 0 && rows > BULK_MAX_LEGS) {
+        printf("\n❌ %lld records make %lld ledger rows (a transfer makes two), more than the %d one "
+               "all-or-nothing ingest can hold; nothing was applied.\n", reader->record, rows, BULK_MAX_LEGS);
+        rejected = reader->record;
+    } else if (rejected > 0) {
+        printf("\n❌ %lld of %lld records rejected; nothing was applied.\n", rejected, reader->record);
+    } else if (count == 0) {
+        printf("\n✅ No records to apply\n");
+    }
+    if (rejected > 0 || count == 0) {
+        free(records);
+        return rejected > 0 ? 1 : 0;
+    }
+    
+    BatchEntry* entries = (BatchEntry*)malloc((size_t)count * sizeof(BatchEntry));
+    if (entries == NULL) {
+        printf("\n❌ Error: out of memory for ingest!\n");
+        exit(1);
+    }
+    for (long long i = 0; i < count; i++) {
+        const IngestRecord* r = &records[i];
+        const char* description = r->description;
+        if (description[0] == '\0' && r->type != 'T') description = r->type == 'D' ? "Bulk credit" : "Bulk debit";
+        entries[i] = (BatchEntry){ .farmer_id = r->farmer_id, .to_id = r->to_id, .amount = r->amount,
+                                   .type = r->type, .description = description };
+    }
+    
+    // Balances may have moved since the check; the engine checks again under its locks
+    int failed_entry;
+    LedgerStatus result = ledger_apply_batch(entries, (int)count, &failed_entry, NULL);
+    free(entries);
+    free(records);
+    if (result != LEDGER_OK) {
+        if (failed_entry >= 0) {
+            printf("\n❌ Nothing was applied: record %d: %s\n", failed_entry + 1, ledger_status_message(result));
+        } else {
+            printf("\n❌ Nothing was applied: %s\n", ledger_status_message(result));
+        }
+        return 1;
+    }
+    // Settled once every shard has journaled its part, handed-over rows included
+    settle_all();
+    double elapsed = now_seconds() - start;
+    printf("\n✅ Applied all %lld records as one batch in %.2fs (%.0f records/sec)\n",
+           count, elapsed, elapsed > 0 ? count / elapsed : 0.0);
+    return 0;
+}
+
+void bench_history_alloc(long long transactions, int accounts) {
+    // Each variant runs in its own child process so its peak RSS can be measured alone
+    if (transactions < 1) transactions = 1;
+    if (accounts < 1) accounts = 1;
+    printf("\n📊 History allocation benchmark: %lld transactions over %d accounts\n\n", transactions, accounts);
+    printf("  %-14s %16s %14s %12s\n", "Allocator", "inserts/sec", "release ms", "max RSS MB");
+    
+    for (int variant = 0; variant < 2; variant++) {
+        int pipe_fd[2];
+        if (pipe(pipe_fd) == -1) {
+            printf("\n❌ Error: cannot create pipe: %s\n", strerror(errno));
+            return;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pipe_fd[0]);
+            int** history = (int**)calloc((size_t)accounts, sizeof(int*));
+            int* count = (int*)calloc((size_t)accounts, sizeof(int));
+            int* capacity = (int*)calloc((size_t)accounts, sizeof(int));
+            SlabAllocator slab;
+            memset(&slab, 0, sizeof(slab));
+            
+            // Same growth pattern as history_append(): start small, double when full
+            uint32_t seed = 2463534242u;
+            double start = now_seconds();
+            for (long long i = 0; i < transactions; i++) {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                int a = (int)(seed % (uint32_t)accounts);
+                if (count[a] == capacity[a]) {
+                    int grown = capacity[a] ? capacity[a] * 2 : HISTORY_INITIAL_CAPACITY;
+                    if (variant == 0) {
+                        history[a] = (int*)realloc(history[a], (size_t)grown * sizeof(int));
+                    } else {
+                        int* fresh = (int*)slab_alloc(&slab, (size_t)grown * sizeof(int));
+                        if (count[a] > 0) {
+                            memcpy(fresh, history[a], (size_t)count[a] * sizeof(int));
+                            slab_free(&slab, history[a], (size_t)capacity[a] * sizeof(int));
+                        }
+                        history[a] = fresh;
+                    }
+                    capacity[a] = grown;
+                }
+                history[a][count[a]++] = (int)i;
+            }
+            double insert = now_seconds() - start;
+            
+            start = now_seconds();
+            if (variant == 0) {
+                for (int a = 0; a < accounts; a++) free(history[a]);
+            } else {
+                slab_release_all(&slab);
+            }
+            double release = now_seconds() - start;
+            
+            double result[2] = { transactions / insert, release * 1000 };
+            if (write(pipe_fd[1], result, sizeof(result)) != (ssize_t)sizeof(result)) _exit(1);
+            _exit(0);
+        }
+        close(pipe_fd[1]);
+        
+        double result[2] = { 0, 0 };
+        int status;
+        struct rusage usage;
+        ssize_t got = read(pipe_fd[0], result, sizeof(result));
+        close(pipe_fd[0]);
+        if (pid == -1 || wait4(pid, &status, 0, &usage) == -1 || got != (ssize_t)sizeof(result)) {
+            printf("\n❌ Error: benchmark child failed\n");
+            return;
+        }
+        printf("  %-14s %16.0f %14.1f %12.1f\n", variant == 0 ? "malloc/realloc" : "slab",
+               result[0], result[1], usage.ru_maxrss / 1024.0);
+    }
+}
+
+volatile sig_atomic_t server_stopping = 0;
+
+void server_stop(int signal_number) {
+    (void)signal_number;
+    server_stopping = 1;
+}
+
+int server_listen(const char* address) {
+    // A number is a TCP port on the loopback interface; anything else is a Unix socket path
+    char* end;
+    long port = strtol(address, &end, 10);
+    int fd;
+    
+    if (*address != '\0' && *end == '\0') {
+        if (port <= 0 || port > 65535) {
+            errno = EINVAL;
+            return -1;
+        }
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) return -1;
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        struct sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons((uint16_t)port);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (struct sockaddr*)&sin, sizeof(sin)) == -1) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(sun.sun_path, address);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) return -1;
+        unlink(address);
+        if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) == -1) {
+            close(fd);
+            return -1;
+        }
+    }
+    
+    if (listen(fd, SOMAXCONN) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int server_run(const char* address) {
+    Server server;
+    memset(&server, 0, sizeof(server));
+    
+    server.listen_fd = server_listen(address);
+    if (server.listen_fd == -1) {
+        printf("\n❌ Error: cannot listen on %s: %s\n", address, strerror(errno));
+        return 1;
+    }
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.settle_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server.epoll_fd == -1 || server.settle_fd == -1) {
+        printf("\n❌ Error: cannot set up event loop: %s\n", strerror(errno));
+        return 1;
+    }
+    
+    // The listening socket and the eventfd are told apart from clients by their data pointer
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &server.listen_fd;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &ev);
+    ev.data.ptr = &server.settle_fd;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.settle_fd, &ev);
+    
+    settlement_notify(server.settle_fd);
+    
+    // SIGINT/SIGTERM interrupt epoll_wait so the loop can shut down cleanly
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = server_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    
+    printf("\n🌐 SACCO server listening on %s\n", address);
+    fflush(stdout);
+    
+    struct epoll_event events[SERVER_EVENTS];
+    while (!server_stopping) {
+        int n = epoll_wait(server.epoll_fd, events, SERVER_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            printf("\n❌ Error: epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+        
+        for (int i = 0; i < n; i++) {
+            void* tag = events[i].data.ptr;
+            if (tag == &server.listen_fd) {
+                server_accept(&server);
+            } else if (tag == &server.settle_fd) {
+                uint64_t count;
+                if (read(server.settle_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                    printf("\n❌ Error: eventfd read failed: %s\n", strerror(errno));
+                }
+                server_settled(&server);
+            } else {
+                Connection* c = (Connection*)tag;
+                if (c->fd == -1) continue;
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    server_close(&server, c);
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) connection_flush(&server, c);
+                if (c->fd != -1 && (events[i].events & EPOLLIN)) server_read(&server, c);
+            }
+        }
+        
+        // Nothing from this pass can refer to these any more
+        while (server.closed != NULL) {
+            Connection* c = server.closed;
+            server.closed = c->next_closed;
+            free(c->out);
+            free(c);
+        }
+    }
+    
+    // Stop signalling before the eventfd goes away; the worker drains on shutdown
+    settlement_notify(-1);
+    while (server.waiting_count > 0) {
+        server_close(&server, server.waiting[0]);
+    }
+    while (server.closed != NULL) {
+        Connection* c = server.closed;
+        server.closed = c->next_closed;
+        free(c->out);
+        free(c);
+    }
+    free(server.waiting);
+    close(server.settle_fd);
+    close(server.epoll_fd);
+    close(server.listen_fd);
+    printf("\n👋 Server stopped. Open client connections were dropped.\n");
+    return 0;
+}
+
+void server_accept(Server* server) {
+    while (true) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                printf("\n⚠️  accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+        
+        Connection* c = (Connection*)calloc(1, sizeof(Connection));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->events = EPOLLIN;
+        struct epoll_event ev;
+        ev.events = c->events;
+        ev.data.ptr = c;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+void server_read(Server* server, Connection* c) {
+    while (c->fd != -1 && !c->closing) {
+        if (c->in_used == sizeof(c->in)) {
+            if (c->ticket == 0) {
+                connection_printf(server, c, "ERR line too long\n");
+                c->closing = true;
+                connection_flush(server, c);
+            } else {
+                // Full behind a held reply: stop reading until it settles
+                connection_watch(server, c);
+            }
+            return;
+        }
+        
+        ssize_t n = read(c->fd, c->in + c->in_used, sizeof(c->in) - c->in_used);
+        if (n == 0) {
+            // Client went away; a reply still held for it is simply dropped
+            server_close(server, c);
+            return;
+        }
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) server_close(server, c);
+            return;
+        }
+        c->in_used += (size_t)n;
+        server_handle_lines(server, c);
+    }
+}
+
+void server_handle_lines(Server* server, Connection* c) {
+    // Requests are answered strictly in order: nothing more is taken out of the
+    // buffer while a reply is held for settlement
+    size_t start = 0;
+    while (c->fd != -1 && c->ticket == 0 && !c->closing) {
+        char* newline = memchr(c->in + start, '\n', c->in_used - start);
+        if (newline == NULL) break;
+        *newline = '\0';
+        if (newline > c->in + start && newline[-1] == '\r') newline[-1] = '\0';
+        server_command(server, c, c->in + start);
+        start = (size_t)(newline - c->in) + 1;
+    }
+    if (c->fd == -1) return;
+    memmove(c->in, c->in + start, c->in_used - start);
+    c->in_used -= start;
+}
+
+void server_command(Server* server, Connection* c, char* line) {
+    char* cursor = line;
+    char* verb = strsep(&cursor, " ");
+    char money[MONEY_TEXT_SIZE];
+    
+    if (strcmp(verb, "QUIT") == 0) {
+        connection_printf(server, c, "OK bye\n");
+        c->closing = true;
+        connection_flush(server, c);
+        return;
+    }
+    if (strcmp(verb, "METRICS") == 0) {
+        // "OK <lines>", then the dump; METRICS json sends a single JSON line
+        char* format = strsep(&cursor, " ");
+        char* text = NULL;
+        size_t len = 0;
+        FILE* out = open_memstream(&text, &len);
+        if (out == NULL) {
+            connection_printf(server, c, "ERR %s\n", strerror(errno));
+            return;
+        }
+        metrics_dump(out, format != NULL && strcmp(format, "json") == 0);
+        fclose(out);
+        int lines = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (text[i] == '\n') lines++;
+        }
+        connection_printf(server, c, "OK %d\n", lines);
+        connection_send(server, c, text, len);
+        free(text);
+        return;
+    }
+    if (strcmp(verb, "AUTH") == 0) {
+        char* username = strsep(&cursor, " ");
+        char* pin = strsep(&cursor, " ");
+        int farmer_id = (username && pin) ? check_login(username, atoi(pin)) : -1;
+        if (farmer_id == -1) {
+            connection_printf(server, c, "ERR authentication failed\n");
+        } else {
+            c->farmer_id = farmer_id;
+            connection_printf(server, c, "OK %d\n", farmer_id);
+        }
+        return;
+    }
+    if (c->farmer_id == 0) {
+        connection_printf(server, c, "ERR not authenticated\n");
+        return;
+    }
+    
+    int index = find_farmer_index(c->farmer_id);
+    if (index == -1) {
+        connection_printf(server, c, "ERR account closed\n");
+        c->farmer_id = 0;
+        return;
+    }
+    Farmer* f = farmer_at(index);
+    
+    if (strcmp(verb, "BALANCE") == 0) {
+        connection_printf(server, c, "OK %s\n", money_text(f->balance, money));
+        return;
+    }
+    if (strcmp(verb, "STATEMENT") == 0) {
+        // Newest first: "OK <rows>", then "<unix time> <D|W> <amount> <description>" per row
+        char* count_text = strsep(&cursor, " ");
+        int n = count_text ? atoi(count_text) : SERVER_STATEMENT_DEFAULT;
+        if (n < 1) {
+            connection_printf(server, c, "ERR row count must be at least 1\n");
+            return;
+        }
+        if (n > SERVER_STATEMENT_MAX) n = SERVER_STATEMENT_MAX;
+        
+        StatementCursor page;
+        statement_latest(&page, c->farmer_id, n);
+        Transaction* rows = (Transaction*)malloc((size_t)page.page_size * sizeof(Transaction));
+        int count = statement_read(&page, rows, NULL);
+        if (count < 0) count = 0;
+        
+        connection_printf(server, c, "OK %d\n", count);
+        for (int i = count - 1; i >= 0; i--) {
+            connection_printf(server, c, "%lld %c %s %s\n", (long long)rows[i].timestamp, rows[i].type,
+                              money_text(rows[i].amount, money), description_at(rows[i].description));
+        }
+        free(rows);
+        return;
+    }
+    if (strcmp(verb, "PAGE") == 0) {
+        // PAGE [size] opens at the newest page, PAGE <token> reopens one. Replies
+        // "OK <rows> <older token|-> <newer token|->", then the rows as STATEMENT sends them.
+        char* arg = strsep(&cursor, " ");
+        StatementCursor page;
+        if (arg != NULL && strchr(arg, ':') != NULL) {
+            if (!statement_resume(&page, arg) || page.farmer_id != c->farmer_id ||
+                page.page_size > SERVER_STATEMENT_MAX) {
+                connection_printf(server, c, "ERR bad page token\n");
+                return;
+            }
+        } else {
+            int size = arg ? atoi(arg) : SERVER_STATEMENT_DEFAULT;
+            if (size < 1) {
+                connection_printf(server, c, "ERR page size must be at least 1\n");
+                return;
+            }
+            statement_latest(&page, c->farmer_id, size > SERVER_STATEMENT_MAX ? SERVER_STATEMENT_MAX : size);
+        }
+        
+        Transaction* rows = (Transaction*)malloc((size_t)page.page_size * sizeof(Transaction));
+        int count = statement_read(&page, rows, NULL);
+        if (count < 0) count = 0;
+        
+        char older_token[STATEMENT_TOKEN_SIZE] = "-";
+        char newer_token[STATEMENT_TOKEN_SIZE] = "-";
+        StatementCursor next = page;
+        if (statement_older(&next)) statement_token(&next, older_token);
+        next = page;
+        if (statement_newer(&next)) statement_token(&next, newer_token);
+        
+        connection_printf(server, c, "OK %d %s %s\n", count, older_token, newer_token);
+        for (int i = count - 1; i >= 0; i--) {
+            connection_printf(server, c, "%lld %c %s %s\n", (long long)rows[i].timestamp, rows[i].type,
+                              money_text(rows[i].amount, money), description_at(rows[i].description));
+        }
+        free(rows);
+        return;
+    }
+    
+    // DEPOSIT <amount> [text], WITHDRAW <amount> [text], TRANSFER <to_id> <amount> [note]
+    bool transfer = strcmp(verb, "TRANSFER") == 0;
+    if (!transfer && strcmp(verb, "DEPOSIT") != 0 && strcmp(verb, "WITHDRAW") != 0) {
+        connection_printf(server, c, "ERR unknown command\n");
+        return;
+    }
+    int to_id = 0;
+    if (transfer) {
+        char* to_text = strsep(&cursor, " ");
+        to_id = to_text ? atoi(to_text) : 0;
+    }
+    char* amount_text = strsep(&cursor, " ");
+    money_t amount = 0;
+    const char* end = amount_text ? parse_money(amount_text, &amount) : NULL;
+    if (end == NULL || *end != '\0') {
+        connection_printf(server, c, "ERR %s\n", ledger_status_message(LEDGER_INVALID_AMOUNT));
+        return;
+    }
+    const char* text = cursor ? cursor : "";
+    
+    uint64_t ticket = 0;
+    LedgerStatus status;
+    if (transfer) {
+        status = ledger_transfer(c->farmer_id, to_id, amount, text, &ticket);
+    } else if (verb[0] == 'D') {
+        status = ledger_deposit(c->farmer_id, amount, text[0] ? text : "Cash deposit", &ticket);
+    } else {
+        status = ledger_withdraw(c->farmer_id, amount, text[0] ? text : "Cash withdrawal", &ticket);
+    }
+    if (status != LEDGER_OK) {
+        connection_printf(server, c, "ERR %s\n", ledger_status_message(status));
+        return;
+    }
+    
+    // Acknowledge only once durable; the loop keeps serving other clients meanwhile
+    snprintf(c->held, sizeof(c->held), "OK %s\n", money_text(f->balance, money));
+    if (ticket_settled(ticket)) {
+        connection_send(server, c, c->held, strlen(c->held));
+        return;
+    }
+    c->ticket = ticket;
+    server_hold(server, c);
+}
+
+void server_hold(Server* server, Connection* c) {
+    if (server->waiting_count == server->waiting_capacity) {
+        int capacity = server->waiting_capacity ? server->waiting_capacity * 2 : 64;
+        Connection** waiting = (Connection**)realloc(server->waiting, (size_t)capacity * sizeof(Connection*));
+        if (waiting == NULL) {
+            printf("\n❌ Error: out of memory for server!\n");
+            exit(1);
+        }
+        server->waiting = waiting;
+        server->waiting_capacity = capacity;
+    }
+    server->waiting[server->waiting_count++] = c;
+}
+
+void server_settled(Server* server) {
+    // Take the whole list: clients resumed below may hold a new reply straight away
+    Connection** waiting = server->waiting;
+    int count = server->waiting_count;
+    server->waiting = NULL;
+    server->waiting_count = 0;
+    server->waiting_capacity = 0;
+    
+    for (int i = 0; i < count; i++) {
+        Connection* c = waiting[i];
+        if (c->fd == -1) continue;
+        if (!ticket_settled(c->ticket)) {
+            server_hold(server, c);
+            continue;
+        }
+        c->ticket = 0;
+        connection_send(server, c, c->held, strlen(c->held));
+        if (c->fd == -1) continue;
+        server_handle_lines(server, c);
+        if (c->fd != -1) connection_watch(server, c);
+    }
+    free(waiting);
+}
+
+void server_close(Server* server, Connection* c) {
+    if (c->fd == -1) return;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    
+    for (int i = 0; i < server->waiting_count; i++) {
+        if (server->waiting[i] == c) {
+            server->waiting[i] = server->waiting[--server->waiting_count];
+            break;
+        }
+    }
+    c->next_closed = server->closed;
+    server->closed = c;
+}
+
+void connection_watch(Server* server, Connection* c) {
+    // Read unless the input buffer is full behind a held reply; write while output is queued
+    uint32_t events = 0;
+    if (!(c->ticket != 0 && c->in_used == sizeof(c->in))) events |= EPOLLIN;
+    if (c->out_used > 0) events |= EPOLLOUT;
+    if (events == c->events) return;
+    
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+void connection_send(Server* server, Connection* c, const char* text, size_t len) {
+    if (c->fd == -1) return;
+    
+    // Write straight through when nothing is queued; keep whatever the socket refuses
+    if (c->out_used == 0) {
+        ssize_t n = send(c->fd, text, len, MSG_NOSIGNAL);
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            server_close(server, c);
+            return;
+        }
+        if (n > 0) {
+            text += n;
+            len -= (size_t)n;
+        }
+        if (len == 0) return;
+    }
+    
+    if (c->out_used + len > c->out_size) {
+        size_t size = c->out_size ? c->out_size : 4096;
+        while (c->out_used + len > size) size *= 2;
+        char* out = (char*)realloc(c->out, size);
+        if (out == NULL) {
+            server_close(server, c);
+            return;
+        }
+        c->out = out;
+        c->out_size = size;
+    }
+    memcpy(c->out + c->out_used, text, len);
+    c->out_used += len;
+    connection_watch(server, c);
+}
+
+void connection_printf(Server* server, Connection* c, const char* format, ...) {
+    char line[SERVER_LINE_MAX];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len < 0) return;
+    if ((size_t)len >= sizeof(line)) len = sizeof(line) - 1;
+    connection_send(server, c, line, (size_t)len);
+}
+
+void connection_flush(Server* server, Connection* c) {
+    size_t sent = 0;
+    while (c->fd != -1 && sent < c->out_used) {
+        ssize_t n = send(c->fd, c->out + sent, c->out_used - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            server_close(server, c);
+            return;
+        }
+        sent += (size_t)n;
+    }
+    if (c->fd == -1) return;
+    memmove(c->out, c->out + sent, c->out_used - sent);
+    c->out_used -= sent;
+    
+    if (c->out_used == 0 && c->closing) {
+        server_close(server, c);
+        return;
+    }
+    connection_watch(server, c);
+}
+
+void metrics_dump(FILE* out, bool json) {
+    // Text is one row per operation plus the gauges; JSON is one object on a single line
+    MetricsReport* r = (MetricsReport*)malloc(sizeof(MetricsReport));
+    if (r == NULL) {
+        printf("\n❌ Error: out of memory for metrics!\n");
+        exit(1);
+    }
+    metrics_report(r);
+    const HashGauge* gauges[2] = { &r->farmer_index, &r->username_index };
+    const char* gauge_names[2] = { "farmer_index", "username_index" };
+    
+    if (json) {
+        fprintf(out, "{\"threads\":%d,\"operations\":{", r->threads);
+        for (int id = 0; id < METRIC_COUNT; id++) {
+            const LatencyHistogram* h = &r->operations[id];
+            fprintf(out, "%s\"%s\":{\"unit\":\"%s\",\"count\":%llu,\"failed\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+                    id ? "," : "", metric_info[id].name, metric_info[id].unit, (unsigned long long)h->total,
+                    (unsigned long long)r->failed[id], (unsigned long long)histogram_percentile(h, 50.0),
+                    (unsigned long long)histogram_percentile(h, 99.0), (unsigned long long)histogram_percentile(h, 99.9),
+                    (unsigned long long)h->max);
+        }
+        fprintf(out, "},\"engine_up\":%s", r->engine_up ? "true" : "false");
+        if (!r->engine_up) {
+            fprintf(out, "}\n");
+            free(r);
+            return;
+        }
+        fprintf(out, ",\"shards\":[");
+        for (int s = 0; s < SHARD_COUNT; s++) {
+            fprintf(out, "%s{\"queue\":%d,\"handoffs\":%d,\"journal_pending\":%d,\"ledger_rows\":%lld}", s ? "," : "",
+                    r->queue_depth[s], r->handoff_depth[s], r->journal_pending[s], r->ledger_rows[s]);
+        }
+        fprintf(out, "]");
+        for (int g = 0; g < 2; g++) {
+            fprintf(out, ",\"%s\":{\"slots\":%u,\"live\":%u,\"deleted\":%u,\"mean_probes\":%.3f,\"max_probes\":%u}",
+                    gauge_names[g], gauges[g]->slots, gauges[g]->live, gauges[g]->deleted, gauges[g]->mean_probes,
+                    gauges[g]->max_probes);
+        }
+        fprintf(out, "}\n");
+        free(r);
+        return;
+    }
+    
+    fprintf(out, "%-18s %10s %8s %10s %10s %10s %10s %s\n", "operation", "count", "failed", "p50", "p99", "p999", "max", "unit");
+    for (int id = 0; id < METRIC_COUNT; id++) {
+        const LatencyHistogram* h = &r->operations[id];
+        fprintf(out, "%-18s %10llu %8llu %10llu %10llu %10llu %10llu %s\n", metric_info[id].name,
+                (unsigned long long)h->total, (unsigned long long)r->failed[id],
+                (unsigned long long)histogram_percentile(h, 50.0), (unsigned long long)histogram_percentile(h, 99.0),
+                (unsigned long long)histogram_percentile(h, 99.9), (unsigned long long)h->max, metric_info[id].unit);
+    }
+    if (!r->engine_up) {
+        // Before startup or after shutdown there are no shards or indexes to read
+        fprintf(out, "engine not running: no shard or index gauges\nthreads recording: %d\n", r->threads);
+        free(r);
+        return;
+    }
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        fprintf(out, "shard %d: queue %d, handoffs %d, journal pending %d, ledger rows %lld\n", s,
+                r->queue_depth[s], r->handoff_depth[s], r->journal_pending[s], r->ledger_rows[s]);
+    }
+    for (int g = 0; g < 2; g++) {
+        fprintf(out, "%s: %u slots, %u live, %u deleted, %.3f mean probes, %u max probes\n", gauge_names[g],
+                gauges[g]->slots, gauges[g]->live, gauges[g]->deleted, gauges[g]->mean_probes, gauges[g]->max_probes);
+    }
+    fprintf(out, "threads recording: %d\n", r->threads);
+    free(r);
+}
+
+void* metrics_signal_worker(void* arg) {
+    // SIGUSR1 and SIGUSR2 are blocked everywhere, so only this thread ever takes them
+    (void)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    
+    while (true) {
+        int signal_number;
+        if (sigwait(&set, &signal_number) != 0) continue;
+        
+        // Written aside and renamed, so a reader never sees half a dump
+        FILE* out = fopen(METRICS_FILE ".tmp", "w");
+        if (out == NULL) {
+            fprintf(stderr, "❌ Error: cannot write %s: %s\n", METRICS_FILE, strerror(errno));
+            continue;
+        }
+        metrics_dump(out, signal_number == SIGUSR2);
+        if (fclose(out) != 0 || rename(METRICS_FILE ".tmp", METRICS_FILE) != 0) {
+            fprintf(stderr, "❌ Error: cannot write %s: %s\n", METRICS_FILE, strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+void metrics_signals_start() {
+    // Must run before any other thread starts, so every thread inherits the blocked mask
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_signal_worker, NULL) != 0) {
+        printf("\n❌ Error: cannot start metrics thread!\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+void start_engine() {
+    // The engine reports; deciding to stop is the front end's call
+    LedgerStatus status = initialize_system();
+    if (status != LEDGER_OK) {
+        printf("\n❌ Error: %s\n", ledger_error());
+        if (status == LEDGER_JOURNAL_DAMAGED) {
+            printf("   The journal was left untouched; restore it from a backup before starting again.\n");
+        }
+        exit(1);
+    }
+}
+
+void print_notice(const char* message) {
+    printf("\n⚠️  %s\n", message);
+}
+
+void print_fatal(const char* message) {
+    printf("\n❌ Error: %s!\n", message);
+    fflush(stdout);
+    exit(1);
 }
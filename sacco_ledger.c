@@ -0,0 +1,3670 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "sacco_ledger.h"
+
+// Global data structures
+Farmer* farmer_blocks[MAX_FARMER_BLOCKS]; // Registry; blocks never move, so indices stay valid
+_Atomic int num_farmers = 0;
+int next_farmer_id = 1;
+pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER; // Opening and closing accounts
+pthread_mutex_t accrual_lock = PTHREAD_MUTEX_INITIALIZER;  // One month-end close at a time
+pthread_mutex_t account_locks[ACCOUNT_LOCK_STRIPES];
+Shard shards[SHARD_COUNT] = {
+    [0 ... SHARD_COUNT - 1] = {
+        .queue = {
+            .lock = PTHREAD_MUTEX_INITIALIZER,
+            .not_empty = PTHREAD_COND_INITIALIZER,
+            .not_full = PTHREAD_COND_INITIALIZER,
+            .settled_changed = PTHREAD_COND_INITIALIZER,
+            .notify_fd = -1
+        },
+        .journal = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER },
+        .ledger = { .fd = -1 }
+    }
+};
+_Atomic(FarmerHashTable*) farmer_hash_table;
+_Atomic(UsernameHashTable*) username_table;
+StringHeap descriptions = { .lock = PTHREAD_MUTEX_INITIALIZER };
+StatsBoard system_stats = { .write_lock = PTHREAD_MUTEX_INITIALIZER };
+HandoffRecovery handoff_recovery; // Only used while replaying
+Checkpointer checkpointer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .busy = PTHREAD_MUTEX_INITIALIZER
+};
+const MetricInfo metric_info[METRIC_COUNT] = {
+    [METRIC_DEPOSIT] = { "deposit", "ns" },
+    [METRIC_WITHDRAW] = { "withdraw", "ns" },
+    [METRIC_TRANSFER] = { "transfer", "ns" },
+    [METRIC_BULK_TRANSFER] = { "bulk_transfer", "ns" },
+    [METRIC_APPLY_BATCH] = { "apply_batch", "ns" },
+    [METRIC_ENQUEUE] = { "enqueue", "ns" },
+    [METRIC_LOOKUP] = { "farmer_lookup", "probes" },
+    [METRIC_SETTLE_BATCH] = { "settle_batch", "ns" },
+    [METRIC_BATCH_ROWS] = { "settle_batch_rows", "rows" },
+    [METRIC_JOURNAL_SYNC] = { "journal_sync", "ns" },
+    [METRIC_FEED_PUBLISH] = { "feed_publish", "ns" }
+};
+MetricsThread* metrics_threads;   // Blocks of the threads still running
+MetricsThread* metrics_free;      // Zeroed blocks left by threads that exited, reused by new ones
+MetricsThread metrics_retired;    // What the exited threads recorded, under metrics_lock
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t metrics_key;        // Its destructor hands a block back when its thread exits
+pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+_Thread_local MetricsThread* metrics_self;
+bool metrics_paused;              // Set while the journals replay, which is not live traffic
+bool metrics_engine_up;           // Between a successful initialize_system() and shutdown_system(), under metrics_engine_lock
+pthread_mutex_t metrics_engine_lock = PTHREAD_MUTEX_INITIALIZER;
+_Thread_local char ledger_error_text[LEDGER_ERROR_SIZE]; // Why this thread's last failed call failed
+void (*notice_handler)(const char* message);
+void (*fatal_handler)(const char* message);
+
+// Internal helpers
+pthread_mutex_t* account_lock(int index);
+LedgerStatus apply_deposit(int farmer_id, money_t amount, const char* description, uint64_t* ticket);
+LedgerStatus apply_withdraw(int farmer_id, money_t amount, const char* description, uint64_t* ticket);
+LedgerStatus apply_transfer(int from_id, int to_id, money_t amount, const char* note, uint64_t* ticket);
+LedgerStatus apply_bulk_transfer(int from_id, const TransferLeg* legs, int count, const char* note,
+                                 int* failed_leg, uint64_t* ticket);
+LedgerStatus apply_batch(const BatchEntry* entries, int count, int* failed_entry, uint64_t* ticket);
+void transfer_text(const Farmer* sender, const Farmer* recipient, const char* note,
+                   char* sender_desc, char* recipient_desc, size_t size);
+MetricsThread* metrics_register();
+void metrics_retire(void* block);
+void metrics_make_key();
+void metrics_merge(MetricsReport* out, MetricsThread* m);
+void metrics_bump(_Atomic uint64_t* counter);
+void hash_gauge_farmers(HashGauge* g);
+void hash_gauge_usernames(HashGauge* g);
+void* accrual_compute(void* arg);
+void* accrual_post(void* arg);
+void lock_all_accounts();
+void unlock_all_accounts();
+void adjust_balance(Farmer* f, money_t delta);
+void credit_account(Farmer* f, money_t amount, int shard);
+void release_credit(Farmer* f, money_t amount);
+void lock_account_pair(int a, int b);
+void unlock_account_pair(int a, int b);
+void store_transaction(int index, Transaction t);
+BulkBatch* bulk_alloc(int count, int shard);
+uint64_t enqueue_bulk(int index, BulkBatch* bulk);
+void publish_recent(RecentFeed* feed, const Transaction* t);
+int feed_last(RecentFeed* feed, int n, Transaction* out);
+uint64_t enqueue_transaction(Shard* s, const QueuedTransaction* item);
+int dequeue_transactions(Shard* s, QueuedTransaction* out, int max);
+void handoff_push(Shard* s, BulkBatch* bulk);
+BulkBatch* handoff_split(Shard* s, const BulkBatch* bulk, int to_shard);
+bool start_settlement_worker();
+void stop_settlement_worker();
+void* settlement_worker(void* arg);
+void insert_username_index(int index);
+void remove_username_index(int index);
+void free_username_index();
+void deactivate_farmer(int index);
+void remove_farmer_hash(int farmer_id);
+uint32_t hash_function(const FarmerHashTable* table, int farmer_id);
+void place_farmer_hash(FarmerHashTable* table, int farmer_id, int index);
+void stats_post(const SystemStats* delta);
+void stats_count_row(SystemStats* delta, char type, money_t amount);
+bool ledger_fail(const char* format, ...);
+void ledger_notice(const char* format, ...);
+void ledger_fatal(const char* format, ...) __attribute__((noreturn));
+LedgerStatus abandon_startup(LedgerStatus status);
+bool journal_open(Journal* j, const char* path);
+LedgerStatus journal_replay(Shard* s, long long from, long long* records);
+void journal_append(Journal* j, int farmer_id, char type, time_t timestamp, int64_t amount, const char* text, int handoff);
+money_t journal_amount(const JournalRecord* r);
+bool journal_apply(Shard* s, const JournalRecord* r, long long position, bool push_recent);
+void journal_sync(Journal* j);
+void journal_write_pending(Journal* j);
+void journal_write_records(Journal* j, const JournalRecord* records, size_t count);
+void journal_append_bulk(Shard* s, const BulkBatch* bulk);
+bool journal_batch_complete(Journal* j, long long position, long long count, long long total);
+LedgerStatus finish_handoffs();
+void free_bulk(BulkBatch* bulk);
+void journal_close();
+uint32_t journal_checksum(const JournalRecord* r);
+bool ledger_open(Ledger* l, const char* path, long long rows, uint64_t hash);
+uint64_t ledger_row_hash(const Ledger* l, uint64_t hash, long long row);
+void ledger_grow(Ledger* l);
+void ledger_bind_columns(Ledger* l, long long capacity);
+long long ledger_append(Ledger* l, const Transaction* t);
+void ledger_close(Ledger* l);
+void history_append(int index, int row);
+LedgerStatus snapshot_load(const char* path, long long* resume, bool* restored);
+void snapshot_header(SnapshotHeader* header);
+bool snapshot_open(SnapshotWriter* w, const char* path);
+bool snapshot_write(SnapshotWriter* w, const SnapshotHeader* header);
+bool snapshot_close(SnapshotWriter* w, const char* path, bool ok);
+bool snapshot_publish(const char* path);
+uint64_t snapshot_hash(uint64_t hash, const void* data, size_t len);
+void snapshot_put(SnapshotWriter* w, const void* data, size_t len);
+void snapshot_flush(SnapshotWriter* w);
+void quiesce_ledger();
+void release_ledger();
+bool start_checkpointer();
+void stop_checkpointer();
+void* checkpoint_worker(void* arg);
+int slab_class(size_t bytes);
+uint32_t hash_string(const char* text);
+uint32_t intern_description(const char* text);
+void free_descriptions();
+int description_words(const char* text, uint64_t* words, int max);
+WordPostings* find_word(uint64_t word);
+void index_description(uint32_t id, const char* text);
+void reindex_descriptions();
+int compare_ids(const void* a, const void* b);
+bool postings_contain(const WordPostings* p, uint32_t id);
+
+LedgerStatus initialize_system() {
+    // Initialize hash tables
+    resize_farmer_hash(HASH_INITIAL_SLOTS);
+    resize_username_index(HASH_INITIAL_SLOTS);
+    
+    // Dan_Trevor_Matovu dcs/day/2024/ 1539, "Mubwiine_Arnold: dcs/day/2024/ 0246", "Sebirungi_Shafiq:dcs/day/2024/0191g",
+    //"Kamogo_David:dcs/day/2024/1006g", "Twesimire_Dorris:dcs/day/2024/0902g"
+    char* usernames[] = {"Dan_Trevor_Matovu", "Mubwiine_Arnold", "Sebirungi_Shafiq", "Kamogo_David", "Twesimire_Dorris"};
+    int passwords[] = {1539, 0246, 1910, 10060, 9020};
+    money_t balances[] = {500000, 750050, 300025, 600075, 900000}; // Cents
+    
+    for (int i = 0; i < ACCOUNT_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&account_locks[i], NULL);
+    }
+    
+    // Initialize each shard's feed and queue, and open its journal
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        Shard* shard = &shards[i];
+        shard->id = i;
+        atomic_store(&shard->recent.head, 0);
+        shard->queue.front = 0;
+        shard->queue.rear = -1;
+        shard->queue.size = 0;
+        shard->queue.enqueued = 0;
+        shard->queue.settled = 0;
+        shard->closed_period = 0;
+        
+        char path[256];
+        shard_file_name(path, sizeof(path), JOURNAL_FILE, i);
+        if (!journal_open(&shard->journal, path)) return abandon_startup(LEDGER_IO_ERROR);
+    }
+    
+    // Recover from the newest snapshot plus the journals written after it, shard 0
+    // first (a journal from before sharding holds every account). Only a fresh start,
+    // with neither a snapshot nor a journal record, gets the opening deposits.
+    long long resume[SHARD_COUNT];
+    metrics_paused = true;
+    bool restored = false;
+    LedgerStatus status = snapshot_load(SNAPSHOT_FILE, resume, &restored);
+    long long replayed = 0;
+    for (int i = 0; i < SHARD_COUNT && status == LEDGER_OK; i++) {
+        long long records = 0;
+        status = journal_replay(&shards[i], resume[i], &records);
+        replayed += records;
+    }
+    if (status == LEDGER_OK) status = finish_handoffs();
+    if (status != LEDGER_OK) return abandon_startup(status);
+    metrics_paused = false;
+    if (!start_settlement_worker()) return abandon_startup(LEDGER_IO_ERROR);
+    if (!start_checkpointer()) {
+        stop_settlement_worker();
+        return abandon_startup(LEDGER_IO_ERROR);
+    }
+    if (!restored && replayed == 0) {
+        for (int i = 0; i < 5; i++) {
+            int farmer_id = create_farmer(usernames[i], passwords[i]);
+            if (farmer_id == -1) continue;
+            
+            // Add initial deposit transaction
+            char desc[100];
+            sprintf(desc, "Initial deposit - Account opening");
+            ledger_deposit(farmer_id, balances[i], desc, NULL);
+        }
+        settle_all();
+    }
+    pthread_mutex_lock(&metrics_engine_lock);
+    metrics_engine_up = true;
+    pthread_mutex_unlock(&metrics_engine_lock);
+    return LEDGER_OK;
+}
+
+LedgerStatus abandon_startup(LedgerStatus status) {
+    // Undoes a start that failed before any worker ran, leaving ledger_error() as it was
+    metrics_paused = false;
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        free(handoff_recovery.positions[s]);
+    }
+    memset(&handoff_recovery, 0, sizeof(handoff_recovery));
+    journal_close();
+    free_memory();
+    return status;
+}
+
+uint32_t hash_function(const FarmerHashTable* table, int farmer_id) {
+    // Fibonacci hashing: the top bits of the product spread sequential IDs evenly
+    return ((uint32_t)farmer_id * 2654435769u) >> table->shift;
+}
+
+void resize_farmer_hash(uint32_t slot_count) {
+    // Writers hold registry_lock (or run before any other thread exists)
+    FarmerHashTable* old = atomic_load_explicit(&farmer_hash_table, memory_order_relaxed);
+    FarmerHashTable* table = (FarmerHashTable*)calloc(1, sizeof(FarmerHashTable) + (size_t)slot_count * sizeof(HashSlot));
+    if (table == NULL) {
+        ledger_fatal("out of memory for farmer index");
+    }
+    table->mask = slot_count - 1;
+    table->shift = 32 - __builtin_ctz(slot_count);
+    
+    // Copy live entries; deleted markers are dropped here
+    if (old != NULL) {
+        for (uint32_t i = 0; i <= old->mask; i++) {
+            int32_t farmer_id = atomic_load_explicit(&old->slots[i].farmer_id, memory_order_relaxed);
+            if (farmer_id > 0) {
+                place_farmer_hash(table, farmer_id, atomic_load_explicit(&old->slots[i].index, memory_order_relaxed));
+            }
+        }
+        // A lookup may still be probing the old table, so it is only freed at shutdown
+        table->retired = old;
+    }
+    atomic_store_explicit(&farmer_hash_table, table, memory_order_release);
+}
+
+void place_farmer_hash(FarmerHashTable* table, int farmer_id, int index) {
+    uint32_t i = hash_function(table, farmer_id);
+    while (atomic_load_explicit(&table->slots[i].farmer_id, memory_order_relaxed) > 0) {
+        i = (i + 1) & table->mask;
+    }
+    if (atomic_load_explicit(&table->slots[i].farmer_id, memory_order_relaxed) == HASH_EMPTY) {
+        table->used++;
+    }
+    atomic_store_explicit(&table->slots[i].index, index, memory_order_relaxed);
+    atomic_store_explicit(&table->slots[i].farmer_id, farmer_id, memory_order_release);
+    table->live++;
+}
+
+void insert_farmer_hash(int farmer_id, int index) {
+    FarmerHashTable* table = atomic_load_explicit(&farmer_hash_table, memory_order_relaxed);
+    if ((uint64_t)(table->used + 1) * 100 > (uint64_t)(table->mask + 1) * HASH_MAX_LOAD_PERCENT) {
+        // Double when mostly live; rebuild at the same size when deleted markers are the problem
+        uint32_t slot_count = table->mask + 1;
+        if (table->live * 2 >= table->used) slot_count *= 2;
+        resize_farmer_hash(slot_count);
+        table = atomic_load_explicit(&farmer_hash_table, memory_order_relaxed);
+    }
+    place_farmer_hash(table, farmer_id, index);
+}
+
+int lookup_farmer_hash(int farmer_id) {
+    FarmerHashTable* table = atomic_load_explicit(&farmer_hash_table, memory_order_acquire);
+    uint32_t i = hash_function(table, farmer_id);
+    int32_t id;
+    
+    // The probe count is the chain walk's cost; timing a lookup this short would double it
+    uint64_t probes = 1;
+    while ((id = atomic_load_explicit(&table->slots[i].farmer_id, memory_order_acquire)) != HASH_EMPTY) {
+        if (id == farmer_id) {
+            metrics_record(METRIC_LOOKUP, probes, true);
+            return atomic_load_explicit(&table->slots[i].index, memory_order_relaxed);
+        }
+        i = (i + 1) & table->mask;
+        probes++;
+    }
+    metrics_record(METRIC_LOOKUP, probes, false);
+    return -1;
+}
+
+void remove_farmer_hash(int farmer_id) {
+    FarmerHashTable* table = atomic_load_explicit(&farmer_hash_table, memory_order_relaxed);
+    uint32_t i = hash_function(table, farmer_id);
+    
+    while (atomic_load_explicit(&table->slots[i].farmer_id, memory_order_relaxed) != HASH_EMPTY) {
+        if (atomic_load_explicit(&table->slots[i].farmer_id, memory_order_relaxed) == farmer_id) {
+            // Keep the probe chain intact for IDs stored further along
+            atomic_store_explicit(&table->slots[i].farmer_id, HASH_DELETED, memory_order_release);
+            table->live--;
+            return;
+        }
+        i = (i + 1) & table->mask;
+    }
+}
+
+void free_farmer_hash() {
+    FarmerHashTable* table = atomic_exchange(&farmer_hash_table, NULL);
+    while (table != NULL) {
+        FarmerHashTable* retired = table->retired;
+        free(table);
+        table = retired;
+    }
+}
+
+int find_farmer_index(int farmer_id) {
+    // Stale tables may still list a closed account, so callers that change it recheck active
+    return lookup_farmer_hash(farmer_id);
+}
+
+int find_farmer_by_username(const char* username) {
+    UsernameHashTable* table = atomic_load_explicit(&username_table, memory_order_acquire);
+    uint32_t h = hash_string(username);
+    uint32_t i = h & table->mask;
+    int32_t index;
+    
+    while ((index = atomic_load_explicit(&table->slots[i].index, memory_order_acquire)) != USERNAME_EMPTY) {
+        if (index >= 0 && atomic_load_explicit(&table->slots[i].hash, memory_order_relaxed) == h &&
+            strcmp(username, farmer_at(index)->username) == 0 && farmer_at(index)->active) {
+            return index;
+        }
+        i = (i + 1) & table->mask;
+    }
+    return -1;
+}
+
+int check_login(const char* username, int password) {
+    int index = find_farmer_by_username(username);
+    if (index != -1 && password == farmer_at(index)->password) {
+        return farmer_at(index)->farmer_id;
+    }
+    return -1;
+}
+
+void resize_username_index(uint32_t slot_count) {
+    UsernameHashTable* old = atomic_load_explicit(&username_table, memory_order_relaxed);
+    UsernameHashTable* table = (UsernameHashTable*)malloc(sizeof(UsernameHashTable) + (size_t)slot_count * sizeof(UsernameSlot));
+    if (table == NULL) {
+        ledger_fatal("out of memory for username index");
+    }
+    for (uint32_t i = 0; i < slot_count; i++) {
+        atomic_init(&table->slots[i].hash, 0);
+        atomic_init(&table->slots[i].index, USERNAME_EMPTY);
+    }
+    table->mask = slot_count - 1;
+    table->used = 0;
+    table->live = 0;
+    table->retired = old;
+    
+    if (old != NULL) {
+        for (uint32_t i = 0; i <= old->mask; i++) {
+            int32_t index = atomic_load_explicit(&old->slots[i].index, memory_order_relaxed);
+            if (index >= 0) {
+                uint32_t j = atomic_load_explicit(&old->slots[i].hash, memory_order_relaxed) & table->mask;
+                while (atomic_load_explicit(&table->slots[j].index, memory_order_relaxed) >= 0) {
+                    j = (j + 1) & table->mask;
+                }
+                atomic_store_explicit(&table->slots[j].hash, atomic_load_explicit(&old->slots[i].hash, memory_order_relaxed), memory_order_relaxed);
+                atomic_store_explicit(&table->slots[j].index, index, memory_order_relaxed);
+                table->used++;
+                table->live++;
+            }
+        }
+    }
+    atomic_store_explicit(&username_table, table, memory_order_release);
+}
+
+void insert_username_index(int index) {
+    UsernameHashTable* table = atomic_load_explicit(&username_table, memory_order_relaxed);
+    if ((uint64_t)(table->used + 1) * 100 > (uint64_t)(table->mask + 1) * HASH_MAX_LOAD_PERCENT) {
+        uint32_t slot_count = table->mask + 1;
+        if (table->live * 2 >= table->used) slot_count *= 2;
+        resize_username_index(slot_count);
+        table = atomic_load_explicit(&username_table, memory_order_relaxed);
+    }
+    
+    uint32_t h = hash_string(farmer_at(index)->username);
+    uint32_t i = h & table->mask;
+    while (atomic_load_explicit(&table->slots[i].index, memory_order_relaxed) >= 0) {
+        i = (i + 1) & table->mask;
+    }
+    if (atomic_load_explicit(&table->slots[i].index, memory_order_relaxed) == USERNAME_EMPTY) {
+        table->used++;
+    }
+    atomic_store_explicit(&table->slots[i].hash, h, memory_order_relaxed);
+    atomic_store_explicit(&table->slots[i].index, index, memory_order_release);
+    table->live++;
+}
+
+void remove_username_index(int index) {
+    UsernameHashTable* table = atomic_load_explicit(&username_table, memory_order_relaxed);
+    uint32_t i = hash_string(farmer_at(index)->username) & table->mask;
+    int32_t slot_index;
+    
+    while ((slot_index = atomic_load_explicit(&table->slots[i].index, memory_order_relaxed)) != USERNAME_EMPTY) {
+        if (slot_index == index) {
+            atomic_store_explicit(&table->slots[i].index, USERNAME_DELETED, memory_order_release);
+            table->live--;
+            return;
+        }
+        i = (i + 1) & table->mask;
+    }
+}
+
+void free_username_index() {
+    UsernameHashTable* table = atomic_exchange(&username_table, NULL);
+    while (table != NULL) {
+        UsernameHashTable* retired = table->retired;
+        free(table);
+        table = retired;
+    }
+}
+
+void deactivate_farmer(int index) {
+    Farmer* f = farmer_at(index);
+    f->active = false;
+    remove_farmer_hash(f->farmer_id);
+    remove_username_index(index);
+    
+    SystemStats delta = { .accounts = -1 };
+    stats_post(&delta);
+}
+
+Farmer* farmer_at(int index) {
+    return &farmer_blocks[index / FARMER_BLOCK_SIZE][index % FARMER_BLOCK_SIZE];
+}
+
+int shard_of(int farmer_id) {
+    // Fibonacci hashing spreads the sequential IDs evenly over the shards
+    return (int)(((uint32_t)farmer_id * 2654435769u) >> (32 - SHARD_BITS));
+}
+
+Ledger* farmer_ledger(const Farmer* f) {
+    return &shards[shard_of(f->farmer_id)].ledger;
+}
+
+void shard_file_name(char* buf, size_t size, const char* base, int shard) {
+    // Shard 0 keeps the plain name, so a journal from before sharding is still found
+    if (shard == 0) {
+        snprintf(buf, size, "%s", base);
+    } else {
+        snprintf(buf, size, "%s.%d", base, shard);
+    }
+}
+
+int register_farmer(int farmer_id, const char* username, int password) {
+    // Caller holds registry_lock, or no other thread is running yet
+    int index = num_farmers;
+    int block = index / FARMER_BLOCK_SIZE;
+    if (block == MAX_FARMER_BLOCKS) {
+        return -1;
+    }
+    
+    // Grow by a whole block; existing blocks are never moved
+    if (farmer_blocks[block] == NULL) {
+        farmer_blocks[block] = (Farmer*)calloc(FARMER_BLOCK_SIZE, sizeof(Farmer));
+        if (farmer_blocks[block] == NULL) {
+            ledger_fatal("out of memory for farmer registry");
+        }
+    }
+    
+    Farmer* f = farmer_at(index);
+    f->farmer_id = farmer_id;
+    snprintf(f->username, sizeof(f->username), "%s", username);
+    f->password = password;
+    f->balance = 0;
+    f->incoming = 0;
+    f->history = NULL;
+    f->chunks = NULL;
+    f->history_capacity = 0;
+    f->transaction_count = 0;
+    f->active = true;
+    
+    // The account is complete before either index can hand it out
+    insert_farmer_hash(farmer_id, index);
+    insert_username_index(index);
+    num_farmers++;
+    
+    SystemStats delta = { .accounts = 1 };
+    stats_post(&delta);
+    if (farmer_id >= next_farmer_id) {
+        next_farmer_id = farmer_id + 1;
+    }
+    return index;
+}
+
+int create_farmer(const char* username, int password) {
+    size_t len = strlen(username);
+    if (len == 0 || len >= sizeof(((Farmer*)0)->username)) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&registry_lock);
+    int farmer_id = -1;
+    if (find_farmer_by_username(username) == -1 && num_farmers < FARMER_BLOCK_SIZE * MAX_FARMER_BLOCKS) {
+        farmer_id = next_farmer_id;
+        journal_append(&shards[shard_of(farmer_id)].journal, farmer_id, 'O', time(NULL), password, username, 0);
+        register_farmer(farmer_id, username, password);
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return farmer_id;
+}
+
+bool close_farmer(int farmer_id) {
+    int index = find_farmer_index(farmer_id);
+    if (index == -1) {
+        return false;
+    }
+    
+    // Lock order is always account stripe, then registry
+    pthread_mutex_lock(account_lock(index));
+    Farmer* f = farmer_at(index);
+    // Only empty accounts can be closed; the money has to leave through the ledger first
+    bool closable = f->active && f->balance == 0 && f->incoming == 0;
+    if (closable) {
+        // Queued transactions for this account must reach the journal before its 'C' record
+        settle_all();
+        pthread_mutex_lock(&registry_lock);
+        journal_append(&shards[shard_of(farmer_id)].journal, farmer_id, 'C', time(NULL), 0, "", 0);
+        deactivate_farmer(index);
+        pthread_mutex_unlock(&registry_lock);
+    }
+    pthread_mutex_unlock(account_lock(index));
+    return closable;
+}
+
+pthread_mutex_t* account_lock(int index) {
+    return &account_locks[index % ACCOUNT_LOCK_STRIPES];
+}
+
+void adjust_balance(Farmer* f, money_t delta) {
+    // Caller holds the account's stripe lock and has checked the result against MONEY_MAX
+    atomic_fetch_add_explicit(&f->balance, delta, memory_order_release);
+}
+
+void credit_account(Farmer* f, money_t amount, int shard) {
+    // A credit settled by shard. One for another shard's account stays in incoming until
+    // shard has its 'H' record on disk: spent any earlier, a crash could replay the
+    // spending without the credit that paid for it.
+    if (shard_of(f->farmer_id) == shard) {
+        adjust_balance(f, amount);
+    } else {
+        atomic_fetch_add_explicit(&f->incoming, amount, memory_order_relaxed);
+    }
+}
+
+void release_credit(Farmer* f, money_t amount) {
+    // Called by the settling worker without the stripe lock: every balance change is an
+    // atomic add, and a credit only ever makes the checks made under the lock safer.
+    // Balance first, so balance + incoming never dips below the MONEY_MAX headroom.
+    atomic_fetch_add_explicit(&f->balance, amount, memory_order_release);
+    atomic_fetch_sub_explicit(&f->incoming, amount, memory_order_release);
+}
+
+const char* parse_money(const char* text, money_t* out) {
+    // Digits with at most two decimals ("7500", "7500.5", "0.05"); no sign or exponent.
+    // Returns the first character after the number, or NULL if it is not a valid amount.
+    money_t units = 0;
+    int digits = 0;
+    for (; *text >= '0' && *text <= '9'; text++, digits++) {
+        units = units * 10 + (*text - '0');
+        if (units > MONEY_MAX / MONEY_SCALE) return NULL;
+    }
+    
+    money_t cents = 0;
+    int decimals = 0;
+    if (*text == '.') {
+        for (text++; *text >= '0' && *text <= '9'; text++, decimals++) {
+            if (decimals == 2) return NULL;
+            cents = cents * 10 + (*text - '0');
+        }
+    }
+    if (digits == 0 && decimals == 0) return NULL;
+    if (decimals == 1) cents *= 10;
+    
+    *out = units * MONEY_SCALE + cents;
+    return *out <= MONEY_MAX ? text : NULL;
+}
+
+const char* money_text(money_t amount, char* buf) {
+    // buf holds MONEY_TEXT_SIZE bytes
+    uint64_t magnitude = amount < 0 ? (uint64_t)0 - (uint64_t)amount : (uint64_t)amount;
+    snprintf(buf, MONEY_TEXT_SIZE, "%s%llu.%02llu", amount < 0 ? "-" : "",
+             (unsigned long long)(magnitude / MONEY_SCALE), (unsigned long long)(magnitude % MONEY_SCALE));
+    return buf;
+}
+
+void lock_account_pair(int a, int b) {
+    // Lower stripe first, so two opposite transfers can never wait on each other
+    pthread_mutex_t* first = account_lock(a);
+    pthread_mutex_t* second = account_lock(b);
+    if (first == second) {
+        pthread_mutex_lock(first);
+        return;
+    }
+    if (first > second) {
+        pthread_mutex_t* swap = first;
+        first = second;
+        second = swap;
+    }
+    pthread_mutex_lock(first);
+    pthread_mutex_lock(second);
+}
+
+void unlock_account_pair(int a, int b) {
+    pthread_mutex_unlock(account_lock(a));
+    if (account_lock(b) != account_lock(a)) {
+        pthread_mutex_unlock(account_lock(b));
+    }
+}
+
+LedgerStatus ledger_deposit(int farmer_id, money_t amount, const char* description, uint64_t* ticket) {
+    uint64_t started = metrics_clock();
+    LedgerStatus status = apply_deposit(farmer_id, amount, description, ticket);
+    metrics_record(METRIC_DEPOSIT, metrics_clock() - started, status == LEDGER_OK);
+    return status;
+}
+
+LedgerStatus ledger_withdraw(int farmer_id, money_t amount, const char* description, uint64_t* ticket) {
+    uint64_t started = metrics_clock();
+    LedgerStatus status = apply_withdraw(farmer_id, amount, description, ticket);
+    metrics_record(METRIC_WITHDRAW, metrics_clock() - started, status == LEDGER_OK);
+    return status;
+}
+
+LedgerStatus ledger_transfer(int from_id, int to_id, money_t amount, const char* note, uint64_t* ticket) {
+    uint64_t started = metrics_clock();
+    LedgerStatus status = apply_transfer(from_id, to_id, amount, note, ticket);
+    metrics_record(METRIC_TRANSFER, metrics_clock() - started, status == LEDGER_OK);
+    return status;
+}
+
+LedgerStatus ledger_bulk_transfer(int from_id, const TransferLeg* legs, int count, const char* note,
+                                  int* failed_leg, uint64_t* ticket) {
+    uint64_t started = metrics_clock();
+    LedgerStatus status = apply_bulk_transfer(from_id, legs, count, note, failed_leg, ticket);
+    metrics_record(METRIC_BULK_TRANSFER, metrics_clock() - started, status == LEDGER_OK);
+    return status;
+}
+
+LedgerStatus ledger_apply_batch(const BatchEntry* entries, int count, int* failed_entry, uint64_t* ticket) {
+    uint64_t started = metrics_clock();
+    LedgerStatus status = apply_batch(entries, count, failed_entry, ticket);
+    metrics_record(METRIC_APPLY_BATCH, metrics_clock() - started, status == LEDGER_OK);
+    return status;
+}
+
+LedgerStatus apply_deposit(int farmer_id, money_t amount, const char* description, uint64_t* ticket) {
+    if (amount <= 0 || amount > MONEY_MAX) return LEDGER_INVALID_AMOUNT;
+    int index = find_farmer_index(farmer_id);
+    if (index == -1) return LEDGER_NOT_FOUND;
+    
+    Farmer* f = farmer_at(index);
+    LedgerStatus status = LEDGER_OK;
+    pthread_mutex_lock(account_lock(index));
+    if (!f->active) {
+        status = LEDGER_NOT_FOUND;
+    } else if (f->balance + f->incoming > MONEY_MAX - amount) {
+        status = LEDGER_LIMIT_EXCEEDED;
+    } else {
+        adjust_balance(f, amount);
+        // Enqueued under the lock so the journal sees this account's changes in balance order
+        uint64_t queued = add_transaction(farmer_id, amount, 'D', description);
+        if (ticket != NULL) *ticket = queued;
+    }
+    pthread_mutex_unlock(account_lock(index));
+    return status;
+}
+
+LedgerStatus apply_withdraw(int farmer_id, money_t amount, const char* description, uint64_t* ticket) {
+    if (amount <= 0 || amount > MONEY_MAX) return LEDGER_INVALID_AMOUNT;
+    int index = find_farmer_index(farmer_id);
+    if (index == -1) return LEDGER_NOT_FOUND;
+    
+    Farmer* f = farmer_at(index);
+    LedgerStatus status = LEDGER_OK;
+    pthread_mutex_lock(account_lock(index));
+    if (!f->active) {
+        status = LEDGER_NOT_FOUND;
+    } else if (amount > f->balance) {
+        status = LEDGER_INSUFFICIENT_FUNDS;
+    } else {
+        adjust_balance(f, -amount);
+        uint64_t queued = add_transaction(farmer_id, amount, 'W', description);
+        if (ticket != NULL) *ticket = queued;
+    }
+    pthread_mutex_unlock(account_lock(index));
+    return status;
+}
+
+LedgerStatus apply_transfer(int from_id, int to_id, money_t amount, const char* note, uint64_t* ticket) {
+    if (from_id == to_id) return LEDGER_SAME_ACCOUNT;
+    if (amount <= 0 || amount > MONEY_MAX) return LEDGER_INVALID_AMOUNT;
+    int from = find_farmer_index(from_id);
+    int to = find_farmer_index(to_id);
+    if (from == -1 || to == -1) return LEDGER_NOT_FOUND;
+    
+    Farmer* sender = farmer_at(from);
+    Farmer* recipient = farmer_at(to);
+    char sender_desc[170], recipient_desc[170];
+    transfer_text(sender, recipient, note, sender_desc, recipient_desc, sizeof(sender_desc));
+    
+    LedgerStatus status = LEDGER_OK;
+    lock_account_pair(from, to);
+    if (!sender->active || !recipient->active) {
+        status = LEDGER_NOT_FOUND;
+    } else if (amount > sender->balance) {
+        status = LEDGER_INSUFFICIENT_FUNDS;
+    } else if (recipient->balance + recipient->incoming > MONEY_MAX - amount) {
+        status = LEDGER_LIMIT_EXCEEDED;
+    } else {
+        adjust_balance(sender, -amount);
+        credit_account(recipient, amount, shard_of(from_id));
+        // A one-leg bulk transfer, so both rows reach the journal in one write. The
+        // sender's shard settles it and hands the credit on if the recipient is elsewhere.
+        BulkBatch* bulk = bulk_alloc(2, -1);
+        time_t now = time(NULL);
+        bulk->rows[0] = (Transaction){ .amount = amount, .timestamp = now, .farmer_id = from_id,
+                                       .description = intern_description(sender_desc), .type = 'W' };
+        bulk->rows[1] = (Transaction){ .amount = amount, .timestamp = now, .farmer_id = to_id,
+                                       .description = intern_description(recipient_desc), .type = 'D' };
+        bulk->indices[0] = from;
+        bulk->indices[1] = to;
+        uint64_t queued = enqueue_bulk(from, bulk);
+        if (ticket != NULL) *ticket = queued;
+    }
+    unlock_account_pair(from, to);
+    return status;
+}
+
+void transfer_text(const Farmer* sender, const Farmer* recipient, const char* note,
+                   char* sender_desc, char* recipient_desc, size_t size) {
+    if (note[0] != '\0') {
+        snprintf(sender_desc, size, "Transfer to %s: %s", recipient->username, note);
+        snprintf(recipient_desc, size, "Transfer from %s: %s", sender->username, note);
+    } else {
+        snprintf(sender_desc, size, "Transfer to %s", recipient->username);
+        snprintf(recipient_desc, size, "Transfer from %s", sender->username);
+    }
+}
+
+LedgerStatus apply_bulk_transfer(int from_id, const TransferLeg* legs, int count, const char* note,
+                                 int* failed_leg, uint64_t* ticket) {
+    if (failed_leg != NULL) *failed_leg = -1;
+    if (count <= 0 || count > BULK_MAX_LEGS) return LEDGER_INVALID_AMOUNT;
+    int from = find_farmer_index(from_id);
+    if (from == -1) return LEDGER_NOT_FOUND;
+    
+    BulkBatch* bulk = bulk_alloc(count + 1, -1);
+    Transaction* rows = bulk->rows;
+    int* indices = bulk->indices;
+    
+    // Everything that can be checked without locks is checked before any lock is taken
+    LedgerStatus status = LEDGER_OK;
+    money_t total = 0;
+    for (int i = 0; i < count && status == LEDGER_OK; i++) {
+        if (legs[i].to_id == from_id) {
+            status = LEDGER_SAME_ACCOUNT;
+        } else if (legs[i].amount <= 0 || legs[i].amount > MONEY_MAX - total) {
+            status = LEDGER_INVALID_AMOUNT;
+        } else if ((indices[i + 1] = find_farmer_index(legs[i].to_id)) == -1) {
+            status = LEDGER_NOT_FOUND;
+        }
+        if (status != LEDGER_OK) {
+            if (failed_leg != NULL) *failed_leg = i;
+        } else {
+            total += legs[i].amount;
+        }
+    }
+    if (status != LEDGER_OK) {
+        free_bulk(bulk);
+        return status;
+    }
+    
+    Farmer* sender = farmer_at(from);
+    time_t now = time(NULL);
+    char text[170];
+    if (note[0] != '\0') {
+        snprintf(text, sizeof(text), "Bulk transfer to %d accounts: %s", count, note);
+    } else {
+        snprintf(text, sizeof(text), "Bulk transfer to %d accounts", count);
+    }
+    rows[0] = (Transaction){ .amount = total, .timestamp = now, .farmer_id = from_id,
+                             .description = intern_description(text), .type = 'W' };
+    indices[0] = from;
+    if (note[0] != '\0') {
+        snprintf(text, sizeof(text), "Transfer from %s: %s", sender->username, note);
+    } else {
+        snprintf(text, sizeof(text), "Transfer from %s", sender->username);
+    }
+    uint32_t credit_text = intern_description(text);
+    for (int i = 0; i < count; i++) {
+        rows[i + 1] = (Transaction){ .amount = legs[i].amount, .timestamp = now, .farmer_id = legs[i].to_id,
+                                     .description = credit_text, .type = 'D' };
+    }
+    
+    // Every stripe involved, locked in ascending order like lock_account_pair()
+    bool* needed = (bool*)calloc(ACCOUNT_LOCK_STRIPES, sizeof(bool));
+    for (int i = 0; i <= count; i++) {
+        needed[indices[i] % ACCOUNT_LOCK_STRIPES] = true;
+    }
+    for (int s = 0; s < ACCOUNT_LOCK_STRIPES; s++) {
+        if (needed[s]) pthread_mutex_lock(&account_locks[s]);
+    }
+    
+    // A recipient may appear in several legs, so its headroom is checked against the whole total
+    if (!sender->active) {
+        status = LEDGER_NOT_FOUND;
+    } else if (total > sender->balance) {
+        status = LEDGER_INSUFFICIENT_FUNDS;
+    }
+    for (int i = 0; i < count && status == LEDGER_OK; i++) {
+        Farmer* recipient = farmer_at(indices[i + 1]);
+        if (!recipient->active) {
+            status = LEDGER_NOT_FOUND;
+        } else if (recipient->balance + recipient->incoming > MONEY_MAX - total) {
+            status = LEDGER_LIMIT_EXCEEDED;
+        }
+        if (status != LEDGER_OK && failed_leg != NULL) *failed_leg = i;
+    }
+    
+    if (status == LEDGER_OK) {
+        adjust_balance(sender, -total);
+        for (int i = 0; i < count; i++) {
+            credit_account(farmer_at(indices[i + 1]), legs[i].amount, shard_of(from_id));
+        }
+        // One queue entry carries every leg to the worker, which journals them in one write
+        uint64_t queued = enqueue_bulk(from, bulk);
+        if (ticket != NULL) *ticket = queued;
+    }
+    
+    for (int s = ACCOUNT_LOCK_STRIPES - 1; s >= 0; s--) {
+        if (needed[s]) pthread_mutex_unlock(&account_locks[s]);
+    }
+    free(needed);
+    if (status != LEDGER_OK) free_bulk(bulk);
+    return status;
+}
+
+LedgerStatus apply_batch(const BatchEntry* entries, int count, int* failed_entry, uint64_t* ticket) {
+    // Every entry or none. The rows settle as one bulk batch on the first entry's shard,
+    // journaled in one write. Entries are checked in order against running balances
+    // under every stripe involved, so a later entry may spend what an earlier one paid in.
+    // A 'T' makes two rows, so the BULK_MAX_LEGS limit can stop the batch part-way;
+    // *failed_entry is then the first entry that did not fit.
+    if (failed_entry != NULL) *failed_entry = -1;
+    if (count <= 0 || count > BULK_MAX_LEGS) return LEDGER_INVALID_AMOUNT;
+    
+    // Lock-free checks first, the same ones the single-account calls make
+    LedgerStatus status = LEDGER_OK;
+    int rows = 0;
+    int highest = 0;
+    int* found = (int*)malloc((size_t)count * 2 * sizeof(int));
+    if (found == NULL) {
+        ledger_fail("out of memory for a batch of %d entries", count);
+        return LEDGER_NO_MEMORY;
+    }
+    for (int i = 0; i < count && status == LEDGER_OK; i++) {
+        const BatchEntry* e = &entries[i];
+        int from = find_farmer_index(e->farmer_id);
+        int to = e->type == 'T' ? find_farmer_index(e->to_id) : -1;
+        if (e->type != 'D' && e->type != 'W' && e->type != 'T') {
+            status = LEDGER_INVALID_AMOUNT;
+        } else if (e->amount <= 0 || e->amount > MONEY_MAX) {
+            status = LEDGER_INVALID_AMOUNT;
+        } else if (e->type == 'T' && e->to_id == e->farmer_id) {
+            status = LEDGER_SAME_ACCOUNT;
+        } else if (from == -1 || (e->type == 'T' && to == -1)) {
+            status = LEDGER_NOT_FOUND;
+        } else if (rows + (e->type == 'T' ? 2 : 1) > BULK_MAX_LEGS) {
+            status = LEDGER_INVALID_AMOUNT;
+        }
+        if (status != LEDGER_OK) {
+            if (failed_entry != NULL) *failed_entry = i;
+            break;
+        }
+        found[rows++] = from;
+        if (to != -1) found[rows++] = to;
+        if (from > highest) highest = from;
+        if (to > highest) highest = to;
+    }
+    if (status != LEDGER_OK) {
+        free(found);
+        return status;
+    }
+    
+    BulkBatch* bulk = bulk_alloc(rows, -1);
+    bulk->held = (money_t*)calloc((size_t)rows, sizeof(money_t));
+    money_t* projected = (money_t*)malloc((size_t)(highest + 1) * sizeof(money_t));
+    if (bulk->held == NULL || projected == NULL) {
+        ledger_fatal("out of memory for batch");
+    }
+    memcpy(bulk->indices, found, (size_t)rows * sizeof(int));
+    free(found);
+    time_t now = time(NULL);
+    for (int i = 0, r = 0; i < count; i++) {
+        const BatchEntry* e = &entries[i];
+        if (e->type != 'T') {
+            bulk->rows[r++] = (Transaction){ .amount = e->amount, .timestamp = now, .farmer_id = e->farmer_id,
+                                             .description = intern_description(e->description), .type = e->type };
+            continue;
+        }
+        char sender_desc[170], recipient_desc[170];
+        transfer_text(farmer_at(bulk->indices[r]), farmer_at(bulk->indices[r + 1]), e->description,
+                      sender_desc, recipient_desc, sizeof(sender_desc));
+        bulk->rows[r++] = (Transaction){ .amount = e->amount, .timestamp = now, .farmer_id = e->farmer_id,
+                                         .description = intern_description(sender_desc), .type = 'W' };
+        bulk->rows[r++] = (Transaction){ .amount = e->amount, .timestamp = now, .farmer_id = e->to_id,
+                                         .description = intern_description(recipient_desc), .type = 'D' };
+    }
+    
+    // Every stripe involved, locked in ascending order like lock_account_pair()
+    bool* needed = (bool*)calloc(ACCOUNT_LOCK_STRIPES, sizeof(bool));
+    for (int r = 0; r < rows; r++) {
+        needed[bulk->indices[r] % ACCOUNT_LOCK_STRIPES] = true;
+    }
+    for (int s = 0; s < ACCOUNT_LOCK_STRIPES; s++) {
+        if (needed[s]) pthread_mutex_lock(&account_locks[s]);
+    }
+    
+    for (int r = 0; r < rows; r++) {
+        projected[bulk->indices[r]] = farmer_at(bulk->indices[r])->balance;
+    }
+    for (int i = 0, r = 0; i < count && status == LEDGER_OK; i++) {
+        int last = r + (entries[i].type == 'T' ? 2 : 1);
+        for (; r < last && status == LEDGER_OK; r++) {
+            Farmer* f = farmer_at(bulk->indices[r]);
+            money_t amount = bulk->rows[r].amount;
+            money_t* balance = &projected[bulk->indices[r]];
+            if (!f->active) {
+                status = LEDGER_NOT_FOUND;
+            } else if (bulk->rows[r].type == 'W') {
+                if (amount > *balance) status = LEDGER_INSUFFICIENT_FUNDS;
+                else *balance -= amount;
+            } else if (*balance + f->incoming > MONEY_MAX - amount) {
+                status = LEDGER_LIMIT_EXCEEDED;
+            } else {
+                *balance += amount;
+            }
+        }
+        if (status != LEDGER_OK && failed_entry != NULL) *failed_entry = i;
+    }
+    
+    // Each account moves once, by its net change. A net credit to another shard's account
+    // is held like a transfer's; a net debit is taken now, which only makes later checks stricter.
+    if (status == LEDGER_OK) {
+        int shard = shard_of(bulk->rows[0].farmer_id);
+        for (int r = 0; r < rows; r++) {
+            Farmer* f = farmer_at(bulk->indices[r]);
+            money_t net = projected[bulk->indices[r]] - f->balance;
+            if (net > 0) {
+                credit_account(f, net, shard);
+                if (shard_of(f->farmer_id) != shard) bulk->held[r] = net;
+            } else if (net < 0) {
+                adjust_balance(f, net);
+            }
+            projected[bulk->indices[r]] = f->balance;
+        }
+        uint64_t queued = enqueue_bulk(bulk->indices[0], bulk);
+        if (ticket != NULL) *ticket = queued;
+    }
+    
+    for (int s = ACCOUNT_LOCK_STRIPES - 1; s >= 0; s--) {
+        if (needed[s]) pthread_mutex_unlock(&account_locks[s]);
+    }
+    free(needed);
+    free(projected);
+    if (status != LEDGER_OK) free_bulk(bulk);
+    return status;
+}
+
+LedgerStatus ledger_accrue(int64_t rate, int32_t period, const char* description, AccrualSummary* out) {
+    // Credits every open account rate / ACCRUAL_RATE_SCALE / ACCRUAL_PERIODS_PER_YEAR of its
+    // balance, rounded down to the cent. The balances are read with every account stripe
+    // held, then released while the cores work the credits out; the stripes are taken again
+    // only to post them, one bulk batch per shard, so each shard journals its share in one
+    // write. Returns once all of them are durable. Each shard's write ends with a 'P' record
+    // closing the period; a shard that already closed it is skipped, so rerunning a close
+    // that a crash cut short finishes it, whatever the rate or description.
+    memset(out, 0, sizeof(*out));
+    if (rate <= 0 || rate > ACCRUAL_RATE_SCALE || period <= 0) return LEDGER_INVALID_AMOUNT;
+    
+    uint32_t text = intern_description(description);
+    time_t now = time(NULL);
+    pthread_mutex_lock(&accrual_lock);
+    lock_all_accounts();
+    int accounts = atomic_load(&num_farmers);
+    money_t* balance = (money_t*)malloc((size_t)(accounts > 0 ? accounts : 1) * sizeof(money_t));
+    money_t* accrued = (money_t*)malloc((size_t)(accounts > 0 ? accounts : 1) * sizeof(money_t));
+    uint8_t* shard = (uint8_t*)malloc((size_t)(accounts > 0 ? accounts : 1));
+    if (balance == NULL || accrued == NULL || shard == NULL) {
+        unlock_all_accounts();
+        pthread_mutex_unlock(&accrual_lock);
+        free(balance);
+        free(accrued);
+        free(shard);
+        ledger_fail("out of memory for an accrual over %d accounts", accounts);
+        return LEDGER_NO_MEMORY;
+    }
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        out->already_closed[s] = shards[s].closed_period >= period;
+    }
+    // Month-end balances; closed accounts and shards that already closed earn nothing
+    for (int i = 0; i < accounts; i++) {
+        const Farmer* f = farmer_at(i);
+        int s = shard_of(f->farmer_id);
+        shard[i] = (uint8_t)s;
+        balance[i] = f->active && f->balance > 0 && !out->already_closed[s] ? f->balance : 0;
+    }
+    unlock_all_accounts();
+    
+    int blocks = (accounts + FARMER_BLOCK_SIZE - 1) / FARMER_BLOCK_SIZE;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cores < 1 ? 1 : cores > ACCRUAL_MAX_THREADS ? ACCRUAL_MAX_THREADS : (int)cores;
+    if (threads > blocks) threads = blocks > 0 ? blocks : 1;
+    AccrualWorker* workers = (AccrualWorker*)calloc((size_t)threads, sizeof(AccrualWorker));
+    BulkBatch* batches[SHARD_COUNT] = { NULL };
+    if (workers == NULL) {
+        ledger_fatal("out of memory for accrual");
+    }
+    
+    // First pass, no locks held: each core works out the credits for its own run of registry blocks
+    for (int w = 0; w < threads; w++) {
+        AccrualWorker* worker = &workers[w];
+        worker->first = (int)((long long)blocks * w / threads) * FARMER_BLOCK_SIZE;
+        worker->last = (int)((long long)blocks * (w + 1) / threads) * FARMER_BLOCK_SIZE;
+        if (worker->last > accounts) worker->last = accounts;
+        worker->rate = rate;
+        worker->balance = balance;
+        worker->accrued = accrued;
+        worker->shard = shard;
+        worker->batches = batches;
+        worker->timestamp = now;
+        worker->description = text;
+        pthread_create(&worker->thread, NULL, accrual_compute, worker);
+    }
+    for (int w = 0; w < threads; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+    
+    // Each worker's rows go after the previous workers' in every shard's batch
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        long long rows = 0;
+        for (int w = 0; w < threads; w++) {
+            workers[w].offset[s] = rows;
+            rows += workers[w].rows[s];
+        }
+        if (rows > 0) {
+            batches[s] = bulk_alloc((int)rows, -1);
+            batches[s]->period = period;
+        }
+    }
+    
+    // Second pass: the same cores fill the batches and move the balances, stripes held again
+    lock_all_accounts();
+    for (int w = 0; w < threads; w++) {
+        pthread_create(&workers[w].thread, NULL, accrual_post, &workers[w]);
+    }
+    for (int w = 0; w < threads; w++) {
+        pthread_join(workers[w].thread, NULL);
+        out->total += workers[w].total;
+    }
+    
+    // An account closed or topped up to MONEY_MAX since the balances were read leaves
+    // a gap in its worker's run; close them up
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        if (batches[s] == NULL) continue;
+        long long rows = 0;
+        for (int w = 0; w < threads; w++) {
+            long long n = workers[w].posted[s];
+            if (rows != workers[w].offset[s] && n > 0) {
+                memmove(&batches[s]->rows[rows], &batches[s]->rows[workers[w].offset[s]], (size_t)n * sizeof(Transaction));
+                memmove(&batches[s]->indices[rows], &batches[s]->indices[workers[w].offset[s]], (size_t)n * sizeof(int));
+            }
+            rows += n;
+        }
+        batches[s]->count = (int)rows;
+        if (rows == 0) {
+            free_bulk(batches[s]);
+            batches[s] = NULL;
+        }
+        out->shard_accounts[s] = rows;
+        out->accounts += rows;
+    }
+    
+    // A shard with nothing to credit still records the close, so a rerun leaves it alone
+    uint64_t tickets[SHARD_COUNT] = { 0 };
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        if (out->already_closed[s]) continue;
+        if (batches[s] != NULL) {
+            tickets[s] = enqueue_bulk(batches[s]->indices[0], batches[s]);
+        } else {
+            journal_append(&shards[s].journal, 0, 'P', now, period, description, 0);
+            journal_sync(&shards[s].journal);
+        }
+        shards[s].closed_period = period;
+    }
+    unlock_all_accounts();
+    pthread_mutex_unlock(&accrual_lock);
+    free(balance);
+    free(accrued);
+    free(shard);
+    free(workers);
+    
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        if (tickets[s] != 0) wait_for_settlement(tickets[s]);
+    }
+    return LEDGER_OK;
+}
+
+void lock_all_accounts() {
+    // Stripes ascending, then the registry, like quiesce_ledger(); returns with the queues drained
+    for (int s = 0; s < ACCOUNT_LOCK_STRIPES; s++) {
+        pthread_mutex_lock(&account_locks[s]);
+    }
+    pthread_mutex_lock(&registry_lock);
+    settle_all();
+}
+
+void unlock_all_accounts() {
+    pthread_mutex_unlock(&registry_lock);
+    for (int s = ACCOUNT_LOCK_STRIPES - 1; s >= 0; s--) {
+        pthread_mutex_unlock(&account_locks[s]);
+    }
+}
+
+void* accrual_compute(void* arg) {
+    // Works from the balances ledger_accrue() read; touches no account
+    AccrualWorker* w = (AccrualWorker*)arg;
+    const uint64_t divisor = (uint64_t)ACCRUAL_RATE_SCALE * ACCRUAL_PERIODS_PER_YEAR;
+    
+    // Over the contiguous balances with no branches, so the loop stays tight. The annual rate
+    // is divided down only after it multiplies the balance, which keeps its full precision;
+    // splitting the balance at the divisor keeps every product inside 64 unsigned bits.
+    for (int i = w->first; i < w->last; i++) {
+        uint64_t b = (uint64_t)w->balance[i];
+        uint64_t interest = b / divisor * (uint64_t)w->rate + b % divisor * (uint64_t)w->rate / divisor;
+        uint64_t room = (uint64_t)(MONEY_MAX - w->balance[i]);
+        w->accrued[i] = (money_t)(interest < room ? interest : room);
+    }
+    
+    for (int i = w->first; i < w->last; i++) {
+        if (w->accrued[i] > 0) w->rows[w->shard[i]]++;
+    }
+    return NULL;
+}
+
+void* accrual_post(void* arg) {
+    // Caller holds every account stripe. Balances may have moved since they were read,
+    // so a credit is cut back to what still fits and an account closed since gets none.
+    AccrualWorker* w = (AccrualWorker*)arg;
+    long long next[SHARD_COUNT];
+    memcpy(next, w->offset, sizeof(next));
+    
+    for (int i = w->first; i < w->last; i++) {
+        money_t amount = w->accrued[i];
+        if (amount <= 0) continue;
+        Farmer* f = farmer_at(i);
+        if (amount > MONEY_MAX - f->balance) amount = MONEY_MAX - f->balance;
+        if (!f->active || amount <= 0) continue;
+        int s = w->shard[i];
+        BulkBatch* bulk = w->batches[s];
+        long long r = next[s]++;
+        bulk->rows[r] = (Transaction){ .amount = amount, .timestamp = w->timestamp, .farmer_id = f->farmer_id,
+                                       .description = w->description, .type = 'D' };
+        bulk->indices[r] = i;
+        w->posted[s]++;
+        adjust_balance(f, amount);
+        w->total += amount;
+    }
+    return NULL;
+}
+
+BulkBatch* bulk_alloc(int count, int shard) {
+    BulkBatch* bulk = (BulkBatch*)malloc(sizeof(BulkBatch));
+    Transaction* rows = (Transaction*)malloc((size_t)count * sizeof(Transaction));
+    int* indices = (int*)malloc((size_t)count * sizeof(int));
+    if (bulk == NULL || rows == NULL || indices == NULL) {
+        ledger_fatal("out of memory for bulk transfer");
+    }
+    bulk->count = count;
+    bulk->rows = rows;
+    bulk->indices = indices;
+    bulk->shard = shard;
+    bulk->held = NULL;
+    bulk->period = 0;
+    return bulk;
+}
+
+void free_bulk(BulkBatch* bulk) {
+    free(bulk->held);
+    free(bulk->rows);
+    free(bulk->indices);
+    free(bulk);
+}
+
+void stats_count_row(SystemStats* delta, char type, money_t amount) {
+    delta->transactions++;
+    if (type == 'D') {
+        delta->deposits++;
+        delta->deposit_total += amount;
+        delta->total_balance += amount;
+    } else {
+        delta->withdrawals++;
+        delta->withdrawal_total += amount;
+        delta->total_balance -= amount;
+    }
+}
+
+void stats_post(const SystemStats* delta) {
+    pthread_mutex_lock(&system_stats.write_lock);
+    uint64_t seq = atomic_load_explicit(&system_stats.seq, memory_order_relaxed);
+    atomic_store_explicit(&system_stats.seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    
+    SystemStats* s = &system_stats.current;
+    s->accounts += delta->accounts;
+    s->transactions += delta->transactions;
+    s->deposits += delta->deposits;
+    s->withdrawals += delta->withdrawals;
+    s->deposit_total += delta->deposit_total;
+    s->withdrawal_total += delta->withdrawal_total;
+    s->total_balance += delta->total_balance;
+    
+    atomic_store_explicit(&system_stats.seq, seq + 2, memory_order_release);
+    pthread_mutex_unlock(&system_stats.write_lock);
+}
+
+SystemStats stats_snapshot() {
+    // Retry until a copy was taken with no update in between
+    SystemStats snapshot;
+    uint64_t seq;
+    do {
+        seq = atomic_load_explicit(&system_stats.seq, memory_order_acquire);
+        snapshot = system_stats.current;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || atomic_load_explicit(&system_stats.seq, memory_order_relaxed) != seq);
+    return snapshot;
+}
+
+uint64_t add_transaction(int farmer_id, money_t amount, char type, const char* description) {
+    time_t now = time(NULL);
+    
+    // Create new transaction
+    QueuedTransaction item;
+    item.bulk = NULL;
+    Transaction* t = &item.t;
+    t->farmer_id = farmer_id;
+    t->amount = amount;
+    t->timestamp = now;
+    t->type = type;
+    t->description = intern_description(description);
+    
+    item.index = find_farmer_index(farmer_id);
+    if (item.index == -1) return 0;
+    
+    // Enqueue for processing; the account's shard worker journals and records it.
+    // The returned ticket can be passed to wait_for_settlement().
+    return enqueue_transaction(&shards[shard_of(farmer_id)], &item);
+}
+
+uint64_t enqueue_bulk(int index, BulkBatch* bulk) {
+    // The sender's shard settles the whole batch and hands any remote credits on
+    QueuedTransaction item;
+    memset(&item, 0, sizeof(item));
+    item.index = index;
+    item.bulk = bulk;
+    return enqueue_transaction(&shards[shard_of(bulk->rows[0].farmer_id)], &item);
+}
+
+void store_transaction(int index, Transaction t) {
+    long long row = ledger_append(farmer_ledger(farmer_at(index)), &t);
+    history_append(index, (int)row);
+}
+
+void publish_recent(RecentFeed* feed, const Transaction* t) {
+    // Single writer: only the shard's worker ever advances head
+    uint64_t started = metrics_clock();
+    uint64_t pos = atomic_load_explicit(&feed->head, memory_order_relaxed);
+    FeedSlot* slot = &feed->slots[pos & (RECENT_FEED_CAPACITY - 1)];
+    
+    atomic_store_explicit(&slot->seq, 2 * pos + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->data = *t;
+    atomic_store_explicit(&slot->seq, 2 * pos + 2, memory_order_release);
+    atomic_store_explicit(&feed->head, pos + 1, memory_order_release);
+    metrics_record(METRIC_FEED_PUBLISH, metrics_clock() - started, true);
+}
+
+int feed_last(RecentFeed* feed, int n, Transaction* out) {
+    // Newest first; a slot the writer laps while we copy it is skipped, never torn
+    uint64_t head = atomic_load_explicit(&feed->head, memory_order_acquire);
+    if (n > RECENT_FEED_CAPACITY) n = RECENT_FEED_CAPACITY;
+    
+    int count = 0;
+    for (uint64_t pos = head; pos > 0 && count < n && head - pos < RECENT_FEED_CAPACITY; pos--) {
+        FeedSlot* slot = &feed->slots[(pos - 1) & (RECENT_FEED_CAPACITY - 1)];
+        uint64_t expected = 2 * pos;
+        
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != expected) continue;
+        out[count] = slot->data;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != expected) continue;
+        count++;
+    }
+    return count;
+}
+
+int recent_feed_last(int n, Transaction* out) {
+    // Every shard keeps its own feed; their newest entries are merged by time
+    if (n > RECENT_FEED_CAPACITY) n = RECENT_FEED_CAPACITY;
+    if (n <= 0) return 0;
+    Transaction* feeds = (Transaction*)malloc((size_t)SHARD_COUNT * (size_t)n * sizeof(Transaction));
+    if (feeds == NULL) return 0;
+    
+    int counts[SHARD_COUNT], next[SHARD_COUNT];
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        counts[s] = feed_last(&shards[s].recent, n, feeds + s * n);
+        next[s] = 0;
+    }
+    int count = 0;
+    while (count < n) {
+        int best = -1;
+        for (int s = 0; s < SHARD_COUNT; s++) {
+            if (next[s] < counts[s] &&
+                (best == -1 || feeds[s * n + next[s]].timestamp > feeds[best * n + next[best]].timestamp)) {
+                best = s;
+            }
+        }
+        if (best == -1) break;
+        out[count++] = feeds[best * n + next[best]++];
+    }
+    free(feeds);
+    return count;
+}
+
+uint64_t enqueue_transaction(Shard* s, const QueuedTransaction* item) {
+    uint64_t started = metrics_clock();
+    TransactionQueue* q = &s->queue;
+    pthread_mutex_lock(&q->lock);
+    
+    // Queue is full: wait for the worker instead of dropping work
+    while (q->size >= MAX_TRANSACTIONS) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    
+    q->rear = (q->rear + 1) % MAX_TRANSACTIONS;
+    q->items[q->rear] = *item;
+    q->size++;
+    // The shard rides in the low bits so a ticket alone says which worker settles it
+    uint64_t ticket = ++q->enqueued << SHARD_BITS | (uint64_t)s->id;
+    
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    metrics_record(METRIC_ENQUEUE, metrics_clock() - started, true);
+    return ticket;
+}
+
+int dequeue_transactions(Shard* s, QueuedTransaction* out, int max) {
+    // Caller holds s->queue.lock
+    TransactionQueue* q = &s->queue;
+    int count = 0;
+    while (count < max && q->size > 0) {
+        out[count++] = q->items[q->front];
+        q->front = (q->front + 1) % MAX_TRANSACTIONS;
+        q->size--;
+    }
+    return count;
+}
+
+void handoff_push(Shard* s, BulkBatch* bulk) {
+    // Unbounded, unlike the teller queue, so a worker never waits on another
+    TransactionQueue* q = &s->queue;
+    pthread_mutex_lock(&q->lock);
+    if (q->handoff_count == q->handoff_capacity) {
+        int capacity = q->handoff_capacity ? q->handoff_capacity * 2 : 16;
+        BulkBatch** grown = (BulkBatch**)realloc(q->handoffs, (size_t)capacity * sizeof(BulkBatch*));
+        if (grown == NULL) {
+            ledger_fatal("out of memory for cross-shard credits");
+        }
+        q->handoffs = grown;
+        q->handoff_capacity = capacity;
+    }
+    q->handoffs[q->handoff_count++] = bulk;
+    q->handoffs_added++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+BulkBatch* handoff_split(Shard* s, const BulkBatch* bulk, int to_shard) {
+    // The credits of one bulk transfer that belong to to_shard, or NULL if none do
+    int count = 0;
+    for (int r = 1; r < bulk->count; r++) {
+        if (shard_of(bulk->rows[r].farmer_id) == to_shard) count++;
+    }
+    if (count == 0) return NULL;
+    
+    BulkBatch* part = bulk_alloc(count, s->id);
+    int n = 0;
+    for (int r = 1; r < bulk->count; r++) {
+        if (shard_of(bulk->rows[r].farmer_id) == to_shard) {
+            part->rows[n] = bulk->rows[r];
+            part->indices[n] = bulk->indices[r];
+            n++;
+        }
+    }
+    return part;
+}
+
+void* settlement_worker(void* arg) {
+    Shard* s = (Shard*)arg;
+    TransactionQueue* q = &s->queue;
+    QueuedTransaction* batch = (QueuedTransaction*)malloc(JOURNAL_GROUP_COMMIT * sizeof(QueuedTransaction));
+    
+    // One core per shard where there are enough, so each ledger stays in one cache
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > 1) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(s->id % cores, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+    
+    pthread_mutex_lock(&q->lock);
+    while (true) {
+        while (q->size == 0 && q->handoff_count == 0 && q->running) {
+            pthread_cond_wait(&q->not_empty, &q->lock);
+        }
+        if (q->size == 0 && q->handoff_count == 0) break; // Stopped and fully drained
+        
+        uint64_t started = metrics_clock();
+        int count = dequeue_transactions(s, batch, JOURNAL_GROUP_COMMIT);
+        uint64_t last_ticket = q->settled + (uint64_t)count;
+        // Credits other shards handed over are taken all at once, in the order they came
+        BulkBatch** incoming = q->handoffs;
+        int incoming_count = q->handoff_count;
+        q->handoffs = NULL;
+        q->handoff_count = 0;
+        q->handoff_capacity = 0;
+        pthread_cond_broadcast(&q->not_full);
+        pthread_mutex_unlock(&q->lock);
+        
+        // Journal, record and publish the whole batch, then pay for one fsync.
+        // Statement readers of this shard are only held off while the rows are stored.
+        for (int i = 0; i < count; i++) {
+            Transaction* t = &batch[i].t;
+            if (batch[i].bulk != NULL) {
+                journal_append_bulk(s, batch[i].bulk);
+            } else {
+                journal_append(&s->journal, t->farmer_id, t->type, t->timestamp, t->amount,
+                               description_at(t->description), 0);
+            }
+        }
+        for (int i = 0; i < incoming_count; i++) {
+            BulkBatch* bulk = incoming[i];
+            if (bulk->count == 1) {
+                Transaction* t = &bulk->rows[0];
+                journal_append(&s->journal, t->farmer_id, t->type, t->timestamp, t->amount,
+                               description_at(t->description), bulk->shard + 1);
+            } else {
+                journal_append_bulk(s, bulk);
+            }
+        }
+        SystemStats delta = { 0 };
+        pthread_rwlock_wrlock(&s->ledger.lock);
+        for (int i = 0; i < count; i++) {
+            BulkBatch* bulk = batch[i].bulk;
+            if (bulk != NULL) {
+                // Credits to other shards' accounts are stored by those shards
+                for (int r = 0; r < bulk->count; r++) {
+                    if (shard_of(bulk->rows[r].farmer_id) != s->id) continue;
+                    store_transaction(bulk->indices[r], bulk->rows[r]);
+                    stats_count_row(&delta, bulk->rows[r].type, bulk->rows[r].amount);
+                }
+            } else {
+                store_transaction(batch[i].index, batch[i].t);
+                stats_count_row(&delta, batch[i].t.type, batch[i].t.amount);
+            }
+        }
+        for (int i = 0; i < incoming_count; i++) {
+            BulkBatch* bulk = incoming[i];
+            for (int r = 0; r < bulk->count; r++) {
+                store_transaction(bulk->indices[r], bulk->rows[r]);
+                stats_count_row(&delta, bulk->rows[r].type, bulk->rows[r].amount);
+            }
+        }
+        pthread_rwlock_unlock(&s->ledger.lock);
+        stats_post(&delta);
+        metrics_record(METRIC_BATCH_ROWS, (uint64_t)delta.transactions, true);
+        for (int i = 0; i < count; i++) {
+            BulkBatch* bulk = batch[i].bulk;
+            if (bulk != NULL) {
+                // Only the newest rows can still be in the feed afterwards
+                int r = bulk->count > RECENT_FEED_CAPACITY ? bulk->count - RECENT_FEED_CAPACITY : 0;
+                for (; r < bulk->count; r++) {
+                    if (shard_of(bulk->rows[r].farmer_id) == s->id) publish_recent(&s->recent, &bulk->rows[r]);
+                }
+            } else {
+                publish_recent(&s->recent, &batch[i].t);
+            }
+        }
+        for (int i = 0; i < incoming_count; i++) {
+            BulkBatch* bulk = incoming[i];
+            int r = bulk->count > RECENT_FEED_CAPACITY ? bulk->count - RECENT_FEED_CAPACITY : 0;
+            for (; r < bulk->count; r++) {
+                publish_recent(&s->recent, &bulk->rows[r]);
+            }
+        }
+        journal_sync(&s->journal);
+        
+        // Remote credits are durable here as 'H' records, so they can be spent and handed
+        // over. That happens before the tickets settle, which is what settle_all() relies on.
+        for (int i = 0; i < count; i++) {
+            BulkBatch* bulk = batch[i].bulk;
+            if (bulk == NULL) continue;
+            for (int r = 0; r < bulk->count; r++) {
+                if (shard_of(bulk->rows[r].farmer_id) == s->id) continue;
+                money_t held = bulk->held != NULL ? bulk->held[r] : bulk->rows[r].type == 'D' ? bulk->rows[r].amount : 0;
+                if (held > 0) release_credit(farmer_at(bulk->indices[r]), held);
+            }
+            for (int to = 0; to < SHARD_COUNT; to++) {
+                if (to == s->id) continue;
+                BulkBatch* part = handoff_split(s, bulk, to);
+                if (part != NULL) handoff_push(&shards[to], part);
+            }
+            free_bulk(bulk);
+        }
+        for (int i = 0; i < incoming_count; i++) {
+            free_bulk(incoming[i]);
+        }
+        free(incoming);
+        metrics_record(METRIC_SETTLE_BATCH, metrics_clock() - started, true);
+        
+        pthread_mutex_lock(&q->lock);
+        q->settled = last_ticket;
+        q->handoffs_settled += (uint64_t)incoming_count;
+        pthread_cond_broadcast(&q->settled_changed);
+        if (q->notify_fd != -1) {
+            uint64_t one = 1;
+            if (write(q->notify_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                ledger_notice("cannot signal settlement: %s", strerror(errno));
+            }
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    
+    free(batch);
+    return NULL;
+}
+
+bool start_settlement_worker() {
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        shards[i].queue.running = true;
+        if (pthread_create(&shards[i].queue.worker, NULL, settlement_worker, &shards[i]) == 0) continue;
+        
+        // Nothing was queued yet, so the ones already running just stop
+        for (int k = 0; k <= i; k++) {
+            pthread_mutex_lock(&shards[k].queue.lock);
+            shards[k].queue.running = false;
+            pthread_cond_signal(&shards[k].queue.not_empty);
+            pthread_mutex_unlock(&shards[k].queue.lock);
+            if (k < i) pthread_join(shards[k].queue.worker, NULL);
+        }
+        return ledger_fail("cannot start settlement worker %d", i);
+    }
+    return true;
+}
+
+void stop_settlement_worker() {
+    if (!shards[0].queue.running) return;
+    
+    // Workers hand credits to each other, so none stops until all of them are idle
+    settle_all();
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        TransactionQueue* q = &shards[i].queue;
+        pthread_mutex_lock(&q->lock);
+        q->running = false;
+        pthread_cond_signal(&q->not_empty);
+        pthread_mutex_unlock(&q->lock);
+    }
+    
+    // Each worker drains whatever is still queued before it exits
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        pthread_join(shards[i].queue.worker, NULL);
+    }
+}
+
+void shutdown_system() {
+    // Drain and stop the workers first so every queued transaction reaches the journals,
+    // then leave a snapshot so the next start has nothing to replay. A metrics report
+    // already reading the gauges finishes before anything is torn down.
+    pthread_mutex_lock(&metrics_engine_lock);
+    metrics_engine_up = false;
+    pthread_mutex_unlock(&metrics_engine_lock);
+    stop_checkpointer();
+    stop_settlement_worker();
+    journal_commit();
+    long long records = 0;
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        records += shards[i].journal.record_count;
+    }
+    if (shards[0].journal.fd != -1 && records > checkpointer.records) {
+        SnapshotHeader header;
+        SnapshotWriter w;
+        snapshot_header(&header);
+        if (snapshot_open(&w, SNAPSHOT_FILE) && snapshot_close(&w, SNAPSHOT_FILE, snapshot_write(&w, &header))) {
+            snapshot_publish(SNAPSHOT_FILE);
+        }
+    }
+    journal_close();
+    free_memory();
+}
+
+void wait_for_settlement(uint64_t ticket) {
+    TransactionQueue* q = &shards[ticket & (SHARD_COUNT - 1)].queue;
+    uint64_t seq = ticket >> SHARD_BITS;
+    pthread_mutex_lock(&q->lock);
+    while (q->settled < seq) {
+        pthread_cond_wait(&q->settled_changed, &q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+bool ticket_settled(uint64_t ticket) {
+    TransactionQueue* q = &shards[ticket & (SHARD_COUNT - 1)].queue;
+    pthread_mutex_lock(&q->lock);
+    bool settled = q->settled >= ticket >> SHARD_BITS;
+    pthread_mutex_unlock(&q->lock);
+    return settled;
+}
+
+void settlement_notify(int fd) {
+    // fd is written an 8-byte count after every settled batch (an eventfd); -1 stops it
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        pthread_mutex_lock(&shards[i].queue.lock);
+        shards[i].queue.notify_fd = fd;
+        pthread_mutex_unlock(&shards[i].queue.lock);
+    }
+}
+
+void settle_all() {
+    // Every shard's tickets first. Settling them can hand credits to other shards,
+    // and those are only counted once the tickets that made them are done.
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        TransactionQueue* q = &shards[i].queue;
+        pthread_mutex_lock(&q->lock);
+        uint64_t ticket = q->enqueued << SHARD_BITS | (uint64_t)i;
+        pthread_mutex_unlock(&q->lock);
+        wait_for_settlement(ticket);
+    }
+    uint64_t handed[SHARD_COUNT];
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        pthread_mutex_lock(&shards[i].queue.lock);
+        handed[i] = shards[i].queue.handoffs_added;
+        pthread_mutex_unlock(&shards[i].queue.lock);
+    }
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        TransactionQueue* q = &shards[i].queue;
+        pthread_mutex_lock(&q->lock);
+        while (q->handoffs_settled < handed[i]) {
+            pthread_cond_wait(&q->settled_changed, &q->lock);
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+void free_memory() {
+    // Per-farmer histories go with their slabs in one pass; then the registry blocks
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        slab_release_all(&shards[i].history_slab);
+    }
+    for (int b = 0; b < MAX_FARMER_BLOCKS && farmer_blocks[b] != NULL; b++) {
+        free(farmer_blocks[b]);
+        farmer_blocks[b] = NULL;
+    }
+    num_farmers = 0;
+    memset(&system_stats.current, 0, sizeof(system_stats.current));
+    
+    // Release the ledger mappings and the description heap
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        ledger_close(&shards[i].ledger);
+    }
+    free_descriptions();
+    
+    // Free hash tables, including the ones they replaced
+    free_farmer_hash();
+    free_username_index();
+}
+
+uint32_t journal_checksum(const JournalRecord* r) {
+    // Word-at-a-time FNV-style mix; cheap enough to verify millions of records on startup
+    uint64_t words[sizeof(JournalRecord) / sizeof(uint64_t)];
+    memcpy(words, r, sizeof(words));
+    memset((char*)words + offsetof(JournalRecord, checksum), 0, sizeof(r->checksum));
+    
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < sizeof(words) / sizeof(uint64_t); i++) {
+        h ^= words[i];
+        h *= 1099511628211ULL;
+        h ^= h >> 29;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+bool journal_open(Journal* j, const char* path) {
+    j->pending_count = 0;
+    j->record_count = 0;
+    j->unsynced = false;
+    j->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    return j->fd != -1 || ledger_fail("cannot open journal %s: %s", path, strerror(errno));
+}
+
+LedgerStatus journal_replay(Shard* s, long long from, long long* records) {
+    // Records before from are already in memory, restored from a snapshot. *records
+    // is how many the journal holds once a torn tail is cut off.
+    Journal* j = &s->journal;
+    struct stat st;
+    if (fstat(j->fd, &st) == -1) {
+        ledger_fail("cannot stat journal %d: %s", s->id, strerror(errno));
+        return LEDGER_IO_ERROR;
+    }
+    
+    long long total = st.st_size / (long long)sizeof(JournalRecord);
+    // Only the newest records are needed to refill the recent-transactions feed
+    long long feed_from = total - RECENT_FEED_CAPACITY;
+    
+    JournalRecord* batch = (JournalRecord*)malloc(JOURNAL_REPLAY_BATCH * sizeof(JournalRecord));
+    if (batch == NULL) {
+        ledger_fail("out of memory replaying journal %d", s->id);
+        return LEDGER_NO_MEMORY;
+    }
+    long long applied = from;
+    bool torn = false;
+    
+    lseek(j->fd, (off_t)(from * (long long)sizeof(JournalRecord)), SEEK_SET);
+    while (applied < total && !torn) {
+        long long want = total - applied;
+        if (want > JOURNAL_REPLAY_BATCH) want = JOURNAL_REPLAY_BATCH;
+        
+        size_t bytes = (size_t)want * sizeof(JournalRecord);
+        size_t got = 0;
+        while (got < bytes) {
+            ssize_t n = read(j->fd, (char*)batch + got, bytes - got);
+            if (n <= 0) break;
+            got += (size_t)n;
+        }
+        long long records = (long long)(got / sizeof(JournalRecord));
+        if (records == 0) break;
+        
+        for (long long i = 0; i < records; i++) {
+            JournalRecord* r = &batch[i];
+            // Last record of the write that was cut short, or -1 while the records are whole.
+            // A bulk transfer counts only if every one of its rows made it to disk.
+            long long damaged = -1;
+            if ((r->magic != JOURNAL_MAGIC && r->magic != JOURNAL_MAGIC_V1) || r->checksum != journal_checksum(r)) {
+                damaged = applied;
+            } else if (r->type == 'B' && !journal_batch_complete(j, applied + 1, r->amount, total)) {
+                damaged = r->amount > 0 ? applied + r->amount : applied;
+            }
+            if (damaged != -1) {
+                // A crash only tears the final write: a group commit, or a bulk transfer
+                // reaching into it. Damage further back would cost committed records.
+                if (damaged < total - JOURNAL_GROUP_COMMIT) {
+                    ledger_fail("journal %d record %lld is damaged and %lld committed records follow it",
+                                s->id, applied, total - damaged - 1);
+                    free(batch);
+                    return LEDGER_JOURNAL_DAMAGED;
+                }
+                torn = true;
+                break;
+            }
+            
+            // A complete record that does not fit the ledger means the file is not ours to repair
+            if (!journal_apply(s, r, applied, applied >= feed_from)) {
+                ledger_fail("journal %d record %lld (type '%c', farmer %d) does not match the ledger",
+                            s->id, applied, r->type, r->farmer_id);
+                free(batch);
+                return LEDGER_CORRUPT;
+            }
+            j->last_checksum = r->checksum;
+            applied++;
+        }
+    }
+    free(batch);
+    
+    // Crash recovery: drop whatever follows the last complete record
+    off_t valid_size = (off_t)(applied * (long long)sizeof(JournalRecord));
+    if (valid_size != st.st_size) {
+        ledger_notice("journal %d: discarding %lld bytes of incomplete tail after %lld records",
+                      s->id, (long long)(st.st_size - valid_size), applied);
+        if (ftruncate(j->fd, valid_size) == -1 || fsync(j->fd) == -1) {
+            ledger_fail("cannot repair journal %d: %s", s->id, strerror(errno));
+            return LEDGER_IO_ERROR;
+        }
+    }
+    
+    j->record_count = applied;
+    *records = applied;
+    return LEDGER_OK;
+}
+
+bool journal_apply(Shard* s, const JournalRecord* r, long long position, bool push_recent) {
+    char text[sizeof(r->description)];
+    memcpy(text, r->description, sizeof(text));
+    text[sizeof(text) - 1] = '\0';
+    
+    if (r->type == 'O') {
+        return find_farmer_index(r->farmer_id) == -1 &&
+               register_farmer(r->farmer_id, text, (int)journal_amount(r)) != -1;
+    }
+    if (r->type == 'P') {
+        // An accrual period this shard has closed
+        if (journal_amount(r) > s->closed_period) s->closed_period = (int32_t)journal_amount(r);
+        return journal_amount(r) > 0;
+    }
+    if (r->type == 'H') {
+        // A credit this shard prepared for another one; finish_handoffs() checks it landed
+        HandoffRecovery* h = &handoff_recovery;
+        int to = shard_of(r->farmer_id);
+        if (to == s->id) return false;
+        if (h->position_count[s->id] == h->position_capacity[s->id]) {
+            long long capacity = h->position_capacity[s->id] ? h->position_capacity[s->id] * 2 : 1024;
+            long long* grown = (long long*)realloc(h->positions[s->id], (size_t)capacity * sizeof(long long));
+            if (grown == NULL) {
+                ledger_fatal("out of memory replaying cross-shard credits");
+            }
+            h->positions[s->id] = grown;
+            h->position_capacity[s->id] = capacity;
+        }
+        h->positions[s->id][h->position_count[s->id]++] = position;
+        h->prepared[s->id][to]++;
+        return true;
+    }
+    
+    int index = find_farmer_index(r->farmer_id);
+    if (index == -1) return false;
+    
+    if (r->type == 'C') {
+        deactivate_farmer(index);
+        return true;
+    }
+    if (r->type == 'B') {
+        return true; // Bulk transfer header; its rows follow as ordinary records
+    }
+    if (r->handoff != 0) {
+        int from = r->handoff - 1;
+        if (from >= SHARD_COUNT || from == s->id || (r->type != 'D' && r->type != 'W')) return false;
+        handoff_recovery.committed[from][s->id]++;
+    }
+    
+    Transaction t;
+    t.farmer_id = r->farmer_id;
+    t.amount = journal_amount(r);
+    if (t.amount <= 0 || t.amount > MONEY_MAX) return false;
+    t.timestamp = (time_t)r->timestamp;
+    t.type = r->type;
+    t.description = intern_description(text);
+    
+    adjust_balance(farmer_at(index), t.type == 'D' ? t.amount : -t.amount);
+    
+    // A journal from before sharding holds every account, so rows go by farmer
+    store_transaction(index, t);
+    if (push_recent) publish_recent(&shards[shard_of(t.farmer_id)].recent, &t);
+    
+    SystemStats delta = { 0 };
+    stats_count_row(&delta, t.type, t.amount);
+    stats_post(&delta);
+    return true;
+}
+
+LedgerStatus finish_handoffs() {
+    // A crash can fall between a shard journaling a cross-shard credit as 'H' and the
+    // recipient's shard journaling it as 'D' (or 'W', for an ingest batch's debit).
+    // Credits are handed over in journal order, so the ones that never landed are the
+    // newest 'H' records for that recipient.
+    HandoffRecovery* h = &handoff_recovery;
+    LedgerStatus status = LEDGER_OK;
+    long long finished = 0;
+    for (int s = 0; s < SHARD_COUNT && status == LEDGER_OK; s++) {
+        long long missing[SHARD_COUNT];
+        long long total = 0;
+        for (int d = 0; d < SHARD_COUNT; d++) {
+            missing[d] = h->prepared[s][d] - h->committed[s][d];
+            if (missing[d] < 0 && status == LEDGER_OK) {
+                ledger_fail("journal %d holds credits journal %d never prepared", d, s);
+                status = LEDGER_CORRUPT;
+            }
+            total += missing[d];
+        }
+        if (status != LEDGER_OK || total == 0) continue;
+        
+        // Found newest first, finished oldest first
+        JournalRecord* found = (JournalRecord*)malloc((size_t)total * sizeof(JournalRecord));
+        if (found == NULL) {
+            ledger_fail("out of memory replaying cross-shard credits");
+            status = LEDGER_NO_MEMORY;
+            continue;
+        }
+        long long count = 0;
+        for (long long i = h->position_count[s] - 1; i >= 0 && count < total; i--) {
+            JournalRecord r;
+            off_t offset = (off_t)(h->positions[s][i] * (long long)sizeof(JournalRecord));
+            if (pread(shards[s].journal.fd, &r, sizeof(r), offset) != (ssize_t)sizeof(r)) {
+                ledger_fail("cannot reread journal %d: %s", s, strerror(errno));
+                status = LEDGER_IO_ERROR;
+                break;
+            }
+            int d = shard_of(r.farmer_id);
+            if (missing[d] > 0) {
+                missing[d]--;
+                found[count++] = r;
+            }
+        }
+        for (long long i = count - 1; i >= 0 && status == LEDGER_OK; i--) {
+            JournalRecord* r = &found[i];
+            Shard* to = &shards[shard_of(r->farmer_id)];
+            r->type = r->reserved[0] == 'W' ? 'W' : 'D';
+            r->handoff = (char)(s + 1);
+            r->reserved[0] = 0;
+            r->checksum = journal_checksum(r);
+            if (!journal_apply(to, r, to->journal.record_count, true)) {
+                ledger_fail("cross-shard credit to farmer %d does not match the ledger", r->farmer_id);
+                status = LEDGER_CORRUPT;
+                break;
+            }
+            journal_append(&to->journal, r->farmer_id, r->type, (time_t)r->timestamp, r->amount, r->description, s + 1);
+        }
+        finished += count;
+        free(found);
+    }
+    
+    if (finished > 0) {
+        journal_commit();
+        ledger_notice("journal: finished %lld cross-shard credits interrupted by a crash", finished);
+    }
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        free(h->positions[s]);
+    }
+    memset(h, 0, sizeof(*h));
+    return status;
+}
+
+money_t journal_amount(const JournalRecord* r) {
+    if (r->magic == JOURNAL_MAGIC) return r->amount;
+    
+    // Older journals stored a double; round it to the nearest cent
+    double value;
+    memcpy(&value, &r->amount, sizeof(value));
+    value *= MONEY_SCALE;
+    return (money_t)(value < 0 ? value - 0.5 : value + 0.5);
+}
+
+void journal_append(Journal* j, int farmer_id, char type, time_t timestamp, int64_t amount, const char* text, int handoff) {
+    pthread_mutex_lock(&j->lock);
+    JournalRecord* r = &j->pending[j->pending_count++];
+    memset(r, 0, sizeof(*r));
+    r->magic = JOURNAL_MAGIC;
+    r->farmer_id = farmer_id;
+    r->type = type;
+    r->handoff = (char)handoff;
+    r->timestamp = (int64_t)timestamp;
+    r->amount = amount;
+    snprintf(r->description, sizeof(r->description), "%s", text);
+    r->checksum = journal_checksum(r);
+    j->last_checksum = r->checksum;
+    j->record_count++;
+    
+    if (j->pending_count == JOURNAL_GROUP_COMMIT) {
+        journal_write_pending(j);
+    }
+    pthread_mutex_unlock(&j->lock);
+}
+
+void journal_append_bulk(Shard* s, const BulkBatch* bulk) {
+    // A 'B' header with the row count, then the rows, in one write so a crash
+    // leaves either all of them or a torn tail that replay cuts off. Credits for
+    // another shard's accounts (or debits, in an ingest batch) are written as 'H'
+    // until that shard journals them. An accrual's 'P' record goes last, so the period closes only with its credits.
+    Journal* j = &s->journal;
+    size_t rows = (size_t)bulk->count + (bulk->period > 0 ? 1 : 0);
+    size_t count = rows + 1;
+    JournalRecord* records = (JournalRecord*)calloc(count, sizeof(JournalRecord));
+    if (records == NULL) {
+        ledger_fatal("out of memory for bulk journal write");
+    }
+    for (size_t i = 0; i < count; i++) {
+        JournalRecord* r = &records[i];
+        if (i > (size_t)bulk->count) {
+            const Transaction* last = &bulk->rows[bulk->count - 1];
+            r->magic = JOURNAL_MAGIC;
+            r->type = 'P';
+            r->timestamp = (int64_t)last->timestamp;
+            r->amount = bulk->period;
+            snprintf(r->description, sizeof(r->description), "%s", description_at(last->description));
+            r->checksum = journal_checksum(r);
+            continue;
+        }
+        const Transaction* t = i == 0 ? &bulk->rows[0] : &bulk->rows[i - 1];
+        r->magic = JOURNAL_MAGIC;
+        r->farmer_id = t->farmer_id;
+        r->type = i == 0 ? 'B' : shard_of(t->farmer_id) != s->id ? 'H' : t->type;
+        if (r->type == 'H') r->reserved[0] = t->type;
+        r->handoff = (char)(i > 0 && bulk->shard >= 0 ? bulk->shard + 1 : 0);
+        r->timestamp = (int64_t)t->timestamp;
+        r->amount = i == 0 ? (int64_t)rows : t->amount;
+        snprintf(r->description, sizeof(r->description), "%s", description_at(t->description));
+        r->checksum = journal_checksum(r);
+    }
+    
+    pthread_mutex_lock(&j->lock);
+    if (j->pending_count > 0) {
+        journal_write_records(j, j->pending, (size_t)j->pending_count);
+        j->pending_count = 0;
+    }
+    journal_write_records(j, records, count);
+    j->record_count += (long long)count;
+    j->last_checksum = records[count - 1].checksum;
+    pthread_mutex_unlock(&j->lock);
+    free(records);
+}
+
+bool journal_batch_complete(Journal* j, long long position, long long count, long long total) {
+    // Replay reads ahead over the rows of a bulk transfer before applying any of them
+    if (count < 0 || count > total - position) return false;
+    
+    JournalRecord* block = (JournalRecord*)malloc(JOURNAL_REPLAY_BATCH * sizeof(JournalRecord));
+    bool complete = true;
+    for (long long done = 0; done < count && complete; ) {
+        long long want = count - done;
+        if (want > JOURNAL_REPLAY_BATCH) want = JOURNAL_REPLAY_BATCH;
+        size_t bytes = (size_t)want * sizeof(JournalRecord);
+        off_t offset = (off_t)((position + done) * (long long)sizeof(JournalRecord));
+        if (pread(j->fd, block, bytes, offset) != (ssize_t)bytes) {
+            complete = false;
+            break;
+        }
+        for (long long i = 0; i < want; i++) {
+            if (block[i].magic != JOURNAL_MAGIC || block[i].type == 'B' || block[i].checksum != journal_checksum(&block[i])) {
+                complete = false;
+                break;
+            }
+        }
+        done += want;
+    }
+    free(block);
+    return complete;
+}
+
+void journal_sync(Journal* j) {
+    pthread_mutex_lock(&j->lock);
+    journal_write_pending(j);
+    pthread_mutex_unlock(&j->lock);
+}
+
+void journal_commit() {
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        journal_sync(&shards[i].journal);
+    }
+}
+
+void journal_write_pending(Journal* j) {
+    // Caller holds j->lock
+    if (j->fd == -1) return;
+    
+    // One write and one fsync for the whole group
+    uint64_t started = metrics_clock();
+    if (j->pending_count > 0) {
+        journal_write_records(j, j->pending, (size_t)j->pending_count);
+        j->pending_count = 0;
+    }
+    if (!j->unsynced) return;
+    if (fsync(j->fd) == -1) {
+        ledger_fatal("journal fsync failed: %s", strerror(errno));
+    }
+    j->unsynced = false;
+    metrics_record(METRIC_JOURNAL_SYNC, metrics_clock() - started, true);
+}
+
+void journal_write_records(Journal* j, const JournalRecord* records, size_t count) {
+    // Caller holds j->lock; journal_write_pending() makes it durable
+    const char* data = (const char*)records;
+    size_t bytes = count * sizeof(JournalRecord);
+    while (bytes > 0) {
+        ssize_t n = write(j->fd, data, bytes);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            ledger_fatal("journal write failed: %s", strerror(errno));
+        }
+        data += n;
+        bytes -= (size_t)n;
+    }
+    j->unsynced = true;
+}
+
+void journal_close() {
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        Journal* j = &shards[i].journal;
+        if (j->fd == -1) continue;
+        journal_sync(j);
+        close(j->fd);
+        j->fd = -1;
+    }
+}
+
+bool ledger_open(Ledger* l, const char* path, long long rows, uint64_t hash) {
+    // The ledger is derived state. With rows == 0 it starts empty; otherwise the
+    // file is reused only if its first rows still hash to what the snapshot recorded.
+    // A false return with rows == 0 is an I/O failure, explained in ledger_error().
+    size_t row_size = sizeof(money_t) + sizeof(int64_t) + sizeof(int32_t) + sizeof(uint32_t) + sizeof(char);
+    l->fd = open(path, rows == 0 ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0600);
+    if (l->fd == -1) {
+        return ledger_fail("cannot open ledger %s: %s", path, strerror(errno));
+    }
+    
+    size_t size = (size_t)LEDGER_INITIAL_CAPACITY * row_size;
+    if (rows == 0) {
+        if (ftruncate(l->fd, (off_t)size) == -1) {
+            ledger_fail("cannot size ledger %s: %s", path, strerror(errno));
+            ledger_close(l);
+            return false;
+        }
+    } else {
+        struct stat st;
+        if (fstat(l->fd, &st) == -1 || st.st_size == 0 || st.st_size % (off_t)row_size != 0 ||
+            st.st_size / (off_t)row_size < rows) {
+            close(l->fd);
+            l->fd = -1;
+            return false;
+        }
+        size = (size_t)st.st_size;
+    }
+    l->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, l->fd, 0);
+    if (l->map == MAP_FAILED) {
+        ledger_fail("cannot map ledger %s: %s", path, strerror(errno));
+        l->map = NULL;
+        ledger_close(l);
+        return false;
+    }
+    l->map_size = size;
+    ledger_bind_columns(l, (long long)(size / row_size));
+    
+    l->count = rows;
+    l->hash = 0;
+    for (long long row = 0; row < rows; row++) {
+        l->hash = ledger_row_hash(l, l->hash, row);
+    }
+    if (l->hash != hash) {
+        ledger_close(l);
+        return false;
+    }
+    
+    // Prefer the writer so a stream of statement screens cannot stall settlement
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&l->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    return true;
+}
+
+uint64_t ledger_row_hash(const Ledger* l, uint64_t hash, long long row) {
+    // Same word-at-a-time mix as journal_checksum(), chained row after row
+    uint64_t words[] = {
+        (uint64_t)l->amount[row],
+        (uint64_t)l->timestamp[row],
+        (uint64_t)(uint32_t)l->farmer_id[row] << 32 | l->description[row],
+        (uint64_t)(unsigned char)l->type[row]
+    };
+    for (int i = 0; i < 4; i++) {
+        hash ^= words[i];
+        hash *= 1099511628211ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+void ledger_bind_columns(Ledger* l, long long capacity) {
+    // Widest columns first so every column stays naturally aligned
+    char* p = l->map;
+    l->amount = (money_t*)p;      p += capacity * sizeof(money_t);
+    l->timestamp = (int64_t*)p;   p += capacity * sizeof(int64_t);
+    l->farmer_id = (int32_t*)p;   p += capacity * sizeof(int32_t);
+    l->description = (uint32_t*)p; p += capacity * sizeof(uint32_t);
+    l->type = p;
+    l->capacity = capacity;
+}
+
+void ledger_grow(Ledger* l) {
+    long long old_capacity = l->capacity;
+    long long new_capacity = old_capacity * 2;
+    size_t new_size = l->map_size * 2;
+    
+    if (ftruncate(l->fd, (off_t)new_size) == -1) {
+        ledger_fatal("cannot grow ledger: %s", strerror(errno));
+    }
+    char* map = mremap(l->map, l->map_size, new_size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        ledger_fatal("cannot remap ledger: %s", strerror(errno));
+    }
+    
+    // Slide each column to its new offset, last column first so nothing is overwritten
+    size_t widths[] = { sizeof(money_t), sizeof(int64_t), sizeof(int32_t), sizeof(uint32_t), sizeof(char) };
+    size_t old_offsets[5], new_offsets[5];
+    size_t old_offset = 0, new_offset = 0;
+    for (int c = 0; c < 5; c++) {
+        old_offsets[c] = old_offset;
+        new_offsets[c] = new_offset;
+        old_offset += (size_t)old_capacity * widths[c];
+        new_offset += (size_t)new_capacity * widths[c];
+    }
+    for (int c = 4; c > 0; c--) {
+        memmove(map + new_offsets[c], map + old_offsets[c], (size_t)l->count * widths[c]);
+    }
+    
+    l->map = map;
+    l->map_size = new_size;
+    ledger_bind_columns(l, new_capacity);
+}
+
+long long ledger_append(Ledger* l, const Transaction* t) {
+    if (l->count == l->capacity) {
+        ledger_grow(l);
+    }
+    
+    long long row = l->count++;
+    l->amount[row] = t->amount;
+    l->timestamp[row] = (int64_t)t->timestamp;
+    l->farmer_id[row] = t->farmer_id;
+    l->description[row] = t->description;
+    l->type[row] = t->type;
+    l->hash = ledger_row_hash(l, l->hash, row);
+    return row;
+}
+
+Transaction ledger_transaction(const Ledger* l, long long row) {
+    Transaction t;
+    t.farmer_id = l->farmer_id[row];
+    t.amount = l->amount[row];
+    t.timestamp = (time_t)l->timestamp[row];
+    t.type = l->type[row];
+    t.description = l->description[row];
+    return t;
+}
+
+money_t ledger_net_total(const Ledger* l, long long first, long long last) {
+    // Deposits minus withdrawals over rows [first, last). Branch-free conditional
+    // negate over two contiguous columns, so the compiler can vectorise it.
+    money_t net = 0;
+    for (long long row = first; row < last; row++) {
+        money_t negate = -(money_t)(l->type[row] != 'D');
+        net += (l->amount[row] ^ negate) - negate;
+    }
+    return net;
+}
+
+void ledger_close(Ledger* l) {
+    if (l->map != NULL) {
+        munmap(l->map, l->map_size);
+        l->map = NULL;
+    }
+    if (l->fd != -1) {
+        close(l->fd);
+        l->fd = -1;
+    }
+    l->count = 0;
+    l->capacity = 0;
+}
+
+uint64_t snapshot_hash(uint64_t hash, const void* data, size_t len) {
+    // Word-at-a-time like journal_checksum(); leftover bytes are mixed one by one
+    const char* p = (const char*)data;
+    for (; len >= sizeof(uint64_t); p += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        hash ^= word;
+        hash *= 1099511628211ULL;
+        hash ^= hash >> 29;
+    }
+    for (; len > 0; p++, len--) {
+        hash ^= (unsigned char)*p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void snapshot_flush(SnapshotWriter* w) {
+    w->hash = snapshot_hash(w->hash, w->buffer, w->used);
+    const char* p = w->buffer;
+    while (w->used > 0 && w->ok) {
+        ssize_t n = write(w->fd, p, w->used);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            w->ok = false;
+            break;
+        }
+        p += n;
+        w->used -= (size_t)n;
+    }
+    w->used = 0;
+}
+
+void snapshot_put(SnapshotWriter* w, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        size_t room = SNAPSHOT_BUFFER - w->used;
+        size_t n = len < room ? len : room;
+        memcpy(w->buffer + w->used, p, n);
+        w->used += n;
+        p += n;
+        len -= n;
+        if (w->used == SNAPSHOT_BUFFER) snapshot_flush(w);
+    }
+}
+
+void snapshot_header(SnapshotHeader* header) {
+    // Caller has the ledger quiet: quiesce_ledger(), or no other thread running
+    memset(header, 0, sizeof(*header));
+    header->magic = SNAPSHOT_MAGIC;
+    header->account_size = sizeof(SnapshotAccount);
+    header->shard_count = SHARD_COUNT;
+    header->accounts = num_farmers;
+    header->next_farmer_id = next_farmer_id;
+    header->heap_blocks = descriptions.block_count;
+    header->heap_used = (int64_t)descriptions.block_used;
+    header->heap_slots = (int64_t)descriptions.slot_count;
+    header->heap_entries = (int64_t)descriptions.entries;
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        header->journal_records[i] = shards[i].journal.record_count;
+        header->journal_checksum[i] = shards[i].journal.last_checksum;
+        header->ledger_rows[i] = shards[i].ledger.count;
+        header->ledger_hash[i] = shards[i].ledger.hash;
+        header->closed_period[i] = shards[i].closed_period;
+    }
+    header->stats = stats_snapshot();
+}
+
+bool snapshot_open(SnapshotWriter* w, const char* path) {
+    // Creates path.tmp and the output buffer. Done before checkpoint() forks, so the
+    // child never has to allocate or open anything.
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    *w = (SnapshotWriter){ .fd = -1, .hash = 1469598103934665603ULL, .ok = true };
+    w->fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    w->buffer = (char*)malloc(SNAPSHOT_BUFFER);
+    if (w->fd == -1 || w->buffer == NULL) {
+        snapshot_close(w, path, false);
+        return false;
+    }
+    return true;
+}
+
+bool snapshot_write(SnapshotWriter* w, const SnapshotHeader* header) {
+    // Writes the header, every account, the description heap and its probe table, then
+    // a checksum of all of it. Only copies into the prepared buffer, write() and fsync(),
+    // so it is safe in a child forked from a threaded process.
+    snapshot_put(w, header, sizeof(*header));
+    for (int i = 0; i < header->accounts; i++) {
+        const Farmer* f = farmer_at(i);
+        SnapshotAccount a;
+        memset(&a, 0, sizeof(a));
+        a.farmer_id = f->farmer_id;
+        a.password = f->password;
+        a.balance = f->balance;
+        memcpy(a.username, f->username, sizeof(a.username));
+        a.username[sizeof(a.username) - 1] = '\0';
+        a.active = f->active;
+        snapshot_put(w, &a, sizeof(a));
+    }
+    for (int b = 0; b < header->heap_blocks; b++) {
+        size_t len = b == header->heap_blocks - 1 ? (size_t)header->heap_used : (size_t)1 << STRING_HEAP_BLOCK_SHIFT;
+        snapshot_put(w, descriptions.blocks[b], len);
+    }
+    snapshot_put(w, descriptions.slots, (size_t)header->heap_slots * sizeof(uint32_t));
+    snapshot_flush(w);
+    
+    // The checksum itself is written unhashed
+    uint64_t sum = w->hash;
+    memcpy(w->buffer, &sum, sizeof(sum));
+    w->used = sizeof(sum);
+    snapshot_flush(w);
+    return w->ok && fsync(w->fd) == 0;
+}
+
+bool snapshot_close(SnapshotWriter* w, const char* path, bool ok) {
+    // Releases what snapshot_open() set up; an unfinished path.tmp is removed
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (w->fd != -1) close(w->fd);
+    free(w->buffer);
+    w->fd = -1;
+    w->buffer = NULL;
+    if (!ok) unlink(tmp);
+    return ok;
+}
+
+bool snapshot_publish(const char* path) {
+    // The snapshot names ledger rows, so they must be on disk before it replaces the old one
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    bool synced = true;
+    for (int i = 0; i < SHARD_COUNT && synced; i++) {
+        synced = fdatasync(shards[i].ledger.fd) == 0;
+    }
+    if (!synced || rename(tmp, path) == -1) {
+        ledger_notice("snapshot not saved: %s", strerror(errno));
+        unlink(tmp);
+        return false;
+    }
+    
+    // Make the rename itself durable
+    int dir = open(".", O_RDONLY | O_DIRECTORY);
+    if (dir != -1) {
+        fsync(dir);
+        close(dir);
+    }
+    return true;
+}
+
+LedgerStatus snapshot_load(const char* path, long long* resume, bool* restored) {
+    // Restores the newest snapshot and opens every shard's ledger. Fills resume with
+    // how many of each shard's journal records it already covers; all 0 (and empty
+    // ledgers, with *restored false) when there is none to use.
+    char ledger_paths[SHARD_COUNT][256];
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        resume[i] = 0;
+        shard_file_name(ledger_paths[i], sizeof(ledger_paths[i]), LEDGER_FILE, i);
+    }
+    *restored = false;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        for (int i = 0; i < SHARD_COUNT; i++) {
+            if (!ledger_open(&shards[i].ledger, ledger_paths[i], 0, 0)) return LEDGER_IO_ERROR;
+        }
+        return LEDGER_OK;
+    }
+    
+    struct stat st;
+    char* data = NULL;
+    size_t size = 0;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)(sizeof(SnapshotHeader) + sizeof(uint64_t))) {
+        size = (size_t)st.st_size;
+        data = (char*)malloc(size);
+        size_t got = 0;
+        while (data != NULL && got < size) {
+            ssize_t n = read(fd, data + got, size - got);
+            if (n <= 0) break;
+            got += (size_t)n;
+        }
+        if (got != size) size = 0;
+    }
+    close(fd);
+    
+    // Every length is checked against the file before anything is trusted
+    const SnapshotHeader* h = (const SnapshotHeader*)data;
+    size_t block_size = (size_t)1 << STRING_HEAP_BLOCK_SHIFT;
+    bool valid = data != NULL && size > 0 && h->magic == SNAPSHOT_MAGIC &&
+                 h->account_size == sizeof(SnapshotAccount) &&
+                 h->accounts >= 0 && h->accounts <= FARMER_BLOCK_SIZE * MAX_FARMER_BLOCKS &&
+                 h->next_farmer_id > 0 &&
+                 h->heap_blocks >= 0 && h->heap_blocks <= STRING_HEAP_MAX_BLOCKS &&
+                 h->heap_used >= 0 && h->heap_used <= (int64_t)block_size &&
+                 h->heap_slots >= 0 && h->heap_slots <= (int64_t)1 << 32 &&
+                 (h->heap_slots & (h->heap_slots - 1)) == 0 && h->heap_entries * 2 <= h->heap_slots &&
+                 h->shard_count == SHARD_COUNT;
+    long long records = 0;
+    for (int i = 0; valid && i < SHARD_COUNT; i++) {
+        valid = h->journal_records[i] >= 0 && h->ledger_rows[i] >= 0 &&
+                h->closed_period[i] >= 0 && h->closed_period[i] <= INT32_MAX;
+        records += h->journal_records[i];
+    }
+    valid = valid && records > 0;
+    size_t heap_bytes = 0;
+    if (valid) {
+        heap_bytes = h->heap_blocks > 0 ? (size_t)(h->heap_blocks - 1) * block_size + (size_t)h->heap_used : 0;
+        size_t expected = sizeof(SnapshotHeader) + (size_t)h->accounts * sizeof(SnapshotAccount) +
+                          heap_bytes + (size_t)h->heap_slots * sizeof(uint32_t) + sizeof(uint64_t);
+        uint64_t sum;
+        memcpy(&sum, data + size - sizeof(sum), sizeof(sum));
+        valid = expected == size && sum == snapshot_hash(1469598103934665603ULL, data, size - sizeof(sum));
+    }
+    
+    // Each journal must still hold the record the snapshot stopped at; a journal
+    // that was replaced or cut short makes the snapshot meaningless
+    for (int i = 0; valid && i < SHARD_COUNT; i++) {
+        if (h->journal_records[i] == 0) continue;
+        JournalRecord r;
+        off_t offset = (off_t)((h->journal_records[i] - 1) * (long long)sizeof(JournalRecord));
+        valid = pread(shards[i].journal.fd, &r, sizeof(r), offset) == (ssize_t)sizeof(r) &&
+                r.checksum == h->journal_checksum[i] && r.checksum == journal_checksum(&r);
+    }
+    int opened = 0;
+    while (valid && opened < SHARD_COUNT) {
+        valid = ledger_open(&shards[opened].ledger, ledger_paths[opened], h->ledger_rows[opened], h->ledger_hash[opened]);
+        if (valid) opened++;
+    }
+    if (!valid) {
+        ledger_notice("snapshot %s does not match the journals and ledgers; replaying the whole journals", path);
+        free(data);
+        for (int i = 0; i < SHARD_COUNT; i++) {
+            if (i < opened) ledger_close(&shards[i].ledger);
+            if (!ledger_open(&shards[i].ledger, ledger_paths[i], 0, 0)) return LEDGER_IO_ERROR;
+        }
+        return LEDGER_OK;
+    }
+    
+    // Description heap first: ledger rows refer to it by id
+    const char* p = data + sizeof(SnapshotHeader);
+    const SnapshotAccount* accounts = (const SnapshotAccount*)p;
+    p += (size_t)h->accounts * sizeof(SnapshotAccount);
+    for (int b = 0; b < h->heap_blocks; b++) {
+        size_t len = b == h->heap_blocks - 1 ? (size_t)h->heap_used : block_size;
+        descriptions.blocks[b] = (char*)malloc(block_size);
+        if (descriptions.blocks[b] == NULL) {
+            ledger_fatal("out of memory for descriptions");
+        }
+        memcpy(descriptions.blocks[b], p, len);
+        p += len;
+    }
+    descriptions.block_count = h->heap_blocks;
+    descriptions.block_used = (size_t)h->heap_used;
+    if (h->heap_slots > 0) {
+        descriptions.slots = (uint32_t*)malloc((size_t)h->heap_slots * sizeof(uint32_t));
+        if (descriptions.slots == NULL) {
+            ledger_fatal("out of memory for descriptions");
+        }
+        memcpy(descriptions.slots, p, (size_t)h->heap_slots * sizeof(uint32_t));
+    }
+    descriptions.slot_count = (size_t)h->heap_slots;
+    descriptions.entries = (size_t)h->heap_entries;
+    reindex_descriptions();
+    
+    // Accounts in registry order; IDs are handed out in sequence, so a flat
+    // array maps a ledger row's farmer to its registry index
+    int* index_of = (int*)malloc((size_t)h->next_farmer_id * sizeof(int));
+    if (index_of == NULL) {
+        ledger_fatal("out of memory loading snapshot");
+    }
+    for (int id = 0; id < h->next_farmer_id; id++) index_of[id] = -1;
+    for (int i = 0; i < h->accounts; i++) {
+        const SnapshotAccount* a = &accounts[i];
+        if (a->farmer_id <= 0 || a->farmer_id >= h->next_farmer_id || register_farmer(a->farmer_id, a->username, a->password) != i) {
+            ledger_fail("snapshot account %d does not fit the registry", a->farmer_id);
+            free(index_of);
+            free(data);
+            return LEDGER_CORRUPT;
+        }
+        farmer_at(i)->balance = a->balance;
+        index_of[a->farmer_id] = i;
+    }
+    
+    // Histories come straight from each ledger's farmer column
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        const Ledger* l = &shards[s].ledger;
+        for (long long row = 0; row < h->ledger_rows[s]; row++) {
+            int32_t farmer_id = l->farmer_id[row];
+            if (farmer_id <= 0 || farmer_id >= h->next_farmer_id || index_of[farmer_id] == -1 || shard_of(farmer_id) != s) {
+                ledger_fail("ledger %d row %lld (farmer %d) does not match the snapshot", s, row, farmer_id);
+                free(index_of);
+                free(data);
+                return LEDGER_CORRUPT;
+            }
+            history_append(index_of[farmer_id], (int)row);
+        }
+    }
+    free(index_of);
+    
+    // Closed accounts go last so a reused username indexes its newest owner
+    for (int i = 0; i < h->accounts; i++) {
+        if (!accounts[i].active) deactivate_farmer(i);
+    }
+    next_farmer_id = h->next_farmer_id;
+    pthread_mutex_lock(&system_stats.write_lock);
+    system_stats.current = h->stats;
+    pthread_mutex_unlock(&system_stats.write_lock);
+    
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        long long rows = h->ledger_rows[s];
+        long long feed_from = rows > RECENT_FEED_CAPACITY ? rows - RECENT_FEED_CAPACITY : 0;
+        for (long long row = feed_from; row < rows; row++) {
+            Transaction t = ledger_transaction(&shards[s].ledger, row);
+            publish_recent(&shards[s].recent, &t);
+        }
+        shards[s].journal.last_checksum = h->journal_checksum[s];
+        shards[s].closed_period = (int32_t)h->closed_period[s];
+        resume[s] = h->journal_records[s];
+    }
+    checkpointer.records = records;
+    free(data);
+    *restored = true;
+    return LEDGER_OK;
+}
+
+void quiesce_ledger() {
+    // Same order tellers use: stripes ascending, then the registry. With all of them
+    // held nothing new can be queued, so draining the queues leaves everything still.
+    for (int i = 0; i < ACCOUNT_LOCK_STRIPES; i++) {
+        pthread_mutex_lock(&account_locks[i]);
+    }
+    pthread_mutex_lock(&registry_lock);
+    settle_all();
+    journal_commit();
+    pthread_mutex_lock(&descriptions.lock);
+}
+
+void release_ledger() {
+    pthread_mutex_unlock(&descriptions.lock);
+    pthread_mutex_unlock(&registry_lock);
+    for (int i = ACCOUNT_LOCK_STRIPES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&account_locks[i]);
+    }
+}
+
+bool checkpoint() {
+    // Tellers wait only while the queue drains and the process forks. The child
+    // writes the snapshot from its copy-on-write image while they carry on. Another
+    // thread may hold the malloc or stdio locks at the fork, so the file and buffer
+    // are set up beforehand and the child only writes, syncs and exits.
+    pthread_mutex_lock(&checkpointer.busy);
+    SnapshotWriter w;
+    if (!snapshot_open(&w, SNAPSHOT_FILE)) {
+        pthread_mutex_unlock(&checkpointer.busy);
+        return false;
+    }
+    SnapshotHeader header;
+    quiesce_ledger();
+    snapshot_header(&header);
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(snapshot_write(&w, &header) ? 0 : 1);
+    }
+    release_ledger();
+    
+    int status = 0;
+    bool ok = pid != -1;
+    while (ok && waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) ok = false;
+    }
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    ok = snapshot_close(&w, SNAPSHOT_FILE, ok) && snapshot_publish(SNAPSHOT_FILE);
+    if (ok) {
+        long long records = 0;
+        for (int i = 0; i < SHARD_COUNT; i++) {
+            records += header.journal_records[i];
+        }
+        pthread_mutex_lock(&checkpointer.lock);
+        checkpointer.records = records;
+        pthread_mutex_unlock(&checkpointer.lock);
+    }
+    pthread_mutex_unlock(&checkpointer.busy);
+    return ok;
+}
+
+void* checkpoint_worker(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&checkpointer.lock);
+    while (checkpointer.running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SNAPSHOT_INTERVAL;
+        pthread_cond_timedwait(&checkpointer.wake, &checkpointer.lock, &deadline);
+        if (!checkpointer.running) break;
+        
+        long long records = 0;
+        for (int i = 0; i < SHARD_COUNT; i++) {
+            pthread_mutex_lock(&shards[i].journal.lock);
+            records += shards[i].journal.record_count;
+            pthread_mutex_unlock(&shards[i].journal.lock);
+        }
+        if (records - checkpointer.records < SNAPSHOT_MIN_RECORDS) continue;
+        
+        pthread_mutex_unlock(&checkpointer.lock);
+        checkpoint();
+        pthread_mutex_lock(&checkpointer.lock);
+    }
+    pthread_mutex_unlock(&checkpointer.lock);
+    return NULL;
+}
+
+bool start_checkpointer() {
+    checkpointer.running = true;
+    if (pthread_create(&checkpointer.thread, NULL, checkpoint_worker, NULL) != 0) {
+        checkpointer.running = false;
+        return ledger_fail("cannot start checkpoint thread");
+    }
+    return true;
+}
+
+void stop_checkpointer() {
+    pthread_mutex_lock(&checkpointer.lock);
+    if (!checkpointer.running) {
+        pthread_mutex_unlock(&checkpointer.lock);
+        return;
+    }
+    checkpointer.running = false;
+    pthread_cond_signal(&checkpointer.wake);
+    pthread_mutex_unlock(&checkpointer.lock);
+    pthread_join(checkpointer.thread, NULL);
+}
+
+void history_append(int index, int row) {
+    // Only the account's shard worker gets here, so the shard's slab needs no lock
+    Farmer* f = farmer_at(index);
+    Shard* s = &shards[shard_of(f->farmer_id)];
+    const Ledger* l = &s->ledger;
+    int count = f->transaction_count;
+    if (count == f->history_capacity) {
+        // Slab-allocated; the outgrown arrays go back to their size class for other farmers
+        int capacity = f->history_capacity ? f->history_capacity * 2 : HISTORY_INITIAL_CAPACITY;
+        int chunk_count = (capacity + HISTORY_CHUNK_ROWS - 1) / HISTORY_CHUNK_ROWS;
+        int old_chunks = (f->history_capacity + HISTORY_CHUNK_ROWS - 1) / HISTORY_CHUNK_ROWS;
+        int* history = (int*)slab_alloc(&s->history_slab, (size_t)capacity * sizeof(int));
+        HistoryChunk* chunks = (HistoryChunk*)slab_alloc(&s->history_slab, (size_t)chunk_count * sizeof(HistoryChunk));
+        if (count > 0) {
+            memcpy(history, f->history, (size_t)count * sizeof(int));
+            memcpy(chunks, f->chunks, (size_t)old_chunks * sizeof(HistoryChunk));
+            slab_free(&s->history_slab, f->history, (size_t)f->history_capacity * sizeof(int));
+            slab_free(&s->history_slab, f->chunks, (size_t)old_chunks * sizeof(HistoryChunk));
+        }
+        f->history = history;
+        f->chunks = chunks;
+        f->history_capacity = capacity;
+    }
+    
+    // Always an append, even when the clock stepped back, so history positions never
+    // change under a statement cursor. Only the chunk bounds account for the disorder.
+    int64_t when = l->timestamp[row];
+    f->history[count] = row;
+    int c = count / HISTORY_CHUNK_ROWS;
+    if (count % HISTORY_CHUNK_ROWS == 0) {
+        f->chunks[c].min_time = when;
+        f->chunks[c].max_time = c > 0 && f->chunks[c - 1].max_time > when ? f->chunks[c - 1].max_time : when;
+    } else {
+        if (when < f->chunks[c].min_time) f->chunks[c].min_time = when;
+        if (when > f->chunks[c].max_time) f->chunks[c].max_time = when;
+    }
+    // An earlier timestamp lowers the bound of every chunk before it that was still above it
+    for (c--; c >= 0 && f->chunks[c].min_time > when; c--) {
+        f->chunks[c].min_time = when;
+    }
+    f->transaction_count = count + 1;
+}
+
+int history_range(const Farmer* f, int64_t start, int64_t end, int* first) {
+    // Caller holds farmer_ledger(f)->lock for reading. Returns the length of the run
+    // history[*first] onwards that holds every entry in [start, end]. In time order
+    // that is exactly those entries; after the clock stepped back the run may also
+    // hold a few outside the window, so callers check each timestamp.
+    const Ledger* l = farmer_ledger(f);
+    int count = f->transaction_count;
+    int chunk_count = (count + HISTORY_CHUNK_ROWS - 1) / HISTORY_CHUNK_ROWS;
+    
+    // Binary search the chunk spans for the first chunk that reaches start
+    int lo = 0, hi = chunk_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (f->chunks[mid].max_time < start) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == chunk_count || f->chunks[lo].min_time > end) {
+        *first = count;
+        return 0;
+    }
+    
+    // Everything before that chunk's first entry at or after start is earlier than start
+    int pos = lo * HISTORY_CHUNK_ROWS;
+    while (l->timestamp[f->history[pos]] < start) pos++;
+    
+    // The run ends after the last entry up to end; past a chunk whose bound is
+    // later than end, nothing can match
+    int last = pos;
+    for (int i = pos; i < count; i++) {
+        if (i % HISTORY_CHUNK_ROWS == 0 && f->chunks[i / HISTORY_CHUNK_ROWS].min_time > end) break;
+        if (l->timestamp[f->history[i]] <= end) last = i + 1;
+    }
+    *first = pos;
+    return last - pos;
+}
+
+int statement_total(const StatementCursor* c) {
+    // 0 once the account is closed
+    int index = find_farmer_index(c->farmer_id);
+    return index == -1 ? 0 : atomic_load_explicit(&farmer_at(index)->transaction_count, memory_order_acquire);
+}
+
+void statement_latest(StatementCursor* c, int farmer_id, int page_size) {
+    c->farmer_id = farmer_id;
+    c->page_size = page_size < 1 ? 1 : page_size > STATEMENT_PAGE_MAX ? STATEMENT_PAGE_MAX : page_size;
+    c->end = statement_total(c);
+    c->first = c->end > c->page_size ? c->end - c->page_size : 0;
+}
+
+void statement_oldest(StatementCursor* c, int farmer_id, int page_size) {
+    c->farmer_id = farmer_id;
+    c->page_size = page_size < 1 ? 1 : page_size > STATEMENT_PAGE_MAX ? STATEMENT_PAGE_MAX : page_size;
+    int total = statement_total(c);
+    c->first = 0;
+    c->end = total < c->page_size ? total : c->page_size;
+}
+
+bool statement_older(StatementCursor* c) {
+    if (c->first == 0) return false;
+    c->end = c->first;
+    c->first = c->end > c->page_size ? c->end - c->page_size : 0;
+    return true;
+}
+
+bool statement_newer(StatementCursor* c) {
+    // Reaches transactions settled since the cursor was opened
+    int total = statement_total(c);
+    if (c->end >= total) return false;
+    c->first = c->end;
+    c->end = total - c->first < c->page_size ? total : c->first + c->page_size;
+    return true;
+}
+
+int statement_read(const StatementCursor* c, Transaction* out, int* rows) {
+    // Copies the page, oldest first, into out (and the ledger rows into rows unless it is
+    // NULL), each holding page_size entries. Returns how many, or -1 if the account is gone.
+    int index = find_farmer_index(c->farmer_id);
+    if (index == -1) return -1;
+    
+    const Farmer* f = farmer_at(index);
+    Ledger* l = farmer_ledger(f);
+    pthread_rwlock_rdlock(&l->lock);
+    int last = c->end < f->transaction_count ? c->end : f->transaction_count;
+    int count = 0;
+    for (int i = c->first; i < last; i++, count++) {
+        int row = f->history[i];
+        out[count] = ledger_transaction(l, row);
+        if (rows != NULL) rows[count] = row;
+    }
+    pthread_rwlock_unlock(&l->lock);
+    return count;
+}
+
+const char* statement_token(const StatementCursor* c, char* buf) {
+    // buf holds STATEMENT_TOKEN_SIZE bytes
+    snprintf(buf, STATEMENT_TOKEN_SIZE, "%d:%d:%d:%d", c->farmer_id, c->first, c->end, c->page_size);
+    return buf;
+}
+
+bool statement_resume(StatementCursor* c, const char* token) {
+    // Only the shape is checked; callers check the account is one the user may read
+    StatementCursor t;
+    int used = 0;
+    if (sscanf(token, "%d:%d:%d:%d%n", &t.farmer_id, &t.first, &t.end, &t.page_size, &used) != 4 ||
+        token[used] != '\0' || t.page_size < 1 || t.page_size > STATEMENT_PAGE_MAX ||
+        t.first < 0 || t.end < t.first || t.end - t.first > t.page_size) {
+        return false;
+    }
+    *c = t;
+    return true;
+}
+
+void export_row(ExportWriter* w, const Transaction* t, int row, bool json, bool first) {
+    char number[24];
+    char amount[MONEY_TEXT_SIZE];
+    size_t amount_len = export_money(t->amount, amount);
+    char type = t->type == 'D' ? 'D' : 'W';
+    
+    if (json) {
+        export_put(w, first ? "\n{\"row\":" : ",\n{\"row\":", first ? 8 : 9);
+        export_put(w, number, (size_t)snprintf(number, sizeof(number), "%d", row));
+        export_put(w, ",\"timestamp\":\"", 14);
+        export_timestamp(w, t->timestamp);
+        export_put(w, "\",\"type\":\"", 10);
+        export_put(w, &type, 1);
+        export_put(w, "\",\"amount\":\"", 12);
+        export_put(w, amount, amount_len);
+        export_put(w, "\",\"description\":", 16);
+        export_text(w, description_at(t->description), true);
+        export_put(w, "}", 1);
+    } else {
+        export_put(w, number, (size_t)snprintf(number, sizeof(number), "%d,", row));
+        export_timestamp(w, t->timestamp);
+        export_put(w, ",", 1);
+        export_put(w, &type, 1);
+        export_put(w, ",", 1);
+        export_put(w, amount, amount_len);
+        export_put(w, ",", 1);
+        export_text(w, description_at(t->description), false);
+        export_put(w, "\n", 1);
+    }
+}
+
+size_t export_money(money_t amount, char* buf) {
+    // Same text as money_text(), written back to front without printf
+    uint64_t magnitude = amount < 0 ? (uint64_t)0 - (uint64_t)amount : (uint64_t)amount;
+    char digits[MONEY_TEXT_SIZE];
+    char* p = digits + sizeof(digits);
+    uint64_t cents = magnitude % MONEY_SCALE;
+    uint64_t units = magnitude / MONEY_SCALE;
+    *--p = (char)('0' + cents % 10);
+    *--p = (char)('0' + cents / 10);
+    *--p = '.';
+    do {
+        *--p = (char)('0' + units % 10);
+        units /= 10;
+    } while (units > 0);
+    if (amount < 0) *--p = '-';
+    
+    size_t len = (size_t)(digits + sizeof(digits) - p);
+    memcpy(buf, p, len);
+    return len;
+}
+
+void export_timestamp(ExportWriter* w, time_t when) {
+    // "YYYY-MM-DD HH:MM:SS" in local time. A statement's rows arrive day by day,
+    // so the date is formatted once per day and the time worked out from midnight.
+    // Days with a clock change fall back to localtime_r() for every row.
+    char text[20];
+    if (when < w->day_start || when >= w->day_end) {
+        struct tm day;
+        localtime_r(&when, &day);
+        day.tm_hour = 0;
+        day.tm_min = 0;
+        day.tm_sec = 0;
+        day.tm_isdst = -1;
+        w->day_start = (int64_t)mktime(&day);
+        strftime(w->day_text, sizeof(w->day_text), "%Y-%m-%d", &day);
+        day.tm_mday++;
+        day.tm_isdst = -1;
+        w->day_end = (int64_t)mktime(&day);
+        w->day_exact = w->day_end - w->day_start == 24 * 60 * 60;
+    }
+    
+    if (!w->day_exact) {
+        struct tm local;
+        localtime_r(&when, &local);
+        strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &local);
+        export_put(w, text, 19);
+        return;
+    }
+    int seconds = (int)((int64_t)when - w->day_start);
+    int hour = seconds / 3600, minute = seconds / 60 % 60, second = seconds % 60;
+    memcpy(text, w->day_text, 10);
+    text[10] = ' ';
+    text[11] = (char)('0' + hour / 10);
+    text[12] = (char)('0' + hour % 10);
+    text[13] = ':';
+    text[14] = (char)('0' + minute / 10);
+    text[15] = (char)('0' + minute % 10);
+    text[16] = ':';
+    text[17] = (char)('0' + second / 10);
+    text[18] = (char)('0' + second % 10);
+    export_put(w, text, 19);
+}
+
+void export_text(ExportWriter* w, const char* text, bool json) {
+    // JSON gets a quoted, escaped string. CSV quotes only a field that needs it,
+    // doubling any quote inside.
+    if (!json) {
+        if (strpbrk(text, ",\"\r\n") == NULL) {
+            export_put(w, text, strlen(text));
+            return;
+        }
+        export_put(w, "\"", 1);
+        for (const char* p = text; *p; p++) {
+            if (*p == '"') export_put(w, "\"", 1);
+            export_put(w, p, 1);
+        }
+        export_put(w, "\"", 1);
+        return;
+    }
+    
+    export_put(w, "\"", 1);
+    const char* run = text;
+    for (const char* p = text; ; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c != '\0' && c != '"' && c != '\\' && c >= 0x20) continue;
+        export_put(w, run, (size_t)(p - run));
+        if (c == '\0') break;
+        char escape[8];
+        if (c == '"' || c == '\\') {
+            escape[0] = '\\';
+            escape[1] = (char)c;
+            export_put(w, escape, 2);
+        } else {
+            export_put(w, escape, (size_t)snprintf(escape, sizeof(escape), "\\u%04x", c));
+        }
+        run = p + 1;
+    }
+    export_put(w, "\"", 1);
+}
+
+void export_put(ExportWriter* w, const char* data, size_t len) {
+    // Fields are short, so one flush always makes room
+    if (EXPORT_BUFFER - w->used < len) {
+        export_flush(w);
+    }
+    memcpy(w->buffer + w->used, data, len);
+    w->used += len;
+}
+
+void export_flush(ExportWriter* w) {
+    const char* p = w->buffer;
+    while (w->used > 0 && w->ok) {
+        ssize_t n = write(w->fd, p, w->used);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            w->ok = false;
+            break;
+        }
+        p += n;
+        w->used -= (size_t)n;
+    }
+    w->used = 0;
+}
+
+int slab_class(size_t bytes) {
+    int c = 0;
+    while (((size_t)1 << (c + SLAB_MIN_SHIFT)) < bytes) c++;
+    return c;
+}
+
+void* slab_alloc(SlabAllocator* slab, size_t bytes) {
+    // Single-threaded per allocator: a shard's history_slab is only used by its worker or during replay
+    int c = slab_class(bytes);
+    size_t size = (size_t)1 << (c + SLAB_MIN_SHIFT);
+    
+    void* p = slab->free_lists[c];
+    if (p != NULL) {
+        slab->free_lists[c] = *(void**)p;
+        return p;
+    }
+    
+    if (size > slab->remaining) {
+        // Big objects get a slab of their own; the rest of the current slab stays in use
+        size_t slab_bytes = size > SLAB_SIZE / 4 ? size : SLAB_SIZE;
+        SlabHeader* header = (SlabHeader*)malloc(sizeof(SlabHeader) + slab_bytes);
+        if (header == NULL) {
+            ledger_fatal("out of memory for slab allocator");
+        }
+        header->size = slab_bytes;
+        header->next = slab->slabs;
+        slab->slabs = header;
+        slab->reserved += sizeof(SlabHeader) + slab_bytes;
+        if (slab_bytes != SLAB_SIZE) {
+            return header + 1;
+        }
+        slab->cursor = (char*)(header + 1);
+        slab->remaining = slab_bytes;
+    }
+    
+    p = slab->cursor;
+    slab->cursor += size;
+    slab->remaining -= size;
+    return p;
+}
+
+void slab_free(SlabAllocator* slab, void* p, size_t bytes) {
+    // bytes must be the size the object was allocated with
+    int c = slab_class(bytes);
+    *(void**)p = slab->free_lists[c];
+    slab->free_lists[c] = p;
+}
+
+void slab_release_all(SlabAllocator* slab) {
+    while (slab->slabs != NULL) {
+        SlabHeader* next = slab->slabs->next;
+        free(slab->slabs);
+        slab->slabs = next;
+    }
+    memset(slab, 0, sizeof(*slab));
+}
+
+uint32_t hash_string(const char* text) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (; *text; text++) {
+        h ^= (unsigned char)*text;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+uint32_t intern_description(const char* text) {
+    // Longer text is cut to DESCRIPTION_MAX - 1 bytes, as the old fixed field did
+    char clipped[DESCRIPTION_MAX];
+    size_t len = strlen(text);
+    if (len >= DESCRIPTION_MAX) {
+        len = DESCRIPTION_MAX - 1;
+        memcpy(clipped, text, len);
+        clipped[len] = '\0';
+        text = clipped;
+    }
+    uint32_t h = hash_string(text);
+    
+    pthread_mutex_lock(&descriptions.lock);
+    
+    // Keep the probe table at most half full
+    if ((descriptions.entries + 1) * 2 > descriptions.slot_count) {
+        size_t slot_count = descriptions.slot_count ? descriptions.slot_count * 2 : 64;
+        uint32_t* slots = (uint32_t*)calloc(slot_count, sizeof(uint32_t));
+        if (slots == NULL) {
+            ledger_fatal("out of memory for descriptions");
+        }
+        for (size_t i = 0; i < descriptions.slot_count; i++) {
+            uint32_t entry = descriptions.slots[i];
+            if (entry == 0) continue;
+            
+            size_t j = hash_string(description_at(entry - 1)) & (slot_count - 1);
+            while (slots[j] != 0) j = (j + 1) & (slot_count - 1);
+            slots[j] = entry;
+        }
+        free(descriptions.slots);
+        descriptions.slots = slots;
+        descriptions.slot_count = slot_count;
+    }
+    
+    size_t j = h & (descriptions.slot_count - 1);
+    while (descriptions.slots[j] != 0) {
+        uint32_t id = descriptions.slots[j] - 1;
+        if (strcmp(description_at(id), text) == 0) {
+            pthread_mutex_unlock(&descriptions.lock);
+            return id;
+        }
+        j = (j + 1) & (descriptions.slot_count - 1);
+    }
+    
+    // New text: append it to the newest block, opening another when it does not fit
+    size_t block_size = (size_t)1 << STRING_HEAP_BLOCK_SHIFT;
+    if (descriptions.block_count == 0 || descriptions.block_used + len + 1 > block_size) {
+        if (descriptions.block_count == STRING_HEAP_MAX_BLOCKS) {
+            ledger_fatal("description heap is full");
+        }
+        char* block = (char*)malloc(block_size);
+        if (block == NULL) {
+            ledger_fatal("out of memory for descriptions");
+        }
+        descriptions.blocks[descriptions.block_count++] = block;
+        descriptions.block_used = 0;
+    }
+    uint32_t id = ((uint32_t)(descriptions.block_count - 1) << STRING_HEAP_BLOCK_SHIFT) | (uint32_t)descriptions.block_used;
+    memcpy(descriptions.blocks[descriptions.block_count - 1] + descriptions.block_used, text, len + 1);
+    descriptions.block_used += len + 1;
+    descriptions.slots[j] = id + 1;
+    descriptions.entries++;
+    index_description(id, text);
+    
+    pthread_mutex_unlock(&descriptions.lock);
+    return id;
+}
+
+int description_words(const char* text, uint64_t* words, int max) {
+    // Runs of letters and digits, lower-cased and hashed; "Kamogo_David" is two words.
+    // Each word is listed once.
+    int count = 0;
+    while (*text != '\0' && count < max) {
+        while (*text != '\0' && !isalnum((unsigned char)*text)) text++;
+        if (*text == '\0') break;
+        
+        uint64_t h = 14695981039346656037ULL; // FNV-1a, 64-bit
+        for (; isalnum((unsigned char)*text); text++) {
+            h ^= (unsigned char)tolower((unsigned char)*text);
+            h *= 1099511628211ULL;
+        }
+        if (h == 0) h = 1;
+        
+        bool seen = false;
+        for (int i = 0; i < count && !seen; i++) {
+            seen = words[i] == h;
+        }
+        if (!seen) words[count++] = h;
+    }
+    return count;
+}
+
+WordPostings* find_word(uint64_t word) {
+    // Caller holds descriptions.lock
+    if (descriptions.word_slots == 0) return NULL;
+    size_t mask = descriptions.word_slots - 1;
+    for (size_t i = (size_t)(word ^ word >> 32) & mask; descriptions.words[i].word != 0; i = (i + 1) & mask) {
+        if (descriptions.words[i].word == word) return &descriptions.words[i];
+    }
+    return NULL;
+}
+
+void index_description(uint32_t id, const char* text) {
+    // Caller holds descriptions.lock; runs once per distinct description, not per transaction
+    uint64_t words[DESCRIPTION_MAX / 2];
+    int count = description_words(text, words, DESCRIPTION_MAX / 2);
+    
+    for (int w = 0; w < count; w++) {
+        if ((descriptions.word_count + 1) * 2 > descriptions.word_slots) {
+            size_t slot_count = descriptions.word_slots ? descriptions.word_slots * 2 : WORD_INDEX_INITIAL_SLOTS;
+            WordPostings* slots = (WordPostings*)calloc(slot_count, sizeof(WordPostings));
+            if (slots == NULL) {
+                ledger_fatal("out of memory for the description index");
+            }
+            for (size_t i = 0; i < descriptions.word_slots; i++) {
+                WordPostings* p = &descriptions.words[i];
+                if (p->word == 0) continue;
+                size_t j = (size_t)(p->word ^ p->word >> 32) & (slot_count - 1);
+                while (slots[j].word != 0) j = (j + 1) & (slot_count - 1);
+                slots[j] = *p;
+            }
+            free(descriptions.words);
+            descriptions.words = slots;
+            descriptions.word_slots = slot_count;
+        }
+        
+        size_t mask = descriptions.word_slots - 1;
+        size_t j = (size_t)(words[w] ^ words[w] >> 32) & mask;
+        while (descriptions.words[j].word != 0 && descriptions.words[j].word != words[w]) j = (j + 1) & mask;
+        WordPostings* p = &descriptions.words[j];
+        if (p->word == 0) {
+            p->word = words[w];
+            descriptions.word_count++;
+        }
+        if (p->count == p->capacity) {
+            int capacity = p->capacity ? p->capacity * 2 : 4;
+            uint32_t* ids = (uint32_t*)realloc(p->ids, (size_t)capacity * sizeof(uint32_t));
+            if (ids == NULL) {
+                ledger_fatal("out of memory for the description index");
+            }
+            p->ids = ids;
+            p->capacity = capacity;
+        }
+        p->ids[p->count++] = id;
+    }
+}
+
+int compare_ids(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+void reindex_descriptions() {
+    // A snapshot restores the heap but not the word index. Ids go in ascending
+    // order so every postings list comes out sorted.
+    uint32_t* ids = (uint32_t*)malloc((descriptions.entries + 1) * sizeof(uint32_t));
+    if (ids == NULL) {
+        ledger_fatal("out of memory for the description index");
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < descriptions.slot_count; i++) {
+        if (descriptions.slots[i] != 0) ids[count++] = descriptions.slots[i] - 1;
+    }
+    qsort(ids, count, sizeof(uint32_t), compare_ids);
+    for (size_t i = 0; i < count; i++) {
+        index_description(ids[i], description_at(ids[i]));
+    }
+    free(ids);
+}
+
+bool postings_contain(const WordPostings* p, uint32_t id) {
+    int lo = 0, hi = p->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (p->ids[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < p->count && p->ids[lo] == id;
+}
+
+int ledger_search(int farmer_id, const char* query, Transaction* out, int max) {
+    // Transactions of one account whose description holds every word of the query,
+    // newest first. Returns how many match; at most max are copied to out.
+    int index = find_farmer_index(farmer_id);
+    if (index == -1) return 0;
+    uint64_t words[SEARCH_MAX_WORDS];
+    int word_count = description_words(query, words, SEARCH_MAX_WORDS);
+    if (word_count == 0) return 0;
+    
+    // Descriptions holding every word: walk the shortest postings list, look the rest up
+    pthread_mutex_lock(&descriptions.lock);
+    const WordPostings* lists[SEARCH_MAX_WORDS];
+    int shortest = 0;
+    for (int w = 0; w < word_count; w++) {
+        lists[w] = find_word(words[w]);
+        if (lists[w] == NULL) {
+            pthread_mutex_unlock(&descriptions.lock);
+            return 0;
+        }
+        if (lists[w]->count < lists[shortest]->count) shortest = w;
+    }
+    uint32_t* ids = (uint32_t*)malloc((size_t)lists[shortest]->count * sizeof(uint32_t));
+    if (ids == NULL) {
+        ledger_fatal("out of memory for search");
+    }
+    int id_count = 0;
+    for (int i = 0; i < lists[shortest]->count; i++) {
+        uint32_t id = lists[shortest]->ids[i];
+        bool all = true;
+        for (int w = 0; w < word_count && all; w++) {
+            if (w != shortest) all = postings_contain(lists[w], id);
+        }
+        if (all) ids[id_count++] = id;
+    }
+    pthread_mutex_unlock(&descriptions.lock);
+    if (id_count == 0) {
+        free(ids);
+        return 0;
+    }
+    
+    // Hash set of those ids (id + 1, 0 when empty), then one pass over the account's history
+    size_t slot_count = 16;
+    while (slot_count < (size_t)id_count * 2) slot_count *= 2;
+    uint32_t* set = (uint32_t*)calloc(slot_count, sizeof(uint32_t));
+    if (set == NULL) {
+        ledger_fatal("out of memory for search");
+    }
+    for (int i = 0; i < id_count; i++) {
+        size_t j = (ids[i] * 2654435761u) & (slot_count - 1);
+        while (set[j] != 0) j = (j + 1) & (slot_count - 1);
+        set[j] = ids[i] + 1;
+    }
+    free(ids);
+    
+    Farmer* f = farmer_at(index);
+    Ledger* l = farmer_ledger(f);
+    int total = 0;
+    pthread_rwlock_rdlock(&l->lock);
+    for (int i = f->transaction_count - 1; i >= 0; i--) {
+        int row = f->history[i];
+        uint32_t id = l->description[row];
+        size_t j = (id * 2654435761u) & (slot_count - 1);
+        while (set[j] != 0 && set[j] != id + 1) j = (j + 1) & (slot_count - 1);
+        if (set[j] == 0) continue;
+        if (total < max) out[total] = ledger_transaction(l, row);
+        total++;
+    }
+    pthread_rwlock_unlock(&l->lock);
+    free(set);
+    return total;
+}
+
+const char* description_at(uint32_t id) {
+    return descriptions.blocks[id >> STRING_HEAP_BLOCK_SHIFT] + (id & (((uint32_t)1 << STRING_HEAP_BLOCK_SHIFT) - 1));
+}
+
+void free_descriptions() {
+    for (int b = 0; b < descriptions.block_count; b++) {
+        free(descriptions.blocks[b]);
+        descriptions.blocks[b] = NULL;
+    }
+    free(descriptions.slots);
+    descriptions.slots = NULL;
+    descriptions.slot_count = 0;
+    descriptions.entries = 0;
+    for (size_t i = 0; i < descriptions.word_slots; i++) {
+        free(descriptions.words[i].ids);
+    }
+    free(descriptions.words);
+    descriptions.words = NULL;
+    descriptions.word_slots = 0;
+    descriptions.word_count = 0;
+    descriptions.block_count = 0;
+    descriptions.block_used = 0;
+}
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int histogram_bucket(uint64_t value) {
+    // Exact below 32; above that, the top HISTOGRAM_SUB_BITS bits pick the bucket
+    if (value < (1u << HISTOGRAM_SUB_BITS)) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int)((value >> shift) - (1u << HISTOGRAM_SUB_BITS));
+}
+
+void histogram_record(LatencyHistogram* h, uint64_t ns) {
+    int bucket = histogram_bucket(ns);
+    h->counts[bucket]++;
+    h->total++;
+    if (ns > h->max) h->max = ns;
+}
+
+void histogram_merge(LatencyHistogram* into, const LatencyHistogram* from) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->max > into->max) into->max = from->max;
+}
+
+uint64_t histogram_percentile(const LatencyHistogram* h, double percentile) {
+    // Upper edge of the bucket holding the requested rank, so results never flatter
+    if (h->total == 0) return 0;
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)h->total);
+    if (rank >= h->total) rank = h->total - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank) {
+            if (i < (1 << HISTOGRAM_SUB_BITS)) return (uint64_t)i;
+            int shift = (i >> HISTOGRAM_SUB_BITS) - 1;
+            uint64_t mantissa = (uint64_t)((1 << HISTOGRAM_SUB_BITS) + (i & ((1 << HISTOGRAM_SUB_BITS) - 1)));
+            uint64_t edge = ((mantissa + 1) << shift) - 1;
+            return edge < h->max ? edge : h->max;
+        }
+    }
+    return h->max;
+}
+
+uint64_t metrics_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_make_key() {
+    if (pthread_key_create(&metrics_key, metrics_retire) != 0) {
+        ledger_fatal("cannot create metrics key");
+    }
+}
+
+MetricsThread* metrics_register() {
+    // Short-lived threads (bench clients, accrual cores) reuse blocks instead of adding ~160 KB each
+    pthread_once(&metrics_key_once, metrics_make_key);
+    pthread_mutex_lock(&metrics_lock);
+    MetricsThread* m = metrics_free;
+    if (m != NULL) {
+        metrics_free = m->next;
+    } else {
+        m = (MetricsThread*)calloc(1, sizeof(MetricsThread));
+        if (m == NULL) {
+            ledger_fatal("out of memory for metrics");
+        }
+    }
+    m->next = metrics_threads;
+    metrics_threads = m;
+    pthread_mutex_unlock(&metrics_lock);
+    pthread_setspecific(metrics_key, m);
+    metrics_self = m;
+    return m;
+}
+
+void metrics_retire(void* block) {
+    // Thread exit: fold its counts into metrics_retired, then zero the block for the next thread
+    MetricsThread* m = (MetricsThread*)block;
+    pthread_mutex_lock(&metrics_lock);
+    MetricsThread** link = &metrics_threads;
+    while (*link != m) link = &(*link)->next;
+    *link = m->next;
+    
+    for (int id = 0; id < METRIC_COUNT; id++) {
+        uint64_t total = atomic_load_explicit(&m->total[id], memory_order_relaxed);
+        if (total == 0) continue;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            uint64_t count = atomic_load_explicit(&m->counts[id][b], memory_order_relaxed);
+            if (count != 0) atomic_fetch_add_explicit(&metrics_retired.counts[id][b], count, memory_order_relaxed);
+        }
+        atomic_fetch_add_explicit(&metrics_retired.total[id], total, memory_order_relaxed);
+        atomic_fetch_add_explicit(&metrics_retired.failed[id], atomic_load_explicit(&m->failed[id], memory_order_relaxed),
+                                  memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&m->max[id], memory_order_relaxed);
+        if (max > atomic_load_explicit(&metrics_retired.max[id], memory_order_relaxed)) {
+            atomic_store_explicit(&metrics_retired.max[id], max, memory_order_relaxed);
+        }
+    }
+    memset(m, 0, sizeof(*m));
+    m->next = metrics_free;
+    metrics_free = m;
+    pthread_mutex_unlock(&metrics_lock);
+    metrics_self = NULL;
+}
+
+void metrics_bump(_Atomic uint64_t* counter) {
+    // Single writer, so a plain load and store is enough; no locked instruction
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+void metrics_record(MetricId id, uint64_t value, bool ok) {
+    if (metrics_paused) return;
+    MetricsThread* m = metrics_self != NULL ? metrics_self : metrics_register();
+    metrics_bump(&m->counts[id][histogram_bucket(value)]);
+    metrics_bump(&m->total[id]);
+    if (!ok) metrics_bump(&m->failed[id]);
+    if (value > atomic_load_explicit(&m->max[id], memory_order_relaxed)) {
+        atomic_store_explicit(&m->max[id], value, memory_order_relaxed);
+    }
+}
+
+void metrics_report(MetricsReport* out) {
+    // Histograms are merged from every thread's block; a reader never stalls a writer
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&metrics_lock);
+    metrics_merge(out, &metrics_retired);
+    for (MetricsThread* m = metrics_threads; m != NULL; m = m->next) {
+        metrics_merge(out, m);
+        out->threads++;
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    
+    // Gauges are read as they stand right now, and only while the engine is up: before
+    // startup and after shutdown the shards and indexes may not exist
+    pthread_mutex_lock(&metrics_engine_lock);
+    out->engine_up = metrics_engine_up;
+    for (int i = 0; i < SHARD_COUNT && out->engine_up; i++) {
+        Shard* s = &shards[i];
+        pthread_mutex_lock(&s->queue.lock);
+        out->queue_depth[i] = s->queue.size;
+        out->handoff_depth[i] = s->queue.handoff_count;
+        pthread_mutex_unlock(&s->queue.lock);
+        pthread_mutex_lock(&s->journal.lock);
+        out->journal_pending[i] = s->journal.pending_count;
+        pthread_mutex_unlock(&s->journal.lock);
+        pthread_rwlock_rdlock(&s->ledger.lock);
+        out->ledger_rows[i] = s->ledger.count;
+        pthread_rwlock_unlock(&s->ledger.lock);
+    }
+    if (out->engine_up) {
+        pthread_mutex_lock(&registry_lock);
+        hash_gauge_farmers(&out->farmer_index);
+        hash_gauge_usernames(&out->username_index);
+        pthread_mutex_unlock(&registry_lock);
+    }
+    pthread_mutex_unlock(&metrics_engine_lock);
+}
+
+void metrics_merge(MetricsReport* out, MetricsThread* m) {
+    // Caller holds metrics_lock
+    for (int id = 0; id < METRIC_COUNT; id++) {
+        LatencyHistogram* h = &out->operations[id];
+        if (atomic_load_explicit(&m->total[id], memory_order_relaxed) == 0) continue;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            uint64_t count = atomic_load_explicit(&m->counts[id][b], memory_order_relaxed);
+            h->counts[b] += count;
+            h->total += count;
+        }
+        uint64_t max = atomic_load_explicit(&m->max[id], memory_order_relaxed);
+        if (max > h->max) h->max = max;
+        out->failed[id] += atomic_load_explicit(&m->failed[id], memory_order_relaxed);
+    }
+}
+
+void hash_gauge_farmers(HashGauge* g) {
+    // Caller holds registry_lock. A present key's probe chain runs from its home slot to where it sits.
+    FarmerHashTable* table = atomic_load_explicit(&farmer_hash_table, memory_order_acquire);
+    uint64_t probes = 0;
+    memset(g, 0, sizeof(*g));
+    g->slots = table->mask + 1;
+    g->live = table->live;
+    g->deleted = table->used - table->live;
+    for (uint32_t i = 0; i <= table->mask; i++) {
+        int32_t farmer_id = atomic_load_explicit(&table->slots[i].farmer_id, memory_order_relaxed);
+        if (farmer_id <= 0) continue;
+        uint32_t chain = ((i - hash_function(table, farmer_id)) & table->mask) + 1;
+        probes += chain;
+        if (chain > g->max_probes) g->max_probes = chain;
+    }
+    g->mean_probes = g->live > 0 ? (double)probes / g->live : 0.0;
+}
+
+void hash_gauge_usernames(HashGauge* g) {
+    // Caller holds registry_lock
+    UsernameHashTable* table = atomic_load_explicit(&username_table, memory_order_acquire);
+    uint64_t probes = 0;
+    memset(g, 0, sizeof(*g));
+    g->slots = table->mask + 1;
+    g->live = table->live;
+    g->deleted = table->used - table->live;
+    for (uint32_t i = 0; i <= table->mask; i++) {
+        if (atomic_load_explicit(&table->slots[i].index, memory_order_relaxed) < 0) continue;
+        uint32_t home = atomic_load_explicit(&table->slots[i].hash, memory_order_relaxed) & table->mask;
+        uint32_t chain = ((i - home) & table->mask) + 1;
+        probes += chain;
+        if (chain > g->max_probes) g->max_probes = chain;
+    }
+    g->mean_probes = g->live > 0 ? (double)probes / g->live : 0.0;
+}
+
+const char* ledger_status_message(LedgerStatus status) {
+    switch (status) {
+        case LEDGER_OK:                 return "ok";
+        case LEDGER_NOT_FOUND:          return "account not found";
+        case LEDGER_INVALID_AMOUNT:     return "amount must be positive, in whole cents";
+        case LEDGER_INSUFFICIENT_FUNDS: return "insufficient funds";
+        case LEDGER_SAME_ACCOUNT:       return "cannot transfer to the same account";
+        case LEDGER_LIMIT_EXCEEDED:     return "balance would exceed the account limit";
+        case LEDGER_NO_MEMORY:          return "out of memory";
+        case LEDGER_IO_ERROR:           return "cannot read or write the ledger files";
+        case LEDGER_CORRUPT:            return "the ledger files are damaged";
+        case LEDGER_JOURNAL_DAMAGED:    return "a journal record is damaged";
+    }
+    return "unknown error";
+}
+
+const char* ledger_error() {
+    return ledger_error_text;
+}
+
+void ledger_on_notice(void (*handler)(const char* message)) {
+    notice_handler = handler;
+}
+
+void ledger_on_fatal(void (*handler)(const char* message)) {
+    fatal_handler = handler;
+}
+
+bool ledger_fail(const char* format, ...) {
+    // Records why a call failed for ledger_error(); returns false so callers can return it
+    va_list args;
+    va_start(args, format);
+    vsnprintf(ledger_error_text, sizeof(ledger_error_text), format, args);
+    va_end(args);
+    return false;
+}
+
+void ledger_notice(const char* format, ...) {
+    if (notice_handler == NULL) return;
+    char message[LEDGER_ERROR_SIZE];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    notice_handler(message);
+}
+
+void ledger_fatal(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(ledger_error_text, sizeof(ledger_error_text), format, args);
+    va_end(args);
+    if (fatal_handler != NULL) fatal_handler(ledger_error_text);
+    abort();
+}
@@ -0,0 +1,605 @@
+#ifndef SACCO_LEDGER_H
+#define SACCO_LEDGER_H
+
+// Core SACCO ledger: accounts, money movement, journal and settlement.
+// Nothing here reads the keyboard, prints or exits; final_project.c is the
+// terminal front end, and batch, server and benchmark modes use the same calls.
+// Calls that can fail return a status, with the reason in ledger_error().
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+
+// Constants
+#define FARMER_BLOCK_SIZE 4096        // Accounts per registry block
+#define MAX_FARMER_BLOCKS 4096        // Block directory size (16M accounts)
+#define MAX_TRANSACTIONS 1000
+#define RECENT_FEED_CAPACITY 1024     // Newest transactions kept SACCO-wide; a power of two
+#define PASSWORD_LENGTH 4
+#define MONEY_SCALE 100               // Minor units (cents) per currency unit
+#define MONEY_MAX 1000000000000000LL  // Largest amount or balance in cents (10 trillion)
+#define MONEY_TEXT_SIZE 32            // Buffer for one formatted amount
+#define HASH_INITIAL_SLOTS 64         // Farmer index slots; always a power of two
+#define HASH_MAX_LOAD_PERCENT 70      // Grow once live + deleted slots pass this load
+#define HASH_EMPTY 0                  // Farmer IDs start at 1, so 0 marks a free slot
+#define HASH_DELETED -1               // Left behind by a closed account
+#define USERNAME_EMPTY -1             // Username index slot that was never used
+#define USERNAME_DELETED -2           // Username index slot of a closed account
+#define ACCOUNT_LOCK_STRIPES 1024     // Account mutexes; account i uses stripe i % this
+#define SHARD_BITS 2                  // At least 1
+#define SHARD_COUNT (1 << SHARD_BITS) // Partitions of the accounts, each settled by its own worker
+#define JOURNAL_FILE "sacco.journal"
+#define JOURNAL_MAGIC 0x32434153u     // "SAC2" marks a complete journal record, amount in cents
+#define JOURNAL_MAGIC_V1 0x4A434153u  // "SACJ": older record whose amount is a double; read only
+#define JOURNAL_GROUP_COMMIT 256      // Records per settlement batch, written with one fsync
+#define BULK_MAX_LEGS 1000000         // Payments in one bulk transfer; ledger rows in one ledger_apply_batch()
+#define ACCRUAL_RATE_SCALE 1000000000LL // Accrual rates are in billionths of the balance per year
+#define ACCRUAL_PERIODS_PER_YEAR 12   // Each close credits this fraction of the annual rate
+#define ACCRUAL_MAX_THREADS 64        // Most cores one accrual is split across
+#define JOURNAL_REPLAY_BATCH 8192     // Records read per block during startup replay
+#define LEDGER_FILE "sacco.ledger"
+#define SNAPSHOT_FILE "sacco.snapshot"
+#define SNAPSHOT_MAGIC 0x33504E53u     // "SNP3" starts a snapshot file
+#define SNAPSHOT_INTERVAL 30          // Seconds between the checkpoint thread's looks at the journal
+#define SNAPSHOT_MIN_RECORDS 100000   // New journal records that make another snapshot worthwhile
+#define SNAPSHOT_BUFFER (1 << 20)     // Write buffer; a multiple of 8 so the checksum ignores where flushes fall
+#define LEDGER_INITIAL_CAPACITY 4096  // Rows; doubles whenever the ledger fills up
+#define HISTORY_INITIAL_CAPACITY 8    // Row numbers per farmer before the first grow
+#define HISTORY_CHUNK_ROWS 64         // History entries summarised by one time span
+#define SLAB_SIZE (1 << 20)           // Bytes carved out of malloc at a time by a slab allocator
+#define SLAB_MIN_SHIFT 4              // Smallest slab size class: 16 bytes
+#define SLAB_CLASSES 40               // Power-of-two size classes from 16 bytes up
+#define STRING_HEAP_BLOCK_SHIFT 18    // Interned text is stored in 256 KB blocks that never move
+#define STRING_HEAP_MAX_BLOCKS 16384  // 4 GB of distinct description text
+#define DESCRIPTION_MAX 100           // Longest description kept, terminator included
+#define WORD_INDEX_INITIAL_SLOTS 1024 // Description word index slots; always a power of two
+#define SEARCH_MAX_WORDS 8            // Words of a search query that count; the rest are ignored
+#define STATEMENT_PAGE_MAX 4096       // Most rows one statement page holds
+#define STATEMENT_TOKEN_SIZE 48       // Buffer for a statement resume token
+#define EXPORT_BUFFER (1 << 20)       // Statement export bytes gathered per write
+#define HISTOGRAM_SUB_BITS 5           // Latency histogram: 32 buckets per power of two (~3% error)
+#define HISTOGRAM_BUCKETS 2048         // Covers every 64-bit nanosecond value
+#define METRICS_FILE "sacco.metrics"   // Written on SIGUSR1 (text) or SIGUSR2 (JSON)
+#define LEDGER_ERROR_SIZE 256          // Longest message ledger_error() returns
+
+// Money in minor units (cents); every amount and balance uses it
+typedef int64_t money_t;
+
+// Transaction structure: 32 bytes, cheap to copy through the queue and the feed
+typedef struct {
+    money_t amount;
+    time_t timestamp;
+    int32_t farmer_id;
+    uint32_t description;   // Interned text; resolve with description_at()
+    char type;              // 'D' for deposit, 'W' for withdrawal
+} Transaction;
+
+// One slot of the recent-transactions feed. seq is odd while the writer is
+// filling the slot and 2 * (position + 1) once the transaction is complete.
+typedef struct {
+    _Atomic uint64_t seq;
+    Transaction data;
+} FeedSlot;
+
+// Fixed-size ring of the newest transactions: one writer, any number of readers
+typedef struct {
+    _Atomic uint64_t head;  // Transactions ever published
+    FeedSlot slots[RECENT_FEED_CAPACITY];
+} RecentFeed;
+
+// Rows of one bulk transfer; settled, journaled and recovered as a single unit.
+// A cross-shard transfer is a bulk transfer with one leg.
+typedef struct {
+    int count;              // The sender's debit first, then one credit per leg; an accrual has only credits
+    Transaction* rows;
+    int* indices;           // Registry index of each row's farmer
+    money_t* held;          // Per row, credit held in the account's incoming until the batch is durable;
+                            // NULL means each remote 'D' row's amount
+    int shard;              // Credits handed over by this shard, or -1 for a teller's transfer
+    int32_t period;         // Accrual period closed by this batch's 'P' record, or 0
+} BulkBatch;
+
+// Transaction waiting for the settlement worker
+typedef struct {
+    Transaction t;
+    int index;              // Registry index of t.farmer_id
+    BulkBatch* bulk;        // Set instead of t for a bulk transfer; freed once settled
+} QueuedTransaction;
+
+// One payment of a bulk transfer
+typedef struct {
+    int32_t to_id;
+    money_t amount;
+} TransferLeg;
+
+// One entry of ledger_apply_batch()
+typedef struct {
+    int32_t farmer_id;
+    int32_t to_id;          // Recipient for 'T', otherwise 0
+    money_t amount;
+    char type;              // 'D' credit, 'W' debit, 'T' transfer
+    const char* description; // The note for 'T'
+} BatchEntry;
+
+// Queue for processing transactions: tellers enqueue, the shard's settlement worker drains
+typedef struct {
+    QueuedTransaction items[MAX_TRANSACTIONS];
+    int front;
+    int rear;
+    int size;
+    uint64_t enqueued;      // Tickets issued so far
+    uint64_t settled;       // Every ticket up to this one is applied and durable
+    BulkBatch** handoffs;   // Credits other shards have made durable; unbounded so workers never wait on each other
+    int handoff_count;
+    int handoff_capacity;
+    uint64_t handoffs_added;
+    uint64_t handoffs_settled;
+    bool running;
+    int notify_fd;          // eventfd poked after every settled batch, or -1
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t settled_changed;
+} TransactionQueue;
+
+// Outcome of ledger_accrue(); one credit per account that earned at least a cent
+typedef struct {
+    long long accounts;     // Accounts credited
+    money_t total;
+    long long shard_accounts[SHARD_COUNT];
+    bool already_closed[SHARD_COUNT]; // Shard journaled this period's close in an earlier run; skipped
+} AccrualSummary;
+
+// One core's share of an accrual: registry indices [first, last), whole registry blocks
+typedef struct {
+    pthread_t thread;
+    int first;
+    int last;
+    int64_t rate;           // Per year, in ACCRUAL_RATE_SCALE units
+    const money_t* balance; // By registry index, as the close found them; 0 where nothing is earned
+    money_t* accrued;       // By registry index; 0 where nothing is paid
+    const uint8_t* shard;   // By registry index
+    long long rows[SHARD_COUNT];   // Credits this worker found per shard
+    long long offset[SHARD_COUNT]; // Where they go in each shard's batch
+    long long posted[SHARD_COUNT]; // Credits it actually posted; fewer if accounts changed meanwhile
+    BulkBatch** batches;
+    money_t total;          // Credited by this worker
+    time_t timestamp;
+    uint32_t description;
+} AccrualWorker;
+
+// Result of a core account operation
+typedef enum {
+    LEDGER_OK = 0,
+    LEDGER_NOT_FOUND,
+    LEDGER_INVALID_AMOUNT,
+    LEDGER_INSUFFICIENT_FUNDS,
+    LEDGER_SAME_ACCOUNT,
+    LEDGER_LIMIT_EXCEEDED,
+    LEDGER_NO_MEMORY,
+    LEDGER_IO_ERROR,        // A journal, ledger or snapshot file could not be used
+    LEDGER_CORRUPT,         // The files on disk do not describe a valid ledger
+    LEDGER_JOURNAL_DAMAGED  // A damaged record has committed records after it; the journal is left as it was
+} LedgerStatus;
+
+// Hash table slot for farmer lookup (open addressing, linear probing).
+// Writers store index before farmer_id, so a reader that sees the ID sees its index.
+typedef struct {
+    _Atomic int32_t farmer_id;
+    _Atomic int32_t index;
+} HashSlot;
+
+// Farmer ID -> registry index; lookups never lock, a resize publishes a new table
+typedef struct FarmerHashTable {
+    struct FarmerHashTable* retired; // Table this one replaced; readers may still hold it
+    uint32_t mask;          // slot count - 1
+    int shift;              // 32 - log2(slot count)
+    uint32_t used;          // Live plus deleted slots
+    uint32_t live;
+    HashSlot slots[];
+} FarmerHashTable;
+
+// Username index slot; the full hash is kept so most mismatches skip the strcmp
+typedef struct {
+    _Atomic uint32_t hash;
+    _Atomic int32_t index;  // Registry index, or USERNAME_EMPTY / USERNAME_DELETED
+} UsernameSlot;
+
+// Username -> registry index, used by login and registration
+typedef struct UsernameHashTable {
+    struct UsernameHashTable* retired;
+    uint32_t mask;
+    uint32_t used;          // Live plus deleted slots
+    uint32_t live;
+    UsernameSlot slots[];
+} UsernameHashTable;
+
+// Time bounds for HISTORY_CHUNK_ROWS consecutive history entries. A clock that stepped
+// back can leave the history out of time order, so each bound also covers the entries
+// beyond the chunk on its side; that keeps both sorted along the history for searching.
+typedef struct {
+    int64_t min_time;       // Earliest timestamp in this chunk or any later one
+    int64_t max_time;       // Latest timestamp in this chunk or any earlier one
+} HistoryChunk;
+
+// Header in front of every slab, linking them for bulk release
+typedef struct SlabHeader {
+    struct SlabHeader* next;
+    size_t size;
+} SlabHeader;
+
+// Power-of-two size-class allocator for small, short-lived-or-forever buffers.
+// Freed objects are reused by their class; everything is released in one pass.
+typedef struct {
+    void* free_lists[SLAB_CLASSES];
+    char* cursor;           // Uncarved space in the current slab
+    size_t remaining;
+    SlabHeader* slabs;
+    size_t reserved;        // Bytes obtained from malloc
+} SlabAllocator;
+
+// Farmer account structure
+typedef struct {
+    int farmer_id;
+    char username[50];
+    int password;
+    _Atomic money_t balance; // Read without locks; changed under the account's stripe lock
+    _Atomic money_t incoming; // Cross-shard credits not yet durable: they count against MONEY_MAX but cannot be spent
+    int* history;           // Ledger row numbers in settlement order, which is time order unless the clock stepped back
+    HistoryChunk* chunks;   // One span per HISTORY_CHUNK_ROWS history entries
+    int history_capacity;
+    _Atomic int transaction_count;
+    _Atomic bool active;    // False once the account has been closed
+} Farmer;
+
+// On-disk journal record (fixed size, appended once per transaction)
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum;      // Covers the whole record with this field zeroed
+    int32_t farmer_id;
+    char type;
+    char handoff;           // 1 + the shard that prepared this credit, or 0
+    char reserved[2];       // reserved[0]: the row's own type in an 'H' record, 0 meaning 'D'
+    int64_t timestamp;
+    int64_t amount;         // Cents (a double in JOURNAL_MAGIC_V1 records); PIN for 'O'; period for 'P'
+    char description[104];  // Username for 'O' (account opened) records
+} JournalRecord;
+
+// Append-only write-ahead journal with group commit
+typedef struct {
+    int fd;
+    JournalRecord pending[JOURNAL_GROUP_COMMIT]; // Appended but not yet written
+    int pending_count;
+    long long record_count;                      // Records in the file, pending included
+    bool unsynced;                               // Written since the last fsync
+    uint32_t last_checksum;                      // Of the newest record, so a snapshot can name its place
+    pthread_mutex_t lock;                        // Settlement worker and account changes both append
+} Journal;
+
+// Memory-mapped columnar store: one row per transaction, one array per field
+typedef struct {
+    int fd;
+    char* map;
+    size_t map_size;
+    long long capacity;
+    long long count;
+    money_t* amount;
+    int64_t* timestamp;
+    int32_t* farmer_id;
+    uint32_t* description;  // Offset into the description heap
+    char* type;
+    uint64_t hash;          // Running hash of every row, recorded by snapshots
+    pthread_rwlock_t lock;  // Settlement worker appends rows; statement screens read them
+} Ledger;
+
+// Descriptions that contain one word. Ids are handed out in increasing order,
+// so appending keeps the list sorted.
+typedef struct {
+    uint64_t word;          // 64-bit hash of the lower-cased word; 0 marks a free slot
+    uint32_t* ids;
+    int count;
+    int capacity;
+} WordPostings;
+
+// Interned description text; identical descriptions are stored once.
+// An id is block << STRING_HEAP_BLOCK_SHIFT | offset, and blocks never move,
+// so description_at() needs no lock.
+typedef struct {
+    char* blocks[STRING_HEAP_MAX_BLOCKS];
+    int block_count;
+    size_t block_used;      // Bytes used in the newest block
+    uint32_t* slots;        // Open addressing: id + 1, or 0 when empty
+    size_t slot_count;
+    size_t entries;
+    WordPostings* words;    // Inverted index, word -> descriptions; open addressing, at most half full
+    size_t word_slots;
+    size_t word_count;
+    pthread_mutex_t lock;   // Tellers intern while queueing transactions
+} StringHeap;
+
+// One page of an account's history. Positions count from the account's oldest
+// transaction, so a page keeps its rows while newer transactions arrive.
+typedef struct {
+    int32_t farmer_id;
+    int32_t first;          // The page is history positions [first, end)
+    int32_t end;
+    int32_t page_size;
+} StatementCursor;
+
+// Buffered output for statement exports; the current local day is formatted once
+typedef struct {
+    int fd;
+    char* buffer;
+    size_t used;
+    bool ok;                // Cleared by the first failed write
+    int64_t day_start;      // Local midnight of the cached day
+    int64_t day_end;        // The next local midnight
+    bool day_exact;         // False on a day with a clock change
+    char day_text[11];      // "YYYY-MM-DD"
+} ExportWriter;
+
+// Running totals for the statistics screen, always read as one consistent snapshot
+typedef struct {
+    long long accounts;         // Open accounts
+    long long transactions;     // Settled ledger rows
+    long long deposits;
+    long long withdrawals;
+    money_t deposit_total;
+    money_t withdrawal_total;
+    money_t total_balance;      // deposit_total - withdrawal_total
+} SystemStats;
+
+// Seqlock around SystemStats: writers take write_lock, readers never block
+typedef struct {
+    _Atomic uint64_t seq;       // Odd while an update is in progress
+    SystemStats current;
+    pthread_mutex_t write_lock;
+} StatsBoard;
+
+// One partition of the accounts: farmer_id belongs to shard_of(farmer_id), whose
+// worker alone journals, stores and publishes that account's transactions
+typedef struct {
+    int id;
+    TransactionQueue queue;
+    Journal journal;
+    Ledger ledger;          // Rows of this shard's accounts; their histories index it
+    RecentFeed recent;
+    SlabAllocator history_slab; // History and chunk arrays of this shard's accounts
+    int32_t closed_period;  // Newest accrual period journaled as closed, YYYYMM, or 0
+} Shard;
+
+// Cross-shard credits seen while replaying, so ones prepared but never committed can be finished
+typedef struct {
+    long long prepared[SHARD_COUNT][SHARD_COUNT];  // 'H' records shard s wrote for shard d
+    long long committed[SHARD_COUNT][SHARD_COUNT]; // Credits shard d journaled for shard s
+    long long* positions[SHARD_COUNT];             // Record number of each 'H' replayed per shard
+    long long position_count[SHARD_COUNT];
+    long long position_capacity[SHARD_COUNT];
+} HandoffRecovery;
+
+// Start of a snapshot file. The accounts, the description heap and a
+// checksum of everything before it follow.
+typedef struct {
+    uint32_t magic;
+    uint32_t account_size;      // sizeof(SnapshotAccount), so an old layout is never misread
+    int32_t shard_count;        // A build with a different SHARD_COUNT ignores the snapshot
+    int32_t accounts;
+    int32_t next_farmer_id;
+    int32_t heap_blocks;
+    int64_t heap_used;          // Bytes used in the newest heap block
+    int64_t heap_slots;
+    int64_t heap_entries;
+    int64_t journal_records[SHARD_COUNT];   // Records already reflected; replay resumes after them
+    uint32_t journal_checksum[SHARD_COUNT]; // Checksum of the last of those records
+    int64_t ledger_rows[SHARD_COUNT];       // Ledger files are reused if these rows still hash to ledger_hash
+    uint64_t ledger_hash[SHARD_COUNT];
+    int64_t closed_period[SHARD_COUNT];     // Shard.closed_period
+    SystemStats stats;
+} SnapshotHeader;
+
+// One registry entry in a snapshot, in registry order
+typedef struct {
+    int32_t farmer_id;
+    int32_t password;
+    money_t balance;
+    char username[50];
+    bool active;
+} SnapshotAccount;
+
+// Buffered snapshot output with a running checksum of everything written
+typedef struct {
+    int fd;
+    char* buffer;
+    size_t used;
+    uint64_t hash;
+    bool ok;                    // Cleared by the first failed write
+} SnapshotWriter;
+
+// Background thread that writes a snapshot once enough new journal records pile up
+typedef struct {
+    pthread_t thread;
+    bool running;
+    long long records;          // Journal records, all shards together, covered by the newest snapshot
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_mutex_t busy;       // One checkpoint at a time; they share the temporary file
+} Checkpointer;
+
+// Log-linear latency histogram in nanoseconds: fixed size, so recording never allocates
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} LatencyHistogram;
+
+// Instrumented operations; each keeps a count, a failure count and a histogram
+typedef enum {
+    METRIC_DEPOSIT,
+    METRIC_WITHDRAW,
+    METRIC_TRANSFER,
+    METRIC_BULK_TRANSFER,
+    METRIC_APPLY_BATCH,     // ledger_apply_batch(), the all-or-nothing ingest
+    METRIC_ENQUEUE,         // add_transaction() and the other queue entries, waiting included
+    METRIC_LOOKUP,          // lookup_farmer_hash(); recorded in slots probed, not time
+    METRIC_SETTLE_BATCH,    // One settlement worker pass, fsync included
+    METRIC_BATCH_ROWS,      // Rows stored by that pass
+    METRIC_JOURNAL_SYNC,    // journal_write_pending(): the write and the fsync
+    METRIC_FEED_PUBLISH,    // publish_recent()
+    METRIC_COUNT
+} MetricId;
+
+typedef struct {
+    const char* name;
+    const char* unit;
+} MetricInfo;
+
+// One thread's metrics. Only the owning thread writes them, with relaxed atomics,
+// so metrics_report() can merge every thread's block while they keep running.
+typedef struct MetricsThread {
+    _Atomic uint64_t counts[METRIC_COUNT][HISTOGRAM_BUCKETS];
+    _Atomic uint64_t total[METRIC_COUNT];
+    _Atomic uint64_t failed[METRIC_COUNT];
+    _Atomic uint64_t max[METRIC_COUNT];
+    struct MetricsThread* next;
+} MetricsThread;
+
+// Shape of an open-addressing index at the moment it was read
+typedef struct {
+    uint32_t slots;
+    uint32_t live;
+    uint32_t deleted;       // Markers that lengthen probe chains until the next resize
+    double mean_probes;     // Slots a lookup of a present key visits, on average
+    uint32_t max_probes;
+} HashGauge;
+
+// Everything metrics_report() gathers: merged histograms plus gauges read on the spot
+typedef struct {
+    LatencyHistogram operations[METRIC_COUNT];
+    uint64_t failed[METRIC_COUNT];
+    int threads;            // Running threads that have recorded; exited ones are folded in
+    bool engine_up;         // False before initialize_system() and after shutdown_system(); the gauges below stay zero
+    int queue_depth[SHARD_COUNT];
+    int handoff_depth[SHARD_COUNT];
+    int journal_pending[SHARD_COUNT];
+    long long ledger_rows[SHARD_COUNT];
+    HashGauge farmer_index;
+    HashGauge username_index;
+} MetricsReport;
+
+// Global data structures (defined in sacco_ledger.c)
+extern Farmer* farmer_blocks[MAX_FARMER_BLOCKS]; // Registry; blocks never move, so indices stay valid
+extern _Atomic int num_farmers;
+extern int next_farmer_id;
+extern pthread_mutex_t registry_lock;   // Opening and closing accounts
+extern pthread_mutex_t account_locks[ACCOUNT_LOCK_STRIPES];
+extern Shard shards[SHARD_COUNT];
+extern _Atomic(FarmerHashTable*) farmer_hash_table;
+extern _Atomic(UsernameHashTable*) username_table;
+extern StringHeap descriptions;
+extern StatsBoard system_stats;
+extern Checkpointer checkpointer;
+extern const MetricInfo metric_info[METRIC_COUNT];
+
+// Startup replays the journals and starts the settlement workers; shutdown drains them.
+// A failed start leaves the reason in ledger_error() and nothing open behind it.
+LedgerStatus initialize_system();
+void shutdown_system();
+void free_memory();
+bool checkpoint();
+
+// Accounts
+Farmer* farmer_at(int index);
+int find_farmer_index(int farmer_id);
+int find_farmer_by_username(const char* username);
+int check_login(const char* username, int password);
+int create_farmer(const char* username, int password);
+int register_farmer(int farmer_id, const char* username, int password);
+bool close_farmer(int farmer_id);
+int shard_of(int farmer_id);
+Ledger* farmer_ledger(const Farmer* f);
+void shard_file_name(char* buf, size_t size, const char* base, int shard);
+
+// Money movement; every call returns a status and never prints
+LedgerStatus ledger_deposit(int farmer_id, money_t amount, const char* description, uint64_t* ticket);
+LedgerStatus ledger_withdraw(int farmer_id, money_t amount, const char* description, uint64_t* ticket);
+LedgerStatus ledger_transfer(int from_id, int to_id, money_t amount, const char* note, uint64_t* ticket);
+LedgerStatus ledger_bulk_transfer(int from_id, const TransferLeg* legs, int count, const char* note,
+                                  int* failed_leg, uint64_t* ticket);
+LedgerStatus ledger_apply_batch(const BatchEntry* entries, int count, int* failed_entry, uint64_t* ticket);
+LedgerStatus ledger_accrue(int64_t rate, int32_t period, const char* description, AccrualSummary* out);
+const char* ledger_status_message(LedgerStatus status);
+const char* ledger_error();
+const char* parse_money(const char* text, money_t* out);
+const char* money_text(money_t amount, char* buf);
+
+// Reporting: the engine never prints. Notices are things the caller may want to show,
+// such as a torn journal tail that was cut off. A fatal failure is one a running engine
+// cannot return from (a journal write failing in a settlement worker, running out of
+// memory deep inside a call); the handler is expected not to return, and without one
+// the process aborts.
+void ledger_on_notice(void (*handler)(const char* message));
+void ledger_on_fatal(void (*handler)(const char* message));
+
+// Settlement: tickets from add_transaction() become durable in order within each shard
+uint64_t add_transaction(int farmer_id, money_t amount, char type, const char* description);
+void wait_for_settlement(uint64_t ticket);
+bool ticket_settled(uint64_t ticket);
+void settle_all();
+void settlement_notify(int fd);
+void journal_commit();          // fsync account openings and closings right away
+
+// Reading the ledger (hold farmer_ledger(f)->lock for reading around f's history)
+Transaction ledger_transaction(const Ledger* l, long long row);
+money_t ledger_net_total(const Ledger* l, long long first, long long last);
+int history_range(const Farmer* f, int64_t start, int64_t end, int* first);
+int recent_feed_last(int n, Transaction* out);
+int ledger_search(int farmer_id, const char* query, Transaction* out, int max);
+
+// Statement pages: only the rows of the current page are copied out
+void statement_latest(StatementCursor* c, int farmer_id, int page_size);
+void statement_oldest(StatementCursor* c, int farmer_id, int page_size);
+bool statement_older(StatementCursor* c);
+bool statement_newer(StatementCursor* c);
+int statement_read(const StatementCursor* c, Transaction* out, int* rows);
+int statement_total(const StatementCursor* c);
+const char* statement_token(const StatementCursor* c, char* buf);
+bool statement_resume(StatementCursor* c, const char* token);
+const char* description_at(uint32_t id);
+
+// Statement export: CSV or JSON rows gathered in w->buffer (EXPORT_BUFFER bytes) and
+// written to w->fd; a failed write clears w->ok
+void export_row(ExportWriter* w, const Transaction* t, int row, bool json, bool first);
+size_t export_money(money_t amount, char* buf);
+void export_timestamp(ExportWriter* w, time_t when);
+void export_text(ExportWriter* w, const char* text, bool json);
+void export_put(ExportWriter* w, const char* data, size_t len);
+void export_flush(ExportWriter* w);
+SystemStats stats_snapshot();
+
+// Metrics: cheap enough for every call; metrics_report() merges all threads on demand
+uint64_t metrics_clock();
+void metrics_record(MetricId id, uint64_t value, bool ok);
+void metrics_report(MetricsReport* out);
+
+// Account index internals, exposed for the benchmarks
+void resize_farmer_hash(uint32_t slot_count);
+void insert_farmer_hash(int farmer_id, int index);
+int lookup_farmer_hash(int farmer_id);
+void free_farmer_hash();
+void resize_username_index(uint32_t slot_count);
+
+// Utilities
+void* slab_alloc(SlabAllocator* slab, size_t bytes);
+void slab_free(SlabAllocator* slab, void* p, size_t bytes);
+void slab_release_all(SlabAllocator* slab);
+int histogram_bucket(uint64_t value);
+void histogram_record(LatencyHistogram* h, uint64_t ns);
+void histogram_merge(LatencyHistogram* into, const LatencyHistogram* from);
+uint64_t histogram_percentile(const LatencyHistogram* h, double percentile);
+double now_seconds();
+
+#endif
@@ -0,0 +1,1153 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "sacco_ledger.h"
+
+// Engine tests. The engine keeps its state in globals and its files in the working
+// directory, so every case gets a scratch directory and every phase of a case runs in
+// its own child process, starting from a clean set of globals. A phase that ends in
+// raise(SIGKILL) is a crash; the next phase starts up from whatever it left on disk,
+// like a restart would.
+//
+//   gcc sacco_ledger_test.c sacco_ledger.c -o sacco_ledger_test -pthread
+//   ./sacco_ledger_test
+
+#define TEST_OPENING_BALANCE 500000   // Cents the first starter account opens with
+#define TEST_MEMBERS 40               // Extra accounts opened by cases that need several per shard
+#define TEST_DEPOSITS 300             // More than a group commit, so damage can sit behind committed records
+#define TEST_RATE (ACCRUAL_RATE_SCALE / 100) // 1% a year
+#define TEST_PERIOD 202610
+#define TEST_RESIZE_ACCOUNTS 5000  // Enough to double the farmer index from 64 slots seven times
+#define TEST_READERS 4
+#define TEST_BALANCES "balances.expected" // Every balance after a close, in registry order, for a later phase
+
+typedef int (*TestPhase)();
+
+// Test prototypes
+int check(bool ok, const char* what);
+int run_phase(TestPhase phase);
+bool run_case(const char* name, bool (*test)());
+void remove_scratch(const char* dir);
+long long file_size(const char* path);
+char* read_file(const char* path, long long* size);
+void journal_path(char* buf, size_t size, int farmer_id);
+money_t balance_of(int farmer_id);
+int open_members(int* same_shard, int want);
+int remote_member();
+int conserved();
+bool started();
+bool test_failed_start();
+int unopenable_journal();
+int damaged_journal_refused();
+bool test_parse_money();
+int money_is(const char* text, money_t want, const char* rest);
+bool test_metrics_outside_engine();
+int metrics_around_startup();
+bool test_hash_resize();
+int lookups_during_resize();
+void* resize_reader(void* arg);
+bool test_export_quoting();
+int export_awkward_text();
+char* exported(const Transaction* t, const char* text, bool json);
+int exports_as(const char* text, bool json, const char* want);
+bool test_search_words();
+int search_repeated_and_unknown();
+int search_finds(const char* query, int want, const char* what);
+bool test_torn_bulk();
+bool test_damaged_journal();
+bool test_cursor();
+bool test_checkpoint_crash();
+int checkpoint_then_crash();
+int restored_from_checkpoint();
+void count_notice(const char* message);
+bool test_cross_shard_crash();
+int bulk_then_crash();
+int bulk_cut_off();
+int deposits();
+int cursor_pages();
+bool test_clock_step();
+int clock_steps_back();
+int rows_between(int farmer_id, int64_t start, int64_t end);
+bool test_history_chunks();
+int ranges_at_chunk_edges();
+int64_t history_time(int farmer_id, int position);
+int range_is(int farmer_id, int64_t start, int64_t end, int want_first, int want_span, const char* what);
+int spend_held_credit_then_crash();
+int held_credit_was_never_paid();
+int spend_settled_credit_then_crash();
+int settled_credit_survives();
+bool test_accrual_rerun();
+int close_twice();
+int rerun_after_restart();
+int close_then_crash();
+int rerun_finishes_close();
+money_t accrue(int64_t rate, int32_t period, const char* description, AccrualSummary* summary);
+bool test_batch_crash();
+void batch_members(int* x, int* z);
+LedgerStatus apply_test_batch(money_t debit, int* failed_entry);
+int batch_held_then_crash();
+int batch_never_applied();
+int batch_settled_then_crash();
+int batch_finished();
+int batch_row_limit();
+
+// Set by the parent between phases; the next phase's child inherits it
+long long saved_size;
+int notices;                  // Engine notices seen by the current phase
+long long clock_shift;        // Seconds added to time(), to set the engine's clock back
+_Atomic int resize_published; // Highest farmer ID the resize test has finished opening
+_Atomic bool resize_done;
+_Atomic int resize_misses;    // Lookups that returned the wrong account, or none
+
+int main() {
+    int failed = 0;
+    
+    printf("\n🧪 SACCO ledger engine tests\n\n");
+    failed += !run_case("a failed start is reported, not printed or exited", test_failed_start);
+    failed += !run_case("amounts parse to the cent and bad ones are refused", test_parse_money);
+    failed += !run_case("metrics skip the gauges before startup and after shutdown", test_metrics_outside_engine);
+    failed += !run_case("farmer lookups stay right while the index resizes", test_hash_resize);
+    failed += !run_case("exports quote commas, quotes and line breaks", test_export_quoting);
+    failed += !run_case("search ignores repeated words and finds nothing for unknown ones", test_search_words);
+    failed += !run_case("torn bulk batch is dropped on replay", test_torn_bulk);
+    failed += !run_case("damage mid-journal stops startup and keeps the file", test_damaged_journal);
+    failed += !run_case("statement cursor pages and resume tokens", test_cursor);
+    failed += !run_case("a clock set back does not move an open statement page", test_clock_step);
+    failed += !run_case("date ranges start and end on chunk boundaries", test_history_chunks);
+    failed += !run_case("checkpoint snapshot restores after a crash", test_checkpoint_crash);
+    failed += !run_case("cross-shard credit cannot be spent before it is durable", test_cross_shard_crash);
+    failed += !run_case("month-end close pays each shard once per period", test_accrual_rerun);
+    failed += !run_case("all-or-nothing batch survives a crash whole or not at all", test_batch_crash);
+    
+    if (failed > 0) {
+        printf("\n❌ %d test case%s failed\n", failed, failed == 1 ? "" : "s");
+        return 1;
+    }
+    printf("\n✅ All test cases passed\n");
+    return 0;
+}
+
+time_t time(time_t* out) {
+    // Replaces the C library's for the whole test program: the engine stamps rows with time()
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    time_t t = now.tv_sec + (time_t)clock_shift;
+    if (out != NULL) *out = t;
+    return t;
+}
+
+int check(bool ok, const char* what) {
+    // Returns 1 on failure, so a phase can add up its checks
+    if (!ok) fprintf(stderr, "   ❌ %s\n", what);
+    return ok ? 0 : 1;
+}
+
+int run_phase(TestPhase phase) {
+    // Exit status of the phase's child, or 128 + the signal that ended it
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        printf("\n❌ Error: cannot fork: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (pid == 0) {
+        int failures = phase();
+        fflush(stdout);
+        _exit(failures > 0 ? 1 : 0);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {}
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+bool run_case(const char* name, bool (*test)()) {
+    // Runs test inside a fresh scratch directory, kept afterwards only if it failed
+    char dir[] = "/tmp/sacco_test.XXXXXX";
+    char previous[4096];
+    if (mkdtemp(dir) == NULL || getcwd(previous, sizeof(previous)) == NULL || chdir(dir) == -1) {
+        printf("\n❌ Error: cannot set up a scratch directory: %s\n", strerror(errno));
+        exit(1);
+    }
+    bool ok = test();
+    if (chdir(previous) == -1) {
+        printf("\n❌ Error: cannot return to %s: %s\n", previous, strerror(errno));
+        exit(1);
+    }
+    if (ok) {
+        remove_scratch(dir);
+        printf("✅ %s\n", name);
+    } else {
+        printf("❌ %s (files left in %s)\n", name, dir);
+    }
+    return ok;
+}
+
+void remove_scratch(const char* dir) {
+    DIR* d = opendir(dir);
+    if (d == NULL) return;
+    struct dirent* e;
+    char path[4096];
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+long long file_size(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long long)st.st_size : -1;
+}
+
+char* read_file(const char* path, long long* size) {
+    *size = file_size(path);
+    char* data = (char*)malloc((size_t)(*size > 0 ? *size : 1));
+    FILE* fp = fopen(path, "rb");
+    if (data == NULL || fp == NULL || fread(data, 1, (size_t)*size, fp) != (size_t)*size) {
+        printf("\n❌ Error: cannot read %s\n", path);
+        exit(1);
+    }
+    fclose(fp);
+    return data;
+}
+
+void journal_path(char* buf, size_t size, int farmer_id) {
+    shard_file_name(buf, size, JOURNAL_FILE, shard_of(farmer_id));
+}
+
+money_t balance_of(int farmer_id) {
+    int index = find_farmer_index(farmer_id);
+    return index == -1 ? -1 : farmer_at(index)->balance;
+}
+
+int open_members(int* same_shard, int want) {
+    // Opens TEST_MEMBERS accounts and returns up to want of them that share farmer 1's shard
+    int found = 0;
+    for (int i = 0; i < TEST_MEMBERS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Member_%d", i);
+        int farmer_id = create_farmer(name, 1234);
+        if (farmer_id != -1 && found < want && shard_of(farmer_id) == shard_of(1)) {
+            same_shard[found++] = farmer_id;
+        }
+    }
+    journal_commit();
+    return found;
+}
+
+int remote_member() {
+    // An account opened by open_members() that lives outside farmer 1's shard
+    for (int farmer_id = 6; farmer_id <= TEST_MEMBERS + 5; farmer_id++) {
+        if (shard_of(farmer_id) != shard_of(1)) return farmer_id;
+    }
+    return -1;
+}
+
+int conserved() {
+    // Every balance is non-negative and they add up to what the ledger rows say
+    money_t total = 0;
+    int failures = 0;
+    for (int i = 0; i < num_farmers; i++) {
+        Farmer* f = farmer_at(i);
+        if (!f->active) continue;
+        failures += check(f->balance >= 0, "no balance is negative");
+        total += f->balance;
+    }
+    failures += check(total == stats_snapshot().total_balance, "balances add up to the ledger rows");
+    return failures;
+}
+
+bool started() {
+    // Starts the engine for a phase, reporting why if it would not
+    LedgerStatus status = initialize_system();
+    if (status != LEDGER_OK) {
+        fprintf(stderr, "   ❌ startup failed: %s (%s)\n", ledger_status_message(status), ledger_error());
+    }
+    return status == LEDGER_OK;
+}
+
+bool test_failed_start() {
+    return run_phase(unopenable_journal) == 0;
+}
+
+int unopenable_journal() {
+    // A directory where a journal belongs: startup returns to the caller with a reason,
+    // and a second attempt once the path is clear starts normally
+    char path[256];
+    shard_file_name(path, sizeof(path), JOURNAL_FILE, SHARD_COUNT - 1);
+    if (mkdir(path, 0700) == -1) return 1;
+    int failures = check(initialize_system() == LEDGER_IO_ERROR, "startup returns LEDGER_IO_ERROR");
+    failures += check(strstr(ledger_error(), path) != NULL, "ledger_error() names the journal");
+    rmdir(path);
+    failures += check(initialize_system() == LEDGER_OK, "startup works once the journal can be opened");
+    failures += check(balance_of(1) == TEST_OPENING_BALANCE, "starter accounts opened after the retry");
+    shutdown_system();
+    return failures;
+}
+
+bool test_parse_money() {
+    // Pure text handling, so no engine and no child process
+    int failures = money_is("7500", 750000, "");
+    failures += money_is("7500.5", 750050, "");
+    failures += money_is("0.05", 5, "");
+    failures += money_is(".5", 50, "");
+    failures += money_is("10000000000000.00", MONEY_MAX, "");
+    
+    // Trailing junk ends the number; the caller decides whether to accept what follows
+    failures += money_is("12.34x", 1234, "x");
+    failures += money_is("12,desc", 1200, ",desc");
+    failures += money_is("1e3", 100, "e3");
+    failures += money_is("5 ", 500, " ");
+    
+    money_t amount = -1;
+    const char* refused[] = {
+        "-5", "+5", "-0.01", "1.234", "0.001", "10000000000000.01", "10000000000001",
+        "99999999999999999999999", "", ".", "abc", " 5"
+    };
+    for (size_t i = 0; i < sizeof(refused) / sizeof(refused[0]); i++) {
+        if (parse_money(refused[i], &amount) != NULL) {
+            fprintf(stderr, "   ❌ \"%s\" should be refused\n", refused[i]);
+            failures++;
+        }
+    }
+    return failures == 0;
+}
+
+int money_is(const char* text, money_t want, const char* rest) {
+    // 1 unless text parses to want and stops where rest begins
+    money_t amount = -1;
+    const char* end = parse_money(text, &amount);
+    if (end != NULL && amount == want && strcmp(end, rest) == 0) return 0;
+    fprintf(stderr, "   ❌ \"%s\" should be %lld cents followed by \"%s\"\n", text, (long long)want, rest);
+    return 1;
+}
+
+bool test_metrics_outside_engine() {
+    return run_phase(metrics_around_startup) == 0;
+}
+
+int metrics_around_startup() {
+    // No shards or hash tables exist yet, then they do, then they are gone again
+    MetricsReport* r = (MetricsReport*)malloc(sizeof(MetricsReport));
+    if (r == NULL) return 1;
+    metrics_report(r);
+    int failures = check(!r->engine_up, "a report before startup says the engine is down");
+    if (!started()) {
+        free(r);
+        return 1;
+    }
+    metrics_report(r);
+    failures += check(r->engine_up, "a report while running says the engine is up");
+    failures += check(r->farmer_index.live == 5, "the farmer index gauge counts the starter accounts");
+    shutdown_system();
+    metrics_report(r);
+    failures += check(!r->engine_up, "a report after shutdown says the engine is down");
+    failures += check(r->farmer_index.slots == 0, "no index gauge is read after shutdown");
+    free(r);
+    return failures;
+}
+
+bool test_hash_resize() {
+    return run_phase(lookups_during_resize) == 0;
+}
+
+int lookups_during_resize() {
+    // Readers look accounts up without the registry lock while this thread opens enough
+    // of them to resize the index again and again. Even IDs are closed straight away,
+    // which leaves deleted markers for the rebuilds to drop.
+    if (!started()) return 1;
+    resize_published = 5;
+    pthread_t readers[TEST_READERS];
+    int running = 0;
+    for (; running < TEST_READERS; running++) {
+        if (pthread_create(&readers[running], NULL, resize_reader, (void*)(intptr_t)running) != 0) break;
+    }
+    
+    int failures = check(running == TEST_READERS, "reader threads started");
+    for (int i = 0; i < TEST_RESIZE_ACCOUNTS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Resize_%d", i);
+        int farmer_id = create_farmer(name, 1234);
+        if (farmer_id == -1) {
+            failures += check(false, "account opened");
+            break;
+        }
+        if (farmer_id % 2 == 0 && !close_farmer(farmer_id)) {
+            failures += check(false, "empty account closed");
+            break;
+        }
+        resize_published = farmer_id;
+    }
+    resize_done = true;
+    for (int i = 0; i < running; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    
+    failures += check(resize_misses == 0, "no lookup missed or found the wrong account during a resize");
+    FarmerHashTable* table = atomic_load(&farmer_hash_table);
+    failures += check(table->mask + 1 > HASH_INITIAL_SLOTS, "the index grew");
+    for (int farmer_id = 1; farmer_id <= resize_published; farmer_id++) {
+        int index = find_farmer_index(farmer_id);
+        bool closed = farmer_id > 5 && farmer_id % 2 == 0;
+        bool right = closed ? index == -1 || !farmer_at(index)->active : index != -1 && farmer_at(index)->farmer_id == farmer_id;
+        if (!right) {
+            fprintf(stderr, "   ❌ farmer %d is %s after the resizes\n", farmer_id, closed ? "still listed" : "missing");
+            failures++;
+            break;
+        }
+    }
+    shutdown_system();
+    return failures;
+}
+
+void* resize_reader(void* arg) {
+    // Looks up open accounts, which must always be found, and IDs never issued, which
+    // must never be
+    uint32_t seed = 2463534242u + (uint32_t)(intptr_t)arg;
+    while (!resize_done) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        int published = resize_published;
+        int farmer_id = (int)(seed % (uint32_t)published) + 1;
+        if (farmer_id > 5 && farmer_id % 2 == 0) farmer_id--;
+        int index = find_farmer_index(farmer_id);
+        if (index == -1 || farmer_at(index)->farmer_id != farmer_id) resize_misses++;
+        if (find_farmer_index(published + TEST_RESIZE_ACCOUNTS + 1) != -1) resize_misses++;
+    }
+    return NULL;
+}
+
+bool test_export_quoting() {
+    return run_phase(export_awkward_text) == 0;
+}
+
+int export_awkward_text() {
+    // A description with a comma, quotes and a line break must come back out of a
+    // CSV or JSON reader exactly as it went in
+    int failures = exports_as("Seed loan", false, "Seed loan");
+    failures += exports_as("Seeds, fertiliser", false, "\"Seeds, fertiliser\"");
+    failures += exports_as("The \"hybrid\" kind", false, "\"The \"\"hybrid\"\" kind\"");
+    failures += exports_as("\"", false, "\"\"\"\"");
+    failures += exports_as("Two\nlines", false, "\"Two\nlines\"");
+    failures += exports_as("Carriage\rreturn", false, "\"Carriage\rreturn\"");
+    failures += exports_as("Seeds, fertiliser", true, "\"Seeds, fertiliser\"");
+    failures += exports_as("The \"hybrid\" kind", true, "\"The \\\"hybrid\\\" kind\"");
+    failures += exports_as("Two\nlines\tand a tab", true, "\"Two\\u000alines\\u0009and a tab\"");
+    failures += exports_as("C:\\seeds", true, "\"C:\\\\seeds\"");
+    failures += exports_as("", false, "");
+    failures += exports_as("", true, "\"\"");
+    
+    // The same text through a whole statement row
+    if (!started()) return 1;
+    uint64_t ticket = 0;
+    ledger_deposit(1, 100, "Seeds, \"hybrid\"\nlot 2", &ticket);
+    wait_for_settlement(ticket);
+    StatementCursor c;
+    Transaction t;
+    statement_latest(&c, 1, 1);
+    failures += check(statement_read(&c, &t, NULL) == 1, "deposit read back");
+    char* csv = exported(&t, NULL, false);
+    const char* csv_tail = ",D,1.00,\"Seeds, \"\"hybrid\"\"\nlot 2\"\n";
+    failures += check(strlen(csv) > strlen(csv_tail) && strcmp(csv + strlen(csv) - strlen(csv_tail), csv_tail) == 0,
+                      "CSV row quotes the description");
+    char* json = exported(&t, NULL, true);
+    failures += check(strstr(json, "\"amount\":\"1.00\",\"description\":\"Seeds, \\\"hybrid\\\"\\u000alot 2\"}") != NULL,
+                      "JSON row escapes the description");
+    free(csv);
+    free(json);
+    shutdown_system();
+    return failures;
+}
+
+char* exported(const Transaction* t, const char* text, bool json) {
+    // What export_row() writes for t, or export_text() for text, as a string
+    ExportWriter w = { .fd = open("export.out", O_WRONLY | O_CREAT | O_TRUNC, 0600), .ok = true };
+    w.buffer = (char*)malloc(EXPORT_BUFFER);
+    if (w.fd == -1 || w.buffer == NULL) {
+        printf("\n❌ Error: cannot set up an export\n");
+        exit(1);
+    }
+    if (t != NULL) export_row(&w, t, 0, json, true);
+    else export_text(&w, text, json);
+    export_flush(&w);
+    close(w.fd);
+    free(w.buffer);
+    
+    long long size;
+    char* data = read_file("export.out", &size);
+    char* out = (char*)malloc((size_t)size + 1);
+    memcpy(out, data, (size_t)size);
+    out[size] = '\0';
+    free(data);
+    return out;
+}
+
+int exports_as(const char* text, bool json, const char* want) {
+    // 1 unless text is written exactly as want
+    char* got = exported(NULL, text, json);
+    int failed = strcmp(got, want) != 0;
+    if (failed) fprintf(stderr, "   ❌ %s field [%s] came out as [%s], expected [%s]\n", json ? "JSON" : "CSV", text, got, want);
+    free(got);
+    return failed;
+}
+
+bool test_search_words() {
+    return run_phase(search_repeated_and_unknown) == 0;
+}
+
+int search_repeated_and_unknown() {
+    // Farmer 1 gets four rows mentioning maize, one of them with the word twice, and one
+    // about coffee; farmer 2's maize row must never show up in farmer 1's results
+    if (!started()) return 1;
+    uint64_t ticket = 0;
+    ledger_deposit(1, 101, "Maize harvest", &ticket);
+    ledger_deposit(1, 102, "Maize harvest", &ticket);
+    ledger_deposit(1, 103, "Maize maize harvest", &ticket);
+    ledger_deposit(1, 104, "Coffee sale", &ticket);
+    ledger_deposit(1, 105, "MAIZE, harvest!", &ticket);
+    wait_for_settlement(ticket);
+    ledger_deposit(2, 106, "Maize harvest", &ticket);
+    wait_for_settlement(ticket);
+    
+    int failures = search_finds("maize", 4, "one word");
+    failures += search_finds("maize maize", 4, "a word given twice counts once");
+    failures += search_finds("Harvest MAIZE harvest", 4, "repeats in any case count once");
+    failures += search_finds("coffee", 1, "a word on one row");
+    failures += search_finds("sorghum", 0, "a word no description holds");
+    failures += search_finds("maize sorghum", 0, "a known word with an unknown one");
+    failures += search_finds("maize coffee", 0, "two words never on the same row");
+    failures += search_finds("", 0, "an empty query");
+    failures += search_finds("!!! ,,", 0, "a query with no words");
+    failures += search_finds("maize maize maize maize maize maize maize maize maize coffee", 0,
+                             "repeats do not use up the words that count");
+    
+    // Newest first, and the count goes on past the rows copied out
+    Transaction found[2];
+    failures += check(ledger_search(1, "maize", found, 2) == 4, "count includes rows beyond max");
+    failures += check(found[0].amount == 105 && found[1].amount == 103, "newest matches first");
+    failures += check(ledger_search(999999, "maize", found, 2) == 0, "unknown account finds nothing");
+    shutdown_system();
+    return failures;
+}
+
+int search_finds(const char* query, int want, const char* what) {
+    // 1 unless farmer 1's search for query matches want rows
+    Transaction found[16];
+    int got = ledger_search(1, query, found, 16);
+    if (got == want) return 0;
+    fprintf(stderr, "   ❌ %s: \"%s\" found %d rows, expected %d\n", what, query, got, want);
+    return 1;
+}
+
+int damaged_journal_refused() {
+    int failures = check(initialize_system() == LEDGER_JOURNAL_DAMAGED, "startup refuses a damaged journal");
+    failures += check(strstr(ledger_error(), "damaged") != NULL, "ledger_error() says the record is damaged");
+    return failures;
+}
+
+bool test_torn_bulk() {
+    // A crash cut the journal partway through a bulk transfer's rows: none of it may survive
+    if (run_phase(bulk_then_crash) != 128 + SIGKILL) return false;
+    char path[256];
+    journal_path(path, sizeof(path), 1);
+    saved_size = file_size(path);
+    if (truncate(path, (off_t)(saved_size - (long long)sizeof(JournalRecord) * 3 / 2)) == -1) return false;
+    return run_phase(bulk_cut_off) == 0;
+}
+
+bool test_damaged_journal() {
+    // A flipped bit with a group commit's worth of committed records behind it is not a
+    // torn tail: startup must refuse and leave the file for the operator
+    if (run_phase(deposits) != 0) return false;
+    remove(SNAPSHOT_FILE);
+    char path[256];
+    journal_path(path, sizeof(path), 1);
+    int fd = open(path, O_RDWR);
+    unsigned char byte;
+    off_t at = (off_t)sizeof(JournalRecord) * 3 + 20;
+    if (fd == -1 || pread(fd, &byte, 1, at) != 1) return false;
+    byte ^= 1;
+    bool written = pwrite(fd, &byte, 1, at) == 1;
+    close(fd);
+    if (!written) return false;
+    
+    long long before, after;
+    char* damaged = read_file(path, &before);
+    bool refused = run_phase(damaged_journal_refused) == 0;
+    char* now = read_file(path, &after);
+    bool untouched = check(after == before && memcmp(now, damaged, (size_t)before) == 0, "journal left as it was") == 0;
+    free(damaged);
+    free(now);
+    return refused && untouched;
+}
+
+bool test_cursor() {
+    return run_phase(cursor_pages) == 0;
+}
+
+bool test_cross_shard_crash() {
+    // Farmer 1 pays an account in another shard, which withdraws the money straight away,
+    // then the process is killed. Replay must never find the withdrawal without the credit.
+    return run_phase(spend_held_credit_then_crash) == 128 + SIGKILL &&
+           run_phase(held_credit_was_never_paid) == 0 &&
+           run_phase(spend_settled_credit_then_crash) == 128 + SIGKILL &&
+           run_phase(settled_credit_survives) == 0;
+}
+
+int spend_held_credit_then_crash() {
+    if (!started()) return 1;
+    int members[1];
+    open_members(members, 0);
+    int to = remote_member();
+    int failures = check(to != -1, "a member lives in another shard");
+    
+    // Holding the sender shard's journal stalls its worker before the 'H' record is written,
+    // which is the window a slow disk would open
+    Journal* sender = &shards[shard_of(1)].journal;
+    pthread_mutex_lock(&sender->lock);
+    uint64_t ticket = 0;
+    failures += check(ledger_transfer(1, to, 1000, "held", &ticket) == LEDGER_OK, "transfer accepted");
+    failures += check(balance_of(to) == 0 && farmer_at(find_farmer_index(to))->incoming == 1000,
+                      "credit is held until the sender's shard has it on disk");
+    failures += check(!close_farmer(to), "account with a held credit cannot be closed");
+    failures += check(ledger_withdraw(to, 1000, "too early", &ticket) == LEDGER_INSUFFICIENT_FUNDS,
+                      "held credit cannot be withdrawn");
+    if (failures > 0) return failures;
+    raise(SIGKILL);
+    return 1;
+}
+
+int held_credit_was_never_paid() {
+    if (!started()) return 1;
+    int to = remote_member();
+    int failures = check(balance_of(1) == TEST_OPENING_BALANCE && balance_of(to) == 0,
+                         "transfer that never reached the disk is gone on both sides");
+    failures += conserved();
+    shutdown_system();
+    return failures;
+}
+
+int spend_settled_credit_then_crash() {
+    // Once the transfer's ticket settles, the credit is durable and the money can move on
+    if (!started()) return 1;
+    int to = remote_member();
+    uint64_t ticket = 0;
+    int failures = check(ledger_transfer(1, to, 1000, "settled", &ticket) == LEDGER_OK, "transfer accepted");
+    wait_for_settlement(ticket);
+    failures += check(balance_of(to) == 1000 && farmer_at(find_farmer_index(to))->incoming == 0,
+                      "settled credit is spendable");
+    failures += check(ledger_withdraw(to, 1000, "spent", &ticket) == LEDGER_OK, "withdrawal accepted");
+    wait_for_settlement(ticket);
+    if (failures > 0) return failures;
+    raise(SIGKILL);
+    return 1;
+}
+
+int settled_credit_survives() {
+    if (!started()) return 1;
+    int to = remote_member();
+    int failures = check(balance_of(1) == TEST_OPENING_BALANCE - 1000 && balance_of(to) == 0,
+                         "transfer and withdrawal both replayed");
+    failures += conserved();
+    shutdown_system();
+    return failures;
+}
+
+int bulk_then_crash() {
+    // Pays some of farmer 1's shard-mates from farmer 1 in one bulk transfer, then dies
+    if (!started()) return 1;
+    int failures = check(balance_of(1) == TEST_OPENING_BALANCE, "fresh start opens farmer 1");
+    int members[4];
+    int found = open_members(members, 4);
+    failures += check(found > 0, "some members share farmer 1's shard");
+    
+    TransferLeg legs[4];
+    for (int i = 0; i < found; i++) {
+        legs[i] = (TransferLeg){ .to_id = members[i], .amount = 1000 * (i + 1) };
+    }
+    uint64_t ticket = 0;
+    failures += check(ledger_bulk_transfer(1, legs, found, "torn", NULL, &ticket) == LEDGER_OK, "bulk transfer accepted");
+    wait_for_settlement(ticket);
+    if (failures > 0) return failures;
+    raise(SIGKILL);
+    return 1;
+}
+
+int bulk_cut_off() {
+    if (!started()) return 1;
+    int failures = check(balance_of(1) == TEST_OPENING_BALANCE, "sender keeps its money");
+    int legs = 0;
+    for (int id = 6; id <= TEST_MEMBERS + 5; id++) {
+        failures += check(balance_of(id) == 0, "no recipient was paid");
+        if (shard_of(id) == shard_of(1) && legs < 4) legs++;
+    }
+    failures += conserved();
+    
+    // The 'B' header and every row are gone, and nothing before them
+    char path[256];
+    journal_path(path, sizeof(path), 1);
+    failures += check(file_size(path) == saved_size - (long long)sizeof(JournalRecord) * (legs + 2),
+                      "journal cut back to just before the batch");
+    shutdown_system();
+    return failures;
+}
+
+int deposits() {
+    if (!started()) return 1;
+    uint64_t ticket = 0;
+    for (int i = 0; i < TEST_DEPOSITS; i++) {
+        ledger_deposit(1, 100, "Test deposit", &ticket);
+    }
+    wait_for_settlement(ticket);
+    int failures = check(balance_of(1) == TEST_OPENING_BALANCE + 100 * TEST_DEPOSITS, "deposits settle");
+    shutdown_system();
+    return failures;
+}
+
+bool test_checkpoint_crash() {
+    return run_phase(checkpoint_then_crash) == 128 + SIGKILL && run_phase(restored_from_checkpoint) == 0;
+}
+
+int checkpoint_then_crash() {
+    // The snapshot comes from a forked child; a crash straight after must not need the shutdown one
+    if (!started()) return 1;
+    uint64_t ticket = 0;
+    for (int i = 0; i < TEST_DEPOSITS; i++) {
+        ledger_deposit(1, 100, "Checkpoint test", &ticket);
+    }
+    wait_for_settlement(ticket);
+    if (check(checkpoint(), "checkpoint writes a snapshot") != 0) return 1;
+    fflush(stdout);
+    raise(SIGKILL);
+    return 1;
+}
+
+int restored_from_checkpoint() {
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", SNAPSHOT_FILE);
+    int failures = check(file_size(SNAPSHOT_FILE) > 0 && file_size(tmp) == -1, "snapshot published, nothing left over");
+    ledger_on_notice(count_notice);
+    if (!started()) return 1;
+    failures += check(notices == 0, "startup takes the snapshot without complaint");
+    long long records = 0;
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        records += shards[i].journal.record_count;
+    }
+    failures += check(checkpointer.records == records, "snapshot covers every journal record");
+    failures += check(balance_of(1) == TEST_OPENING_BALANCE + 100 * TEST_DEPOSITS, "balance restored");
+    failures += conserved();
+    shutdown_system();
+    return failures;
+}
+
+void count_notice(const char* message) {
+    fprintf(stderr, "   ⚠️  %s\n", message);
+    notices++;
+}
+
+int cursor_pages() {
+    if (!started()) return 1;
+    uint64_t ticket = 0;
+    for (int i = 0; i < 45; i++) {
+        ledger_deposit(1, 100 + i, "Page test", &ticket);
+    }
+    wait_for_settlement(ticket);
+
+    // 46 rows: the opening deposit, then 45 more
+    StatementCursor c;
+    Transaction rows[20];
+    statement_latest(&c, 1, 20);
+    int failures = check(c.first == 26 && c.end == 46, "latest page is the newest 20 rows");
+    failures += check(statement_read(&c, rows, NULL) == 20 && rows[19].amount == 144 && rows[0].amount == 125,
+                      "page reads oldest first");
+    failures += check(statement_older(&c) && c.first == 6 && c.end == 26, "older page");
+    failures += check(statement_older(&c) && c.first == 0 && c.end == 6, "oldest page is short");
+    failures += check(!statement_older(&c), "nothing older than the oldest page");
+    failures += check(statement_read(&c, rows, NULL) == 6 && rows[0].amount == TEST_OPENING_BALANCE, "oldest row first");
+
+    // A token brings back exactly the page it was taken from
+    char token[STATEMENT_TOKEN_SIZE];
+    StatementCursor back;
+    statement_newer(&c);
+    statement_token(&c, token);
+    failures += check(statement_resume(&back, token) && memcmp(&back, &c, sizeof(c)) == 0, "token round-trips");
+
+    // New rows do not move a page; they show up further on
+    ledger_deposit(1, 999, "Page test", &ticket);
+    wait_for_settlement(ticket);
+    failures += check(statement_read(&back, rows, NULL) == 20 && rows[0].amount == 105, "page holds still");
+    statement_latest(&c, 1, 20);
+    failures += check(statement_read(&c, rows, NULL) == 20 && rows[19].amount == 999, "newest row on the latest page");
+
+    const char* bad[] = { "1:5:2:20", "1:0:30:20", "1:0:1:0", "1:0:1:5000", "x", "1:0:1:1junk", "-1:-1:0:5" };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        failures += check(!statement_resume(&back, bad[i]), bad[i]);
+    }
+    shutdown_system();
+    return failures;
+}
+
+bool test_clock_step() {
+    return run_phase(clock_steps_back) == 0;
+}
+
+int clock_steps_back() {
+    // A row stamped a month before the rows settled ahead of it, with enough history for
+    // several chunks: the open page keeps its rows and date ranges still find everything
+    if (!started()) return 1;
+    uint64_t ticket = 0;
+    for (int i = 0; i < HISTORY_CHUNK_ROWS * 2; i++) {
+        ledger_deposit(1, 100 + i, "Clock test", &ticket);
+    }
+    wait_for_settlement(ticket);
+    StatementCursor c;
+    Transaction before[20], after[20];
+    statement_latest(&c, 1, 20);
+    int failures = check(statement_read(&c, before, NULL) == 20, "latest page read");
+    
+    clock_shift = -30 * 24 * 3600;
+    time_t then = time(NULL);
+    ledger_deposit(1, 777, "Clock test", &ticket);
+    wait_for_settlement(ticket);
+    clock_shift = 0;
+    
+    bool same = statement_read(&c, after, NULL) == 20;
+    for (int i = 0; same && i < 20; i++) {
+        same = after[i].amount == before[i].amount && after[i].timestamp == before[i].timestamp;
+    }
+    failures += check(same, "open page holds still");
+    failures += check(statement_newer(&c) && statement_read(&c, after, NULL) == 1 && after[0].amount == 777,
+                      "the back-dated row is the next one");
+    failures += check(rows_between(1, then - 60, then + 60) == 1, "date range finds the back-dated row");
+    failures += check(rows_between(1, time(NULL) - 3600, time(NULL) + 3600) == HISTORY_CHUNK_ROWS * 2 + 1,
+                      "date range finds the rows settled before it");
+    shutdown_system();
+    return failures;
+}
+
+int rows_between(int farmer_id, int64_t start, int64_t end) {
+    // Reads a date range the way the statement screen does
+    Farmer* f = farmer_at(find_farmer_index(farmer_id));
+    Ledger* l = farmer_ledger(f);
+    pthread_rwlock_rdlock(&l->lock);
+    int first, found = 0;
+    int span = history_range(f, start, end, &first);
+    for (int i = first; i < first + span; i++) {
+        int64_t when = l->timestamp[f->history[i]];
+        if (when >= start && when <= end) found++;
+    }
+    pthread_rwlock_unlock(&l->lock);
+    return found;
+}
+
+bool test_history_chunks() {
+    return run_phase(ranges_at_chunk_edges) == 0;
+}
+
+int ranges_at_chunk_edges() {
+    // Farmer 1's opening deposit and then one deposit a day fill exactly two chunks,
+    // then one more starts a third. Ranges that begin or end on the first and last
+    // entry of a chunk must find exactly those entries.
+    if (!started()) return 1;
+    uint64_t ticket = 0;
+    for (int i = 1; i < HISTORY_CHUNK_ROWS * 2; i++) {
+        clock_shift = (long long)i * 24 * 3600;
+        ledger_deposit(1, 100, "Chunk test", &ticket);
+        wait_for_settlement(ticket);
+    }
+    
+    int last = HISTORY_CHUNK_ROWS * 2 - 1;
+    int edge = HISTORY_CHUNK_ROWS;     // First entry of the second chunk
+    int failures = range_is(1, history_time(1, 0), history_time(1, 0), 0, 1, "first entry of the first chunk");
+    failures += range_is(1, history_time(1, edge - 1), history_time(1, edge - 1), edge - 1, 1, "last entry of the first chunk");
+    failures += range_is(1, history_time(1, edge), history_time(1, edge), edge, 1, "first entry of the second chunk");
+    failures += range_is(1, history_time(1, edge - 1), history_time(1, edge), edge - 1, 2, "range across the boundary");
+    failures += range_is(1, history_time(1, edge - 1) + 1, history_time(1, edge) - 1, last + 1, 0, "gap between the chunks");
+    failures += range_is(1, history_time(1, last), history_time(1, last), last, 1, "last entry of the last chunk");
+    failures += range_is(1, history_time(1, 0), history_time(1, last), 0, last + 1, "whole history");
+    failures += range_is(1, history_time(1, 0) - 3600, history_time(1, 0) - 1, last + 1, 0, "range before the first entry");
+    failures += range_is(1, history_time(1, last) + 1, history_time(1, last) + 3600, last + 1, 0, "range after the last entry");
+    
+    // A third chunk holding a single entry
+    clock_shift = (long long)(last + 1) * 24 * 3600;
+    ledger_deposit(1, 100, "Chunk test", &ticket);
+    wait_for_settlement(ticket);
+    clock_shift = 0;
+    last++;
+    failures += range_is(1, history_time(1, last), history_time(1, last), last, 1, "only entry of a new chunk");
+    failures += range_is(1, history_time(1, last - 1) + 1, history_time(1, last) + 3600, last, 1, "range reaching into the new chunk");
+    shutdown_system();
+    return failures;
+}
+
+int64_t history_time(int farmer_id, int position) {
+    // Timestamp of the account's history entry at position
+    Farmer* f = farmer_at(find_farmer_index(farmer_id));
+    Ledger* l = farmer_ledger(f);
+    pthread_rwlock_rdlock(&l->lock);
+    int64_t when = l->timestamp[f->history[position]];
+    pthread_rwlock_unlock(&l->lock);
+    return when;
+}
+
+int range_is(int farmer_id, int64_t start, int64_t end, int want_first, int want_span, const char* what) {
+    // 1 unless history_range() returns exactly the run want_first, want_span entries long
+    Farmer* f = farmer_at(find_farmer_index(farmer_id));
+    Ledger* l = farmer_ledger(f);
+    pthread_rwlock_rdlock(&l->lock);
+    int first;
+    int span = history_range(f, start, end, &first);
+    pthread_rwlock_unlock(&l->lock);
+    if (first == want_first && span == want_span) return 0;
+    fprintf(stderr, "   ❌ %s: entries %d..%d, expected %d..%d\n", what, first, first + span, want_first, want_first + want_span);
+    return 1;
+}
+
+bool test_accrual_rerun() {
+    // Closing a period again must pay nothing, whatever the rate, text or restart in between.
+    // A close cut short by a crash is finished by the rerun in just the shards it missed.
+    if (run_phase(close_twice) != 0 || run_phase(rerun_after_restart) != 0) return false;
+    remove(SNAPSHOT_FILE);
+    if (run_phase(rerun_after_restart) != 0) return false;
+    
+    // The crash tears farmer 1's shard's write, taking its credits and its 'P' record
+    if (run_phase(close_then_crash) != 128 + SIGKILL) return false;
+    char path[256];
+    journal_path(path, sizeof(path), 1);
+    long long size = file_size(path);
+    if (truncate(path, (off_t)(size - (long long)sizeof(JournalRecord) * 3 / 2)) == -1) return false;
+    return run_phase(rerun_finishes_close) == 0;
+}
+
+money_t accrue(int64_t rate, int32_t period, const char* description, AccrualSummary* summary) {
+    // Total credited, or -1 if the close was refused
+    return ledger_accrue(rate, period, description, summary) == LEDGER_OK ? summary->total : -1;
+}
+
+int close_twice() {
+    if (!started()) return 1;
+    int members[1];
+    open_members(members, 0);
+    uint64_t ticket = 0;
+    for (int id = 6; id <= TEST_MEMBERS + 5; id++) {
+        ledger_deposit(id, 100000, "Savings", &ticket);
+    }
+    // A member's own row with the close's text must not stand in for the close
+    ledger_deposit(6, 100, "Interest 2026-10", &ticket);
+    // $1.2 million earns exactly $1000 a month at 1% a year; a rate cut to a whole
+    // number of billionths per month would pay a cent less
+    ledger_deposit(1, 120000000 - TEST_OPENING_BALANCE, "Savings", &ticket);
+    wait_for_settlement(ticket);
+    
+    AccrualSummary summary;
+    int failures = check(accrue(TEST_RATE, TEST_PERIOD, "Interest 2026-10", &summary) > 0, "first close pays");
+    failures += check(balance_of(1) == 120000000 + 100000, "a twelfth of the annual rate, to the cent");
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        failures += check(!summary.already_closed[s] && summary.shard_accounts[s] > 0, "every shard is paid");
+    }
+    money_t total = stats_snapshot().total_balance;
+    failures += check(accrue(TEST_RATE * 2, TEST_PERIOD, "Interest again", &summary) == 0, "rerun at another rate pays nothing");
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        failures += check(summary.already_closed[s], "every shard is skipped");
+    }
+    failures += check(accrue(TEST_RATE, TEST_PERIOD - 1, "Interest 2026-09", &summary) == 0, "an older period is closed too");
+    failures += check(stats_snapshot().total_balance == total, "no money moved");
+    failures += conserved();
+    shutdown_system();
+    return failures;
+}
+
+int rerun_after_restart() {
+    // The close is remembered by the snapshot, or by the journal without one
+    if (!started()) return 1;
+    money_t total = stats_snapshot().total_balance;
+    AccrualSummary summary;
+    int failures = check(accrue(TEST_RATE, TEST_PERIOD, "Interest 2026-10", &summary) == 0, "rerun after restart pays nothing");
+    failures += check(stats_snapshot().total_balance == total, "no money moved");
+    shutdown_system();
+    return failures;
+}
+
+int close_then_crash() {
+    if (!started()) return 1;
+    AccrualSummary summary;
+    int failures = check(accrue(TEST_RATE, TEST_PERIOD + 1, "Interest 2026-11", &summary) > 0, "next period pays");
+    
+    FILE* fp = fopen(TEST_BALANCES, "wb");
+    for (int i = 0; fp != NULL && i < num_farmers; i++) {
+        money_t balance = farmer_at(i)->balance;
+        fwrite(&balance, sizeof(balance), 1, fp);
+    }
+    failures += check(fp != NULL && fclose(fp) == 0, "balances saved");
+    if (failures > 0) return failures;
+    raise(SIGKILL);
+    return 1;
+}
+
+int rerun_finishes_close() {
+    if (!started()) return 1;
+    int torn = shard_of(1);
+    int failures = 0;
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        failures += check(shards[s].closed_period == (s == torn ? TEST_PERIOD : TEST_PERIOD + 1),
+                          "only the torn shard lost its close");
+    }
+    AccrualSummary summary;
+    failures += check(accrue(TEST_RATE, TEST_PERIOD + 1, "Interest 2026-11", &summary) > 0, "rerun pays");
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        failures += check(summary.already_closed[s] == (s != torn), "rerun skips the shards that closed");
+    }
+    
+    // Everyone ends up paid exactly once, as if there had been no crash
+    long long size;
+    char* data = read_file(TEST_BALANCES, &size);
+    failures += check(size == (long long)num_farmers * (long long)sizeof(money_t), "same accounts");
+    for (int i = 0; i < num_farmers && failures == 0; i++) {
+        money_t expected;
+        memcpy(&expected, data + (size_t)i * sizeof(money_t), sizeof(expected));
+        failures += check(farmer_at(i)->balance == expected, "balance matches an uninterrupted close");
+    }
+    free(data);
+    failures += conserved();
+    shutdown_system();
+    return failures;
+}
+
+bool test_batch_crash() {
+    // A batch that touches three shards, killed before and after its write is durable. The
+    // second crash also loses the debit another shard had journaled from the hand-over.
+    if (run_phase(batch_held_then_crash) != 128 + SIGKILL || run_phase(batch_never_applied) != 0) return false;
+    if (run_phase(batch_settled_then_crash) != 128 + SIGKILL) return false;
+    int x, z;
+    batch_members(&x, &z);
+    char path[256];
+    journal_path(path, sizeof(path), z);
+    long long size = file_size(path);
+    if (truncate(path, (off_t)(size - (long long)sizeof(JournalRecord))) == -1) return false;
+    return run_phase(batch_finished) == 0 && run_phase(batch_row_limit) == 0;
+}
+
+void batch_members(int* x, int* z) {
+    // Two members outside farmer 1's shard and outside each other's
+    *x = -1;
+    *z = -1;
+    for (int farmer_id = 6; farmer_id <= TEST_MEMBERS + 5; farmer_id++) {
+        int s = shard_of(farmer_id);
+        if (*z == -1 && s != shard_of(1)) *z = farmer_id;
+        if (*x == -1 && s != shard_of(1) && *z != -1 && s != shard_of(*z)) *x = farmer_id;
+    }
+}
+
+LedgerStatus apply_test_batch(money_t debit, int* failed_entry) {
+    // x spends a credit from earlier in the same batch; z is debited in its own shard
+    int x, z;
+    batch_members(&x, &z);
+    BatchEntry entries[] = {
+        { .farmer_id = 1, .to_id = x, .amount = 500, .type = 'T', .description = "batch" },
+        { .farmer_id = x, .amount = 1000, .type = 'D', .description = "Bulk credit" },
+        { .farmer_id = x, .amount = 1000, .type = 'W', .description = "Bulk debit" },
+        { .farmer_id = z, .amount = debit, .type = 'W', .description = "Bulk debit" },
+    };
+    return ledger_apply_batch(entries, 4, failed_entry, NULL);
+}
+
+int batch_held_then_crash() {
+    if (!started()) return 1;
+    int members[1];
+    open_members(members, 0);
+    int x, z;
+    batch_members(&x, &z);
+    uint64_t ticket = 0;
+    int failures = check(x != -1 && z != -1, "members in two other shards");
+    failures += check(ledger_deposit(z, 5000, "Savings", &ticket) == LEDGER_OK, "deposit accepted");
+    wait_for_settlement(ticket);
+    
+    int failed_entry = -1;
+    failures += check(apply_test_batch(6000, &failed_entry) == LEDGER_INSUFFICIENT_FUNDS && failed_entry == 3,
+                      "batch with one bad entry is refused");
+    failures += check(balance_of(1) == TEST_OPENING_BALANCE && balance_of(x) == 0 && balance_of(z) == 5000,
+                      "refused batch changes nothing");
+    
+    // Stalls farmer 1's worker before the batch is written, as in test_cross_shard_crash()
+    Journal* journal = &shards[shard_of(1)].journal;
+    pthread_mutex_lock(&journal->lock);
+    failures += check(apply_test_batch(2000, &failed_entry) == LEDGER_OK, "batch accepted");
+    failures += check(balance_of(1) == TEST_OPENING_BALANCE - 500 && balance_of(z) == 3000,
+                      "debits are taken at once");
+    failures += check(balance_of(x) == 0 && farmer_at(find_farmer_index(x))->incoming == 500,
+                      "net credit to another shard is held");
+    if (failures > 0) return failures;
+    raise(SIGKILL);
+    return 1;
+}
+
+int batch_never_applied() {
+    if (!started()) return 1;
+    int x, z;
+    batch_members(&x, &z);
+    int failures = check(balance_of(1) == TEST_OPENING_BALANCE && balance_of(x) == 0 && balance_of(z) == 5000,
+                         "no entry of the lost batch survives");
+    failures += conserved();
+    shutdown_system();
+    return failures;
+}
+
+int batch_settled_then_crash() {
+    if (!started()) return 1;
+    int failures = check(apply_test_batch(2000, NULL) == LEDGER_OK, "batch accepted");
+    settle_all();
+    if (failures > 0) return failures;
+    raise(SIGKILL);
+    return 1;
+}
+
+int batch_finished() {
+    // z's shard lost the debit it was handed; replay finds the 'H' record and posts it again
+    if (!started()) return 1;
+    int x, z;
+    batch_members(&x, &z);
+    int failures = check(balance_of(1) == TEST_OPENING_BALANCE - 500 && balance_of(x) == 500 && balance_of(z) == 3000,
+                         "every entry of the batch survives");
+    failures += conserved();
+    shutdown_system();
+    return failures;
+}
+
+int batch_row_limit() {
+    // BULK_MAX_LEGS limits rows, and each transfer makes two: one entry too many is refused
+    if (!started()) return 1;
+    int count = BULK_MAX_LEGS / 2 + 1;
+    BatchEntry* entries = (BatchEntry*)malloc((size_t)count * sizeof(BatchEntry));
+    if (entries == NULL) return 1;
+    for (int i = 0; i < count; i++) {
+        entries[i] = (BatchEntry){ .farmer_id = 1, .to_id = 2, .amount = 1, .type = 'T', .description = "limit" };
+    }
+    uint64_t ticket = 0;
+    ledger_deposit(1, count, "Covers the limit batch", &ticket);
+    wait_for_settlement(ticket);
+    money_t before = balance_of(1);
+    int failed_entry = -1;
+    int failures = check(ledger_apply_batch(entries, count, &failed_entry, NULL) == LEDGER_INVALID_AMOUNT,
+                         "batch over the row limit refused");
+    failures += check(failed_entry == count - 1, "the entry that crossed the limit is named");
+    failures += check(balance_of(1) == before, "nothing applied");
+    failures += check(ledger_apply_batch(entries, count - 1, &failed_entry, NULL) == LEDGER_OK,
+                      "a batch of exactly BULK_MAX_LEGS rows is taken");
+    settle_all();
+    failures += check(balance_of(1) == before - (count - 1), "and applied");
+    free(entries);
+    shutdown_system();
+    return failures;
+}